@@ -34,6 +34,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 #include "Project.H"
 #include "ExtraMath.H"
 #include "Stroke.H"
+#include "Threads.H"
 #include "Tool.H"
 #include "View.H"
 
@@ -101,6 +102,277 @@ namespace
     else
       return false;
   }
+
+  // separable resampling
+  //
+  // each output row/column is a weighted sum of nearby source pixels,
+  // the weights (14-bit fixed point, summing to one) are worked out once
+  // per axis, when shrinking the filter is widened by the scale factor
+  // so every source pixel contributes
+  const int weight_bits = 14;
+
+  struct weights_type
+  {
+    int taps;
+    std::vector<int> index;
+    std::vector<int> weight;
+  };
+
+  double filterRadius(int filter)
+  {
+    switch(filter)
+    {
+      case Bitmap::SCALE_BOX:
+        return 0.5;
+      case Bitmap::SCALE_BILINEAR:
+        return 1.0;
+      case Bitmap::SCALE_LANCZOS:
+        return 3.0;
+      default:
+        return 2.0;
+    }
+  }
+
+  double cubic(double x, double b, double c)
+  {
+    x = std::fabs(x);
+
+    if(x < 1)
+    {
+      return ((12 - 9 * b - 6 * c) * x * x * x
+              + (-18 + 12 * b + 6 * c) * x * x + (6 - 2 * b)) / 6;
+    }
+    else if(x < 2)
+    {
+      return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x
+              + (-12 * b - 48 * c) * x + (8 * b + 24 * c)) / 6;
+    }
+
+    return 0;
+  }
+
+  double sinc(double x)
+  {
+    if(x == 0)
+      return 1;
+
+    x *= M_PI;
+
+    return std::sin(x) / x;
+  }
+
+  double filterValue(int filter, double x)
+  {
+    switch(filter)
+    {
+      case Bitmap::SCALE_BOX:
+        return (x >= -0.5 && x < 0.5) ? 1 : 0;
+      case Bitmap::SCALE_BILINEAR:
+        return std::max(0.0, 1 - std::fabs(x));
+      case Bitmap::SCALE_BICUBIC:
+        return cubic(x, 0, 0.5);
+      case Bitmap::SCALE_MITCHELL:
+        return cubic(x, 1.0 / 3, 1.0 / 3);
+      case Bitmap::SCALE_LANCZOS:
+        return std::fabs(x) < 3 ? sinc(x) * sinc(x / 3) : 0;
+      default:
+        return 0;
+    }
+  }
+
+  void makeWeights(weights_type *weights, int src_size, int dest_size,
+                   int filter, bool wrap)
+  {
+    const double scale = (double)src_size / dest_size;
+    const double stretch = std::max(scale, 1.0);
+    const double support = filterRadius(filter) * stretch;
+
+    weights->taps = (int)std::ceil(support * 2) + 1;
+    weights->index.assign(dest_size * weights->taps, 0);
+    weights->weight.assign(dest_size * weights->taps, 0);
+
+    std::vector<double> value(weights->taps);
+
+    for(int i = 0; i < dest_size; i++)
+    {
+      const double center = (i + 0.5) * scale;
+      const int first = (int)std::floor(center - support + 0.5);
+      int *index = &weights->index[i * weights->taps];
+      int *weight = &weights->weight[i * weights->taps];
+      double sum = 0;
+
+      for(int j = 0; j < weights->taps; j++)
+      {
+        value[j] = filterValue(filter, (first + j + 0.5 - center) / stretch);
+        sum += value[j];
+      }
+
+      // can happen with the box filter when enlarging
+      if(sum == 0)
+      {
+        value[(int)(center - first)] = 1;
+        sum = 1;
+      }
+
+      int total = 0;
+      int largest = 0;
+
+      for(int j = 0; j < weights->taps; j++)
+      {
+        int s = first + j;
+
+        if(wrap)
+          s = ((s % src_size) + src_size) % src_size;
+        else
+          s = std::min(std::max(s, 0), src_size - 1);
+
+        index[j] = s;
+        weight[j] = (int)std::floor(value[j] / sum * (1 << weight_bits) + 0.5);
+        total += weight[j];
+
+        if(std::abs(weight[j]) > std::abs(weight[largest]))
+          largest = j;
+      }
+
+      // rounding leftovers
+      weight[largest] += (1 << weight_bits) - total;
+    }
+  }
+
+  // source and destination of the two passes, the intermediate image
+  // is kept in linear light as 16 bits per channel
+  struct resample_type
+  {
+    Bitmap *src;
+    Bitmap *dest;
+    const weights_type *wx;
+    const weights_type *wy;
+    std::vector<unsigned short> *temp;
+  };
+
+  void resampleRows(int first, int last, int, void *data)
+  {
+    const resample_type *job = (resample_type *)data;
+    const Bitmap *src = job->src;
+    const weights_type *wx = job->wx;
+    const int dw = job->dest->cw;
+    const int taps = wx->taps;
+    std::vector<int> line(src->cw * 4);
+
+    for(int y = first; y <= last; y++)
+    {
+      const int *s = src->row[src->ct + y] + src->cl;
+
+      for(int x = 0; x < src->cw; x++)
+      {
+        const rgba_type rgba = getRgba(s[x]);
+
+        line[x * 4 + 0] = Gamma::fix(rgba.r);
+        line[x * 4 + 1] = Gamma::fix(rgba.g);
+        line[x * 4 + 2] = Gamma::fix(rgba.b);
+        line[x * 4 + 3] = rgba.a * 257;
+      }
+
+      unsigned short *d = &(*job->temp)[(size_t)y * dw * 4];
+
+      for(int x = 0; x < dw; x++)
+      {
+        const int *index = &wx->index[x * taps];
+        const int *weight = &wx->weight[x * taps];
+        int sum[4] = { 0, 0, 0, 0 };
+
+        for(int j = 0; j < taps; j++)
+        {
+          const int *c = &line[index[j] * 4];
+
+          sum[0] += c[0] * weight[j];
+          sum[1] += c[1] * weight[j];
+          sum[2] += c[2] * weight[j];
+          sum[3] += c[3] * weight[j];
+        }
+
+        for(int i = 0; i < 4; i++)
+        {
+          const int v = (sum[i] + (1 << (weight_bits - 1))) >> weight_bits;
+
+          d[x * 4 + i] = clamp(v, 65535);
+        }
+      }
+    }
+  }
+
+  void resampleColumns(int first, int last, int, void *data)
+  {
+    const resample_type *job = (resample_type *)data;
+    Bitmap *dest = job->dest;
+    const weights_type *wy = job->wy;
+    const int dw = dest->cw;
+    const int taps = wy->taps;
+    std::vector<int> sum(dw * 4);
+
+    for(int y = first; y <= last; y++)
+    {
+      const int *index = &wy->index[y * taps];
+      const int *weight = &wy->weight[y * taps];
+
+      std::fill(sum.begin(), sum.end(), 0);
+
+      // one source row at a time, so memory is read in order
+      for(int j = 0; j < taps; j++)
+      {
+        const unsigned short *s = &(*job->temp)[(size_t)index[j] * dw * 4];
+        const int w = weight[j];
+
+        for(int i = 0; i < dw * 4; i++)
+          sum[i] += s[i] * w;
+      }
+
+      int *d = dest->row[dest->ct + y] + dest->cl;
+
+      for(int x = 0; x < dw; x++)
+      {
+        int v[4];
+
+        for(int i = 0; i < 4; i++)
+        {
+          v[i] = (sum[x * 4 + i] + (1 << (weight_bits - 1))) >> weight_bits;
+          v[i] = clamp(v[i], 65535);
+        }
+
+        d[x] = makeRgba(Gamma::unfix(v[0]), Gamma::unfix(v[1]),
+                        Gamma::unfix(v[2]), (v[3] + 128) / 257);
+      }
+    }
+  }
+
+  // runs one pass a batch of rows at a time so progress can be shown
+  // in between, rows are reported to progress starting at base,
+  // returns false if the user cancelled
+  bool resampleBatches(void (*func)(int, int, int, void *),
+                       int rows, int width, int base,
+                       resample_type *job, int (*progress)(const int))
+  {
+    if(!progress)
+    {
+      Threads::run(func, 0, rows - 1, job);
+      return true;
+    }
+
+    const int batch = std::max(16, (1 << 18) / std::max(width, 1));
+
+    for(int y = 0; y < rows; y += batch)
+    {
+      const int y2 = std::min(y + batch, rows) - 1;
+
+      Threads::run(func, y, y2, job);
+
+      for(int i = y; i <= y2; i++)
+        if(progress(base + i) < 0)
+          return false;
+    }
+
+    return true;
+  }
 }
 
 // creates bitmap
@@ -827,7 +1099,8 @@ void Bitmap::drawBrush(Bitmap *dest,
 void Bitmap::pointStretch(Bitmap *dest,
                           int sx, int sy, int sw, int sh,
                           int dx, int dy, int dw, int dh,
-                          int overx, int overy, bool bgr_order)
+                          int overx, int overy, bool bgr_order,
+                          Map *indices, const int *lut)
 {
   Palette *pal = Project::palette.get();
 
@@ -885,10 +1158,20 @@ void Bitmap::pointStretch(Bitmap *dest,
     const int y1 = sy + ((y * by) >> 8);
     int *p = dest->row[dy + y] + dx;
 
+    // indexed images show the clipped area through the palette
+    const unsigned char *index = 0;
+
+    if(indices && y1 >= ct && y1 <= cb)
+      index = indices->row[y1];
+
     for(int x = 0; x < dw; x++)
     {
       const int x1 = sx + ((x * bx) >> 8);
-      const int c = *(row[y1] + x1);
+      int c = *(row[y1] + x1);
+
+      if(index && x1 >= cl && x1 <= cr)
+        c = lut[index[x1]] | (c & 0xFF000000);
+
       // generate checkboard pattern for transparent areas
       const int checker = ((x >> 4) & 1) ^ ((y >> 4) & 1) ? 0xA0A0A0 : 0x606060;
 
@@ -923,27 +1206,24 @@ void Bitmap::flipVertical()
   }
 }
 
+// rotates clockwise, a transpose followed by a horizontal flip
 void Bitmap::rotate90()
 {
-  const int tw = w;
-  const int th = h;
+  int *temp = new int [w * h];
 
-  // make copy
-  Bitmap temp(tw, th);
-  blit(&temp, 0, 0, 0, 0, tw, th);
+  ExtraMath::transpose(data, temp, w, h);
+  std::swap(w, h);
+
+  delete[] row;
+  delete[] data;
 
-  // re-allocate a rotated bitmap
-  free(this);
-  new Bitmap(th, tw);
+  data = temp;
+  row = new int *[h];
 
-  for(int yy = 0; yy < tw; yy++)
-  {
-    for(int xx = 0; xx < th; xx++)
-    {
-      *(row[yy] + xx) = *(temp.row[xx] + yy);
-    }
-  }
+  for(int i = 0; i < h; i++)
+    row[i] = &data[w * i];
 
+  flipHorizontal();
   setClip(overscroll, overscroll, w - overscroll - 1, h - overscroll - 1);
 }
 
@@ -1024,99 +1304,40 @@ void Bitmap::fastStretch(Bitmap *dest,
   }
 }
 
-// scales an image with bilinear filtering and gamma-correction
-void Bitmap::scale(Bitmap *dest)
+// scales the clipped area to fill the clipped area of dest, in linear
+// light, with one of the SCALE_* filters, wrap takes samples past the
+// edges from the other side (for tiles)
+//
+// if progress is given it is called with rows 0 to ch + dest->ch - 1,
+// returns false if it cancelled (dest is left partly drawn)
+bool Bitmap::scale(Bitmap *dest, int filter, bool wrap,
+                   int (*progress)(const int))
 {
-  const int sx = cl;
-  const int sy = ct;
-  const int sw = cw;
-  const int sh = ch;
-  const int dx = dest->cl;
-  const int dy = dest->ct;
-  const int dw = dest->cw;
-  const int dh = dest->ch;
-
-  const float ax = ((float)sw / dw);
-  const float ay = ((float)sh / dh);
+  if(cw < 1 || ch < 1)
+    return true;
 
-  if(sw < 1 || sh < 1)
-    return;
+  if(dest->cw < 1 || dest->ch < 1)
+    return true;
 
-  if(dw < 1 || dh < 1)
-    return;
+  weights_type wx, wy;
 
-  for(int y = 0; y < dh; y++) 
-  {
-    int *d = dest->row[dy + y] + dx;
-    const float vv = (y * ay);
-    const int v1 = vv;
-    const float v = vv - v1;
-
-    if(sy + v1 >= h - 1)
-      break;
-
-    int v2 = v1 + 1;
+  makeWeights(&wx, cw, dest->cw, filter, wrap);
+  makeWeights(&wy, ch, dest->ch, filter, wrap);
 
-    if(v2 >= sh)
-    {
-      v2--;
-    }
+  std::vector<unsigned short> temp((size_t)dest->cw * ch * 4);
+  resample_type job;
 
-    int *c[4];
-    c[0] = c[1] = row[sy + v1] + sx;
-    c[2] = c[3] = row[sy + v2] + sx;
-
-    for(int x = 0; x < dw; x++) 
-    {
-      const float uu = (x * ax);
-      const int u1 = uu;
-      const float u = uu - u1;
+  job.src = this;
+  job.dest = dest;
+  job.wx = &wx;
+  job.wy = &wy;
+  job.temp = &temp;
 
-      if(sx + u1 >= w - 1)
-        break;
-
-      int u2 = u1 + 1;
-
-      if(u2 >= sw)
-      {
-        u2--;
-      }
-
-      c[0] += u1;
-      c[1] += u2;
-      c[2] += u1;
-      c[3] += u2;
-
-      float f[4];
-
-      f[0] = (1.0f - u) * (1.0f - v);
-      f[1] = u * (1.0f - v);
-      f[2] = (1.0f - u) * v;
-      f[3] = u * v;
-
-      float r = 0.0f, g = 0.0f, b = 0.0f, a = 0.0f;
-
-      for(int i = 0; i < 4; i++)
-      {
-        rgba_type rgba = getRgba(*c[i]);
-        r += (float)Gamma::fix(rgba.r) * f[i];
-        g += (float)Gamma::fix(rgba.g) * f[i];
-        b += (float)Gamma::fix(rgba.b) * f[i];
-        a += rgba.a * f[i];
-      }
-
-      r = Gamma::unfix((int)r);
-      g = Gamma::unfix((int)g);
-      b = Gamma::unfix((int)b);
-
-      *d++ = makeRgba((int)r, (int)g, (int)b, (int)a);
+  if(!resampleBatches(resampleRows, ch, cw, 0, &job, progress))
+    return false;
 
-      c[0] -= u1;
-      c[1] -= u2;
-      c[2] -= u1;
-      c[3] -= u2;
-    }
-  }
+  return resampleBatches(resampleColumns, dest->ch, dest->cw, ch,
+                         &job, progress);
 }
 
 void Bitmap::invert()
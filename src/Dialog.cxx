@@ -328,10 +328,19 @@ namespace MakePalette
   {
     DialogWindow *dialog;
     InputInt *colors;
+    Fl_Choice *method;
+    CheckBox *refine;
     Fl_Button *ok;
     Fl_Button *cancel;
   }
 
+  enum
+  {
+    PAIRWISE,
+    WU,
+    MEDIAN_CUT
+  };
+
   void begin()
   {
     char s[8];
@@ -343,7 +352,24 @@ namespace MakePalette
   void close()
   {
     Items::dialog->hide();
-    Quantize::pca(Project::bmp, Project::palette.get(), atoi(Items::colors->value()));
+
+    const int colors = atoi(Items::colors->value());
+
+    switch(Items::method->value())
+    {
+      case PAIRWISE:
+        Quantize::pca(Project::bmp, Project::palette.get(), colors);
+        break;
+      case WU:
+        Quantize::wu(Project::bmp, Project::palette.get(), colors);
+        break;
+      case MEDIAN_CUT:
+        Quantize::median(Project::bmp, Project::palette.get(), colors);
+        break;
+    }
+
+    if(Items::refine->value())
+      Quantize::refine(Project::bmp, Project::palette.get(), 16);
   }
 
   void quit()
@@ -359,6 +385,17 @@ namespace MakePalette
     Items::colors = new InputInt(Items::dialog, 0, 8, 96, 24, "Colors:", 0, 1, 256);
     Items::colors->center();
     y1 += 24 + 8;
+    Items::method = new Fl_Choice(64, y1, 128, 24, "");
+    Items::method->tooltip("Method");
+    Items::method->textsize(10);
+    Items::method->add("Pairwise Clustering");
+    Items::method->add("Wu");
+    Items::method->add("Median Cut");
+    Items::method->value(0);
+    y1 += 24 + 8;
+    Items::refine = new CheckBox(Items::dialog, 0, y1, 16, 16, "Refine (k-means)", 0);
+    Items::refine->center();
+    y1 += 16 + 8;
     Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
     Items::ok->callback((Fl_Callback *)close);
     Items::cancel->callback((Fl_Callback *)quit);
@@ -18,67 +18,716 @@ along with Rendera; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 */
 
+#include <algorithm>
 #include <cmath>
+#include <map>
+#include <vector>
+
+#include <pthread.h>
 
 #include "ExtraMath.H"
+#include "Threads.H"
 
-// fft routines adapted from those found here:
-// http://www.dspguide.com/ch12/3.htm
-void ExtraMath::forwardFFT(float *real, float *imag, int size)
+// mixed-radix fft based on the recursive decimation-in-time approach
+// used by kissfft, plans (factors and twiddle tables) are built once per
+// size and cached
+namespace
 {
-  int j = size / 2;
+  struct complex_type
+  {
+    float re, im;
+  };
+
+  struct plan_type
+  {
+    int size;
+    std::vector<int> factors;
+    std::vector<complex_type> twiddles;
+  };
+
+  std::map<int, plan_type> plans;
+  pthread_mutex_t plans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  inline complex_type mul(const complex_type &a, const complex_type &b)
+  {
+    complex_type c;
+
+    c.re = a.re * b.re - a.im * b.im;
+    c.im = a.re * b.im + a.im * b.re;
+
+    return c;
+  }
+
+  // returns the cached plan for a size, creating it if needed
+  const plan_type *getPlan(const int size)
+  {
+    pthread_mutex_lock(&plans_lock);
+
+    std::map<int, plan_type>::iterator i = plans.find(size);
+
+    if(i != plans.end())
+    {
+      pthread_mutex_unlock(&plans_lock);
+      return &i->second;
+    }
+
+    // map nodes never move, so the plan can be handed out directly
+    plan_type *plan = &plans[size];
+
+    plan->size = size;
+    plan->twiddles.resize(size);
+
+    for(int k = 0; k < size; k++)
+    {
+      const double phase = -2 * M_PI * k / size;
+
+      plan->twiddles[k].re = std::cos(phase);
+      plan->twiddles[k].im = std::sin(phase);
+    }
+
+    // store (radix, remaining size) pairs
+    int n = size;
+    const int radix[4] = { 4, 2, 3, 5 };
+
+    for(int r = 0; r < 4; r++)
+    {
+      while(n % radix[r] == 0)
+      {
+        n /= radix[r];
+        plan->factors.push_back(radix[r]);
+        plan->factors.push_back(n);
+      }
+    }
+
+    pthread_mutex_unlock(&plans_lock);
+
+    return plan;
+  }
+
+  void butterfly2(complex_type *out, const int stride,
+                  const plan_type *plan, const int m)
+  {
+    complex_type *out2 = out + m;
+    const complex_type *tw = &plan->twiddles[0];
+
+    for(int k = 0; k < m; k++)
+    {
+      const complex_type t = mul(out2[k], tw[k * stride]);
+
+      out2[k].re = out[k].re - t.re;
+      out2[k].im = out[k].im - t.im;
+      out[k].re += t.re;
+      out[k].im += t.im;
+    }
+  }
+
+  void butterfly3(complex_type *out, const int stride,
+                  const plan_type *plan, const int m)
+  {
+    const complex_type *tw = &plan->twiddles[0];
+    const float sin60 = -tw[stride * m].im;
+
+    for(int k = 0; k < m; k++)
+    {
+      const complex_type a1 = mul(out[k + m], tw[k * stride]);
+      const complex_type a2 = mul(out[k + m * 2], tw[k * stride * 2]);
+      const float sr = a1.re + a2.re;
+      const float si = a1.im + a2.im;
+      const float dr = (a1.re - a2.re) * sin60;
+      const float di = (a1.im - a2.im) * sin60;
+      const float tr = out[k].re - sr / 2;
+      const float ti = out[k].im - si / 2;
+
+      out[k].re += sr;
+      out[k].im += si;
+      out[k + m].re = tr + di;
+      out[k + m].im = ti - dr;
+      out[k + m * 2].re = tr - di;
+      out[k + m * 2].im = ti + dr;
+    }
+  }
+
+  void butterfly4(complex_type *out, const int stride,
+                  const plan_type *plan, const int m)
+  {
+    const complex_type *tw = &plan->twiddles[0];
+
+    for(int k = 0; k < m; k++)
+    {
+      const complex_type a1 = mul(out[k + m], tw[k * stride]);
+      const complex_type a2 = mul(out[k + m * 2], tw[k * stride * 2]);
+      const complex_type a3 = mul(out[k + m * 3], tw[k * stride * 3]);
+      const float s0r = out[k].re + a2.re;
+      const float s0i = out[k].im + a2.im;
+      const float d0r = out[k].re - a2.re;
+      const float d0i = out[k].im - a2.im;
+      const float s1r = a1.re + a3.re;
+      const float s1i = a1.im + a3.im;
+      const float d1r = a1.re - a3.re;
+      const float d1i = a1.im - a3.im;
+
+      out[k].re = s0r + s1r;
+      out[k].im = s0i + s1i;
+      out[k + m].re = d0r + d1i;
+      out[k + m].im = d0i - d1r;
+      out[k + m * 2].re = s0r - s1r;
+      out[k + m * 2].im = s0i - s1i;
+      out[k + m * 3].re = d0r - d1i;
+      out[k + m * 3].im = d0i + d1r;
+    }
+  }
+
+  void butterfly5(complex_type *out, const int stride,
+                  const plan_type *plan, const int m)
+  {
+    const complex_type *tw = &plan->twiddles[0];
+    const complex_type ya = tw[stride * m];
+    const complex_type yb = tw[stride * m * 2];
+
+    for(int k = 0; k < m; k++)
+    {
+      const complex_type a0 = out[k];
+      const complex_type a1 = mul(out[k + m], tw[k * stride]);
+      const complex_type a2 = mul(out[k + m * 2], tw[k * stride * 2]);
+      const complex_type a3 = mul(out[k + m * 3], tw[k * stride * 3]);
+      const complex_type a4 = mul(out[k + m * 4], tw[k * stride * 4]);
+      const float s14r = a1.re + a4.re, s14i = a1.im + a4.im;
+      const float d14r = a1.re - a4.re, d14i = a1.im - a4.im;
+      const float s23r = a2.re + a3.re, s23i = a2.im + a3.im;
+      const float d23r = a2.re - a3.re, d23i = a2.im - a3.im;
+
+      const float b1r = a0.re + s14r * ya.re + s23r * yb.re;
+      const float b1i = a0.im + s14i * ya.re + s23i * yb.re;
+      const float c1r = d14i * ya.im + d23i * yb.im;
+      const float c1i = -(d14r * ya.im + d23r * yb.im);
+      const float b2r = a0.re + s14r * yb.re + s23r * ya.re;
+      const float b2i = a0.im + s14i * yb.re + s23i * ya.re;
+      const float c2r = -d14i * yb.im + d23i * ya.im;
+      const float c2i = d14r * yb.im - d23r * ya.im;
+
+      out[k].re = a0.re + s14r + s23r;
+      out[k].im = a0.im + s14i + s23i;
+      out[k + m].re = b1r - c1r;
+      out[k + m].im = b1i - c1i;
+      out[k + m * 4].re = b1r + c1r;
+      out[k + m * 4].im = b1i + c1i;
+      out[k + m * 2].re = b2r + c2r;
+      out[k + m * 2].im = b2i + c2i;
+      out[k + m * 3].re = b2r - c2r;
+      out[k + m * 3].im = b2i - c2i;
+    }
+  }
 
-  for(int i = 1; i <= size - 2; i++)
+  void work(complex_type *out, const complex_type *in, const int stride,
+            const int *factors, const plan_type *plan)
   {
-    if(i < j)
+    const int p = factors[0];
+    const int m = factors[1];
+    complex_type *begin = out;
+    const complex_type *end = out + p * m;
+
+    if(m == 1)
+    {
+      for(; out != end; out++, in += stride)
+        *out = *in;
+    }
+    else
+    {
+      for(; out != end; out += m, in += stride)
+        work(out, in, stride * p, factors + 2, plan);
+    }
+
+    switch(p)
     {
-      const float tr = real[j];
-      const float ti = imag[j];
-      real[j] = real[i];
-      imag[j] = imag[i];
-      real[i] = tr;
-      imag[i] = ti;
+      case 2:
+        butterfly2(begin, stride, plan, m);
+        break;
+      case 3:
+        butterfly3(begin, stride, plan, m);
+        break;
+      case 4:
+        butterfly4(begin, stride, plan, m);
+        break;
+      case 5:
+        butterfly5(begin, stride, plan, m);
+        break;
     }
+  }
+
+  // transforms in to out (must not overlap)
+  void execute(const plan_type *plan, const complex_type *in,
+               complex_type *out)
+  {
+    if(plan->size == 1)
+      out[0] = in[0];
+    else
+      work(out, in, 1, &plan->factors[0], plan);
+  }
 
-    int k = size / 2;
+  // forward transform of one row, buffers are 2 * size long
+  void forwardRow(float *real, float *imag, const int size,
+                  complex_type *buf)
+  {
+    complex_type *in = buf;
+    complex_type *out = buf + size;
 
-    while(k <= j)
+    for(int i = 0; i < size; i++)
     {
-      j -= k;
-      k /= 2;
+      in[i].re = real[i];
+      in[i].im = imag[i];
     }
 
-    j += k;
+    execute(getPlan(size), in, out);
+
+    for(int i = 0; i < size; i++)
+    {
+      real[i] = out[i].re;
+      imag[i] = out[i].im;
+    }
   }
 
-  for(int k = 1; k <= (int)(logf(size) / logf(2)); k++)
+  // forward transform of a real-valued row by packing it into a complex
+  // transform of half the size
+  void forwardRealRow(float *real, float *imag, const int size,
+                      complex_type *buf)
   {
-    const int le = (int)(powf(2, k));
-    const int le2 = le / 2;
+    if(size & 1)
+    {
+      for(int i = 0; i < size; i++)
+        imag[i] = 0;
+
+      forwardRow(real, imag, size, buf);
+      return;
+    }
 
-    float ur = 1;
-    float ui = 0;
-    float sr = cosf(M_PI / le2);
-    float si = -sinf(M_PI / le2);
+    const int half = size / 2;
+    complex_type *in = buf;
+    complex_type *out = buf + half;
+    const complex_type *tw = &getPlan(size)->twiddles[0];
 
-    for(int j = 1; j <= le2; j++)
+    for(int i = 0; i < half; i++)
     {
-      for(int i = j - 1; i < size; i += le)
+      in[i].re = real[i * 2];
+      in[i].im = real[i * 2 + 1];
+    }
+
+    execute(getPlan(half), in, out);
+
+    for(int k = 0; k <= half; k++)
+    {
+      const complex_type a = out[k % half];
+      const complex_type b = out[(half - k) % half];
+
+      // even and odd parts
+      const float er = (a.re + b.re) / 2;
+      const float ei = (a.im - b.im) / 2;
+      const float or_ = (a.im + b.im) / 2;
+      const float oi = -(a.re - b.re) / 2;
+
+      const float xr = er + or_ * tw[k % size].re - oi * tw[k % size].im;
+      const float xi = ei + or_ * tw[k % size].im + oi * tw[k % size].re;
+
+      real[k] = xr;
+      imag[k] = xi;
+
+      if(k > 0 && k < half)
+      {
+        real[size - k] = xr;
+        imag[size - k] = -xi;
+      }
+    }
+  }
+
+  // inverse transform of a row with a hermitian spectrum, only entries
+  // 0 to size / 2 are read, the real result (scaled by 1 / size) is
+  // written to real by packing it into a complex transform of half the size
+  void inverseRealRow(float *real, float *imag, const int size,
+                      complex_type *buf)
+  {
+    const int half = size / 2;
+
+    if(size & 1)
+    {
+      // conjugate the whole row, so the forward transform runs backwards
+      for(int k = half + 1; k < size; k++)
       {
-        const int ip = i + le2;
-        const float tr = real[ip] * ur - imag[ip] * ui;
-        const float ti = real[ip] * ui + imag[ip] * ur;
-        real[ip] = real[i] - tr;
-        imag[ip] = imag[i] - ti;
-        real[i] += tr;
-        imag[i] += ti;
+        real[k] = real[size - k];
+        imag[k] = imag[size - k];
       }
 
-      const float tr = ur;
-      ur = tr * sr - ui * si;
-      ui = tr * si + ui * sr;
+      for(int k = 0; k <= half; k++)
+        imag[k] = -imag[k];
+
+      forwardRow(real, imag, size, buf);
+
+      for(int i = 0; i < size; i++)
+        real[i] /= size;
+
+      return;
+    }
+
+    complex_type *in = buf;
+    complex_type *out = buf + half;
+    const complex_type *tw = &getPlan(size)->twiddles[0];
+
+    for(int k = 0; k < half; k++)
+    {
+      // even and odd parts
+      const float er = (real[k] + real[half - k]) / 2;
+      const float ei = (imag[k] - imag[half - k]) / 2;
+      const float dr = (real[k] - real[half - k]) / 2;
+      const float di = (imag[k] + imag[half - k]) / 2;
+      const float or_ = dr * tw[k].re + di * tw[k].im;
+      const float oi = di * tw[k].re - dr * tw[k].im;
+
+      // conjugated, so the forward transform runs backwards
+      in[k].re = er - oi;
+      in[k].im = -(ei + or_);
+    }
+
+    execute(getPlan(half), in, out);
+
+    for(int i = 0; i < half; i++)
+    {
+      real[i * 2] = out[i].re / half;
+      real[i * 2 + 1] = -out[i].im / half;
+    }
+  }
+
+  struct rows_type
+  {
+    float *real;
+    float *imag;
+    int w, h;
+    int cols;
+    bool real_input;
+  };
+
+  void forwardRows(int y1, int y2, int, void *data)
+  {
+    const rows_type *rows = (rows_type *)data;
+    const int w = rows->w;
+    std::vector<complex_type> buf(w * 2);
+
+    for(int y = y1; y <= y2; y++)
+    {
+      if(rows->real_input)
+        forwardRealRow(rows->real + w * y, rows->imag + w * y, w, &buf[0]);
+      else
+        forwardRow(rows->real + w * y, rows->imag + w * y, w, &buf[0]);
     }
   }
+
+  // last step of a real-output inverse, the first w / 2 + 1 entries of
+  // each row hold conjugated column transforms
+  void inverseRealRows(int y1, int y2, int, void *data)
+  {
+    const rows_type *rows = (rows_type *)data;
+    const int w = rows->w;
+    const int h = rows->h;
+    std::vector<complex_type> buf(w * 2);
+
+    for(int y = y1; y <= y2; y++)
+    {
+      float *real = rows->real + w * y;
+      float *imag = rows->imag + w * y;
+
+      for(int x = 0; x <= w / 2; x++)
+        imag[x] = -imag[x];
+
+      inverseRealRow(real, imag, w, &buf[0]);
+
+      for(int x = 0; x < w; x++)
+      {
+        real[x] /= h;
+        imag[x] = 0;
+      }
+    }
+  }
+
+  // column pass, the columns are done in strips which are gathered into
+  // complex rows, transformed and scattered back while still in cache
+  const int strip_size = 32;
+
+  void forwardColumns(int s1, int s2, int, void *data)
+  {
+    const rows_type *rows = (rows_type *)data;
+    const int w = rows->w;
+    const int h = rows->h;
+    const plan_type *plan = getPlan(h);
+    std::vector<complex_type> in(strip_size * h);
+    std::vector<complex_type> out(strip_size * h);
+
+    for(int s = s1; s <= s2; s++)
+    {
+      const int x1 = s * strip_size;
+      const int n = std::min(strip_size, rows->cols - x1);
+
+      for(int y = 0; y < h; y++)
+      {
+        const float *real = rows->real + w * y + x1;
+        const float *imag = rows->imag + w * y + x1;
+
+        for(int i = 0; i < n; i++)
+        {
+          in[h * i + y].re = real[i];
+          in[h * i + y].im = imag[i];
+        }
+      }
+
+      for(int i = 0; i < n; i++)
+        execute(plan, &in[h * i], &out[h * i]);
+
+      for(int y = 0; y < h; y++)
+      {
+        float *real = rows->real + w * y + x1;
+        float *imag = rows->imag + w * y + x1;
+
+        for(int i = 0; i < n; i++)
+        {
+          real[i] = out[h * i + y].re;
+          imag[i] = out[h * i + y].im;
+        }
+      }
+    }
+  }
+
+  // fills in columns w / 2 + 1 and up of a real input's spectrum,
+  // which mirror the others
+  void mirrorRows(int y1, int y2, int, void *data)
+  {
+    const rows_type *rows = (rows_type *)data;
+    const int w = rows->w;
+    const int h = rows->h;
+
+    for(int y = y1; y <= y2; y++)
+    {
+      float *real = rows->real + w * y;
+      float *imag = rows->imag + w * y;
+      const float *real2 = rows->real + w * ((h - y) % h);
+      const float *imag2 = rows->imag + w * ((h - y) % h);
+
+      for(int x = w / 2 + 1; x < w; x++)
+      {
+        real[x] = real2[w - x];
+        imag[x] = -imag2[w - x];
+      }
+    }
+  }
+
+  // replaces the first w / 2 + 1 columns of a spectrum with its hermitian
+  // part, whose inverse is the real part of the full inverse
+  // (rows y and h - y are done together)
+  void symmetrizeRows(int y1, int y2, int, void *data)
+  {
+    const rows_type *rows = (rows_type *)data;
+    const int w = rows->w;
+    const int h = rows->h;
+
+    for(int y = y1; y <= y2; y++)
+    {
+      float *real1 = rows->real + w * y;
+      float *imag1 = rows->imag + w * y;
+      float *real2 = rows->real + w * ((h - y) % h);
+      float *imag2 = rows->imag + w * ((h - y) % h);
+
+      for(int x = 0; x <= w / 2; x++)
+      {
+        const int x2 = (w - x) % w;
+        const float r1 = real1[x], i1 = imag1[x];
+        const float r2 = real2[x], i2 = imag2[x];
+
+        if(x2 == x)
+        {
+          // mirrors into the other row of the pair
+          real1[x] = (r1 + r2) / 2;
+          imag1[x] = (i1 - i2) / 2;
+          real2[x] = (r2 + r1) / 2;
+          imag2[x] = (i2 - i1) / 2;
+        }
+        else
+        {
+          // mirrors into a column that is never written
+          real1[x] = (r1 + real2[x2]) / 2;
+          imag1[x] = (i1 - imag2[x2]) / 2;
+
+          if(real2 != real1)
+          {
+            real2[x] = (r2 + real1[x2]) / 2;
+            imag2[x] = (i2 - imag1[x2]) / 2;
+          }
+        }
+      }
+    }
+  }
+
+  // cache-blocked transpose, the image is walked in 64x64 tiles and each
+  // tile in 8x8 blocks, which are read a row at a time into a small
+  // buffer and written back a row at a time (so both sides stream)
+  template <typename T>
+  struct transpose_type
+  {
+    const T *src;
+    T *dest;
+    int w, h;
+  };
+
+  const int tile_size = 64;
+  const int block_size = 8;
+
+  template <typename T>
+  void transposeTiles(int t1, int t2, int, void *data)
+  {
+    const transpose_type<T> *t = (transpose_type<T> *)data;
+    const int w = t->w;
+    const int h = t->h;
+
+    for(int y1 = t1 * tile_size; y1 <= t2 * tile_size && y1 < h;
+        y1 += tile_size)
+    {
+      const int y2 = std::min(y1 + tile_size, h);
+
+      for(int x1 = 0; x1 < w; x1 += tile_size)
+      {
+        const int x2 = std::min(x1 + tile_size, w);
+
+        for(int by = y1; by < y2; by += block_size)
+        {
+          for(int bx = x1; bx < x2; bx += block_size)
+          {
+            if(by + block_size <= y2 && bx + block_size <= x2)
+            {
+              T block[block_size][block_size];
+
+              for(int i = 0; i < block_size; i++)
+              {
+                const T *s = t->src + w * (by + i) + bx;
+
+                for(int j = 0; j < block_size; j++)
+                  block[j][i] = s[j];
+              }
+
+              for(int j = 0; j < block_size; j++)
+              {
+                T *d = t->dest + h * (bx + j) + by;
+
+                for(int i = 0; i < block_size; i++)
+                  d[i] = block[j][i];
+              }
+            }
+            else
+            {
+              // partial block at the edges
+              const int ey = std::min(by + block_size, y2);
+              const int ex = std::min(bx + block_size, x2);
+
+              for(int y = by; y < ey; y++)
+                for(int x = bx; x < ex; x++)
+                  t->dest[h * x + y] = t->src[w * y + x];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  template <typename T>
+  void transposeAny(const T *src, T *dest, int w, int h)
+  {
+    transpose_type<T> t;
+
+    t.src = src;
+    t.dest = dest;
+    t.w = w;
+    t.h = h;
+
+    Threads::run(transposeTiles<T>, 0, (h + tile_size - 1) / tile_size - 1,
+                 &t, 1);
+  }
+
+  // 2D transform, rows first, then columns
+  // the spectrum of a real input is hermitian, so only the first
+  // w / 2 + 1 columns are transformed and the rest are mirrored
+  void fft2D(float *real, float *imag, int w, int h, bool real_input)
+  {
+    // create plans up front
+    getPlan(w);
+    getPlan(h);
+
+    if(real_input && !(w & 1))
+      getPlan(w / 2);
+
+    rows_type rows;
+    rows.real = real;
+    rows.imag = imag;
+    rows.w = w;
+    rows.h = h;
+    rows.cols = real_input ? w / 2 + 1 : w;
+    rows.real_input = real_input;
+
+    Threads::run(forwardRows, 0, h - 1, &rows, 1);
+    Threads::run(forwardColumns,
+                 0, (rows.cols + strip_size - 1) / strip_size - 1, &rows, 1);
+
+    if(real_input)
+      Threads::run(mirrorRows, 0, h - 1, &rows, 1);
+  }
+
+  // inverse transform that only keeps the real part of the result,
+  // the spectrum is made hermitian first so half of it can be skipped
+  void inverseReal2D(float *real, float *imag, int w, int h)
+  {
+    getPlan(w);
+    getPlan(h);
+
+    if(!(w & 1))
+      getPlan(w / 2);
+
+    rows_type rows;
+    rows.real = real;
+    rows.imag = imag;
+    rows.w = w;
+    rows.h = h;
+    rows.cols = w / 2 + 1;
+    rows.real_input = false;
+
+    Threads::run(symmetrizeRows, 0, h / 2, &rows, 1);
+
+    // conjugated, so the forward transform runs backwards
+    for(int y = 0; y < h; y++)
+    {
+      float *p = imag + w * y;
+
+      for(int x = 0; x < rows.cols; x++)
+        p[x] = -p[x];
+    }
+
+    Threads::run(forwardColumns,
+                 0, (rows.cols + strip_size - 1) / strip_size - 1, &rows, 1);
+    Threads::run(inverseRealRows, 0, h - 1, &rows, 1);
+  }
+}
+
+bool ExtraMath::isFFTSize(int size)
+{
+  if(size < 1)
+    return false;
+
+  while(size % 2 == 0)
+    size /= 2;
+  while(size % 3 == 0)
+    size /= 3;
+  while(size % 5 == 0)
+    size /= 5;
+
+  return size == 1;
+}
+
+void ExtraMath::forwardFFT(float *real, float *imag, int size)
+{
+  std::vector<complex_type> buf(size * 2);
+
+  forwardRow(real, imag, size, &buf[0]);
 }
 
 void ExtraMath::inverseFFT(float *real, float *imag, int size)
@@ -95,3 +744,256 @@ void ExtraMath::inverseFFT(float *real, float *imag, int size)
   }
 }
 
+// transforms real-valued input, imag is only written to
+void ExtraMath::forwardRealFFT(float *real, float *imag, int size)
+{
+  std::vector<complex_type> buf(size * 2);
+
+  forwardRealRow(real, imag, size, &buf[0]);
+}
+
+// 2D transform of a w * h image, if real_input is set the imaginary
+// part is ignored on input
+void ExtraMath::forwardFFT2D(float *real, float *imag, int w, int h,
+                             bool real_input)
+{
+  fft2D(real, imag, w, h, real_input);
+}
+
+// if real_output is set only the real part of the result is computed,
+// and imag is cleared
+void ExtraMath::inverseFFT2D(float *real, float *imag, int w, int h,
+                             bool real_output)
+{
+  if(real_output)
+  {
+    inverseReal2D(real, imag, w, h);
+    return;
+  }
+
+  const int size = w * h;
+
+  for(int i = 0; i < size; i++)
+    imag[i] = -imag[i];
+
+  fft2D(real, imag, w, h, false);
+
+  for(int i = 0; i < size; i++)
+  {
+    real[i] = real[i] / size;
+    imag[i] = -imag[i] / size;
+  }
+}
+
+// transpose, src is h rows of w, dest is w rows of h
+void ExtraMath::transpose(const float *src, float *dest, int w, int h)
+{
+  transposeAny(src, dest, w, h);
+}
+
+void ExtraMath::transpose(const int *src, int *dest, int w, int h)
+{
+  transposeAny(src, dest, w, h);
+}
+
+int ExtraMath::nextFFTSize(int size)
+{
+  if(size < 1)
+    size = 1;
+
+  while(!isFFTSize(size))
+    size++;
+
+  return size;
+}
+
+namespace
+{
+  // the source plane with the kernel overhang added on each side
+  struct convolve_type
+  {
+    std::vector<float> pad;
+    int pw, ph;
+    float *dest;
+    int w, h;
+    const float *kernel;
+    int kw, kh;
+
+    // fft tiles
+    int size;
+    int tiles_x;
+    const float *kernel_real;
+    const float *kernel_imag;
+  };
+
+  void convolveRows(int y1, int y2, int, void *data)
+  {
+    const convolve_type *c = (convolve_type *)data;
+
+    for(int y = y1; y <= y2; y++)
+    {
+      float *d = c->dest + c->w * y;
+
+      for(int x = 0; x < c->w; x++)
+      {
+        const float *k = c->kernel;
+        float sum = 0;
+
+        for(int j = 0; j < c->kh; j++)
+        {
+          const float *s = &c->pad[c->pw * (y + j) + x];
+
+          for(int i = 0; i < c->kw; i++)
+            sum += s[i] * *k++;
+        }
+
+        d[x] = sum;
+      }
+    }
+  }
+
+  // overlap-save, each tile reads its own input with the kernel
+  // overhang, so tiles are independent of each other
+  void convolveTiles(int first, int last, int, void *data)
+  {
+    const convolve_type *c = (convolve_type *)data;
+    const int n = c->size;
+    const int bw = n - c->kw + 1;
+    const int bh = n - c->kh + 1;
+
+    std::vector<float> real(n * n);
+    std::vector<float> imag(n * n);
+
+    for(int t = first; t <= last; t++)
+    {
+      const int x1 = (t % c->tiles_x) * bw;
+      const int y1 = (t / c->tiles_x) * bh;
+
+      for(int v = 0; v < n; v++)
+      {
+        float *r = &real[n * v];
+        const int yy = y1 + v;
+
+        for(int u = 0; u < n; u++)
+        {
+          const int xx = x1 + u;
+
+          r[u] = (xx < c->pw && yy < c->ph) ? c->pad[c->pw * yy + xx] : 0;
+        }
+      }
+
+      ExtraMath::forwardFFT2D(&real[0], &imag[0], n, n, true);
+
+      for(int i = 0; i < n * n; i++)
+      {
+        const float re = real[i] * c->kernel_real[i]
+                           - imag[i] * c->kernel_imag[i];
+        const float im = real[i] * c->kernel_imag[i]
+                           + imag[i] * c->kernel_real[i];
+
+        real[i] = re;
+        imag[i] = im;
+      }
+
+      ExtraMath::inverseFFT2D(&real[0], &imag[0], n, n, true);
+
+      const int x2 = std::min(x1 + bw, c->w);
+      const int y2 = std::min(y1 + bh, c->h);
+
+      for(int y = y1; y < y2; y++)
+      {
+        const float *r = &real[n * (y - y1 + c->kh - 1) + c->kw - 1];
+        float *d = c->dest + c->w * y;
+
+        for(int x = x1; x < x2; x++)
+          d[x] = r[x - x1];
+      }
+    }
+  }
+
+  // rough cost of convolving the whole plane with tiles of this size,
+  // in multiply-adds
+  double fftCost(const int n, const int w, const int h,
+                 const int kw, const int kh)
+  {
+    const int bw = n - kw + 1;
+    const int bh = n - kh + 1;
+    const double tiles = (double)((w + bw - 1) / bw) * ((h + bh - 1) / bh);
+
+    return tiles * 10.0 * n * n * std::log((double)n) / std::log(2.0);
+  }
+}
+
+// correlates the w * h plane with a kw * kh kernel centered on each
+// pixel, edges are clamped, small kernels are applied directly and
+// large ones through fft tiles so the cost barely depends on the size
+void ExtraMath::convolve(float *plane, int w, int h,
+                         const float *kernel, int kw, int kh)
+{
+  convolve_type c;
+
+  c.pw = w + kw - 1;
+  c.ph = h + kh - 1;
+  c.pad.resize(c.pw * c.ph);
+  c.dest = plane;
+  c.w = w;
+  c.h = h;
+  c.kernel = kernel;
+  c.kw = kw;
+  c.kh = kh;
+
+  for(int y = 0; y < c.ph; y++)
+  {
+    const float *s = plane + w * std::min(std::max(y - kh / 2, 0), h - 1);
+    float *d = &c.pad[c.pw * y];
+
+    for(int x = 0; x < c.pw; x++)
+      d[x] = s[std::min(std::max(x - kw / 2, 0), w - 1)];
+  }
+
+  // pick the cheapest tile size
+  int size = 0;
+  double cost = (double)w * h * kw * kh;
+
+  for(int n = nextFFTSize(std::max(std::max(kw, kh) * 2, 32));
+      n <= 512; n = nextFFTSize(n + 1))
+  {
+    const double n_cost = fftCost(n, w, h, kw, kh);
+
+    if(n_cost < cost)
+    {
+      cost = n_cost;
+      size = n;
+    }
+  }
+
+  if(size == 0)
+  {
+    Threads::run(convolveRows, 0, h - 1, &c);
+    return;
+  }
+
+  // kernel spectrum, flipped so the product gives a correlation
+  std::vector<float> kernel_real(size * size, 0);
+  std::vector<float> kernel_imag(size * size, 0);
+
+  for(int j = 0; j < kh; j++)
+  {
+    for(int i = 0; i < kw; i++)
+    {
+      kernel_real[size * (kh - 1 - j) + (kw - 1 - i)] = kernel[kw * j + i];
+    }
+  }
+
+  forwardFFT2D(&kernel_real[0], &kernel_imag[0], size, size, true);
+
+  c.size = size;
+  c.tiles_x = (w + size - kw) / (size - kw + 1);
+  c.kernel_real = &kernel_real[0];
+  c.kernel_imag = &kernel_imag[0];
+
+  const int tiles_y = (h + size - kh) / (size - kh + 1);
+
+  Threads::run(convolveTiles, 0, c.tiles_x * tiles_y - 1, &c, 1);
+}
+
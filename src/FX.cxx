@@ -18,12 +18,18 @@ along with Rendera; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 */
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <vector>
 
+#include <sched.h>
+
 #include <FL/Fl_Box.H>
 #include <FL/Fl_Button.H>
 #include <FL/Fl_Choice.H>
+#include <FL/Fl_Multiline_Input.H>
 #include <FL/fl_draw.H>
 
 #include "Bitmap.H"
@@ -44,7 +50,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 #include "Project.H"
 #include "ExtraMath.H"
 #include "Quantize.H"
+#include "Raster.H"
 #include "Separator.H"
+#include "Stats.H"
+#include "Threads.H"
 #include "Undo.H"
 #include "View.H"
 
@@ -58,1225 +67,3050 @@ namespace
 //    Undo::push(bmp->cl, bmp->ct, bmp->cw, bmp->ch);
     Undo::push();
   }
-}
-
-namespace Normalize
-{
-/*
-  (ignore, temporary thing i did to generate a color chart, saving the code)
 
-  static char *font[] =
+  // for filters that keep the image statistics up to date themselves,
+  // pushing the undo doesn't change the image so they stay valid
+  void pushUndoKeepStats()
   {
-    "01110",
-    "10001",
-    "10001",
-    "10001",
-    "10001",
-    "10001",
-    "01110",
+    Stats::hold(true);
+    pushUndo();
+    Stats::hold(false);
+  }
 
-    "00100",
-    "01100",
-    "00100",
-    "00100",
-    "00100",
-    "00100",
-    "11111",
+  // tiled executor for neighborhood filters
+  //
+  // the clipped image is split into tiles, each tile gets a private copy
+  // of its source pixels plus a "halo" border (clamped at the clip edges)
+  // so kernels can read neighbors without bounds checks, and writes its
+  // results to a destination buffer which replaces the image at the end
+  struct tile_type
+  {
+    int x1, y1;
+    int w, h;
+    int halo;
+    int stride;
+    const int *src;
+    Bitmap *dest;
+
+    // source row, valid from x = -halo to w + halo - 1
+    inline const int *srcRow(const int &y) const
+    {
+      return src + stride * y;
+    }
 
-    "01110",
-    "10001",
-    "00001",
-    "00010",
-    "00100",
-    "01000",
-    "11111",
+    // destination row
+    inline int *destRow(const int &y) const
+    {
+      return dest->row[y1 - bmp->ct + y] + (x1 - bmp->cl);
+    }
+  };
 
-    "11111",
-    "00010",
-    "00100",
-    "00010",
-    "00001",
-    "10001",
-    "01110",
+  typedef void (*tile_func_type)(const tile_type &, void *);
 
-    "00010",
-    "00110",
-    "01010",
-    "10010",
-    "11111",
-    "00010",
-    "00010",
+  // reports progress for rows y1 to y2, which were finished together
+  // (Gui::updateProgress has to see every row to advance evenly)
+  // returns false if the user cancelled
+  bool updateRows(const int y1, const int y2)
+  {
+    for(int y = y1; y <= y2; y++)
+      if(Gui::updateProgress(y) < 0)
+        return false;
 
-    "11111",
-    "10000",
-    "11110",
-    "00001",
-    "00001",
-    "00001",
-    "11110",
+    return true;
+  }
 
-    "00111",
-    "01000",
-    "10000",
-    "11110",
-    "10001",
-    "10001",
-    "01110",
+  struct tile_job_type
+  {
+    tile_func_type func;
+    void *data;
+    int halo;
+    int size;
+    int tiles_x;
+    int first_row;
+    Bitmap *dest;
+    std::vector<std::vector<int> > *buffers;
+  };
 
-    "11111",
-    "00001",
-    "00010",
-    "00100",
-    "01000",
-    "01000",
-    "01000",
+  void runTiles(int first, int last, int index, void *data)
+  {
+    const tile_job_type *job = (tile_job_type *)data;
+    std::vector<int> &buf = (*job->buffers)[index];
+    const int halo = job->halo;
 
-    "01110",
-    "10001",
-    "10001",
-    "01110",
-    "10001",
-    "10001",
-    "01110",
+    for(int i = first; i <= last; i++)
+    {
+      tile_type tile;
 
-    "01110",
-    "10001",
-    "10001",
-    "01111",
-    "00001",
-    "00010",
-    "11100",
+      tile.x1 = bmp->cl + (i % job->tiles_x) * job->size;
+      tile.y1 = bmp->ct + (job->first_row + i / job->tiles_x) * job->size;
+      tile.w = std::min(job->size, bmp->cr - tile.x1 + 1);
+      tile.h = std::min(job->size, bmp->cb - tile.y1 + 1);
+      tile.halo = halo;
+      tile.stride = tile.w + halo * 2;
+      tile.dest = job->dest;
 
-    "01110",
-    "10001",
-    "10001",
-    "10001",
-    "11111",
-    "10001",
-    "10001",
+      buf.resize(tile.stride * (tile.h + halo * 2));
 
-    "11110",
-    "10001",
-    "10001",
-    "11110",
-    "10001",
-    "10001",
-    "11110",
+      // copy source with clamped edges
+      for(int y = 0; y < tile.h + halo * 2; y++)
+      {
+        const int sy = std::min(std::max(tile.y1 + y - halo, bmp->ct),
+                                bmp->cb);
+        const int *s = bmp->row[sy];
+        int *d = &buf[tile.stride * y];
 
-    "01110",
-    "10001",
-    "10000",
-    "10000",
-    "10000",
-    "10001",
-    "01110",
+        for(int x = 0; x < tile.stride; x++)
+        {
+          const int sx = std::min(std::max(tile.x1 + x - halo, bmp->cl),
+                                  bmp->cr);
+          d[x] = s[sx];
+        }
+      }
 
-    "11100",
-    "10010",
-    "10001",
-    "10001",
-    "10001",
-    "10010",
-    "11100",
+      tile.src = &buf[tile.stride * halo + halo];
+      job->func(tile, job->data);
+    }
+  }
 
-    "11111",
-    "10000",
-    "10000",
-    "11110",
-    "10000",
-    "10000",
-    "11111",
+  // runs func on every tile of the clipped image, handles progress and
+  // cancellation, returns false if the user cancelled
+  bool filterTiles(tile_func_type func, void *data, int halo)
+  {
+    Bitmap dest(bmp->cw, bmp->ch);
+    std::vector<std::vector<int> > buffers(Threads::count());
+    tile_job_type job;
 
-    "11111",
-    "10000",
-    "10000",
-    "11110",
-    "10000",
-    "10000",
-    "10000"
-  };
+    job.func = func;
+    job.data = data;
+    job.halo = halo;
+    job.size = std::max(128, halo * 2);
+    job.tiles_x = (bmp->cw + job.size - 1) / job.size;
+    job.dest = &dest;
+    job.buffers = &buffers;
 
-  void drawHex(int xx, int yy, int i)
-  {
-    int r = (i >> 0) & 0xF;
-    int g = (i >> 4) & 0xF;
-    int b = (i >> 8) & 0xF;
+    const int tiles_y = (bmp->ch + job.size - 1) / job.size;
 
-    for(int y = 0; y < 7; y++)
-    {
-      for(int x = 0; x < 5; x++)
-      {
-        if(font[r * 7 + y][x] == '1')
-          bmp->setpixelSolid(xx + x, yy + y, makeRgb(255, 255, 255), 96);
-      }
-    }
-  }
-    
-  void apply()
-  {
-    int x = bmp->cl;
-    int y = bmp->ct;
+    // enough tile rows per batch to keep every thread busy
+    const int batch = std::max(1, (Threads::count() * 2 + job.tiles_x - 1)
+                                  / job.tiles_x);
 
-    fl_font(FL_COURIER, 10);
+    Gui::showProgress(bmp->ch);
 
-    for(int i = 0; i < 4096; i++)
+    for(int row = 0; row < tiles_y; row += batch)
     {
-      int r = (i >> 0) & 0xF;
-      int g = (i >> 4) & 0xF;
-      int b = (i >> 8) & 0xF;
-
-      int rr = r | r << 4;
-      int gg = g | g << 4;
-      int bb = b | b << 4;
+      const int rows = std::min(batch, tiles_y - row);
 
-      int c = makeRgb(rr, gg, bb);
+      job.first_row = row;
+      Threads::run(runTiles, 0, rows * job.tiles_x - 1, &job, 1);
 
-      bmp->rectfill(x, y, x + 31, y + 31, c, 0);
-      bmp->rect(x, y, x + 31, y + 31, makeRgb(0, 0, 0), 128);
-      bmp->rect(x + 3, y + 3, x + 23, y + 13, makeRgb(0, 0, 0), 160);
-      bmp->rectfill(x + 4, y + 4, x + 22, y + 12, makeRgb(0, 0, 0), 96);
-      drawHex(x + 5, y + 5, r);
-      drawHex(x + 11, y + 5, g);
-      drawHex(x + 17, y + 5, b);
+      const int y1 = bmp->ct + row * job.size;
+      const int y2 = std::min(y1 + rows * job.size - 1, bmp->cb);
 
-      x += 32;
-      if(x >= bmp->cl + 32 * 64)
-      {
-        x = bmp->cl;
-        y += 32;
-      }
+      if(!updateRows(y1, y2))
+        return false;
     }
+
+    dest.blit(bmp, 0, 0, bmp->cl, bmp->ct, dest.w, dest.h);
+    Gui::hideProgress();
+
+    return true;
   }
-*/
 
-  void apply()
+  // copies one channel of the clipped image into a plane,
+  // color is gamma-linearized to 16 bits
+  // a wide image is read as it is (its levels are already linear)
+  template <typename T>
+  void packPlane(T *buf, const int channel)
   {
-    // search for highest & lowest RGB values
-    int r_high = 0;
-    int g_high = 0;
-    int b_high = 0;
-    int r_low = 0xFFFFFF;
-    int g_low = 0xFFFFFF;
-    int b_low = 0xFFFFFF;
+    const int w = bmp->cw;
+    const int h = bmp->ch;
+    const Raster<float> *wide = Project::wide;
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int y = 0; y < h; y++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      const int *p = bmp->row[y + bmp->ct] + bmp->cl;
+      T *q = buf + w * y;
+
+      if(wide)
       {
-        rgba_type rgba = getRgba(*p);
+        const float *s = wide->row[y + bmp->ct] + bmp->cl * 4 + channel;
 
-        const int r = rgba.r;
-        const int g = rgba.g;
-        const int b = rgba.b;
+        for(int x = 0; x < w; x++)
+          q[x] = s[x * 4];
 
-        if(r < r_low)
-          r_low = r;
-        if(r > r_high)
-          r_high = r;
-        if(g < g_low)
-          g_low = g;
-        if(g > g_high)
-          g_high = g;
-        if(b < b_low)
-          b_low = b;
-        if(b > b_high)
-          b_high = b;
+        continue;
       }
-    }
-
-    if(!(r_high - r_low))
-      r_high++;
-    if(!(g_high - g_low))
-      g_high++;
-    if(!(b_high - b_low))
-      b_high++;
-
-    // scale image
-    double r_scale = 255.0 / (r_high - r_low);
-    double g_scale = 255.0 / (g_high - g_low);
-    double b_scale = 255.0 / (b_high - b_low);
-
-    Gui::showProgress(bmp->h);
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
-    {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      for(int x = 0; x < w; x++)
       {
-        rgba_type rgba = getRgba(*p);
-
-        const int r = (rgba.r - r_low) * r_scale;
-        const int g = (rgba.g - g_low) * g_scale;
-        const int b = (rgba.b - b_low) * b_scale;
+        const rgba_type rgba = getRgba(p[x]);
 
-        *p = makeRgba(r, g, b, rgba.a);
+        switch(channel)
+        {
+          case 0:
+            q[x] = Gamma::fix(rgba.r);
+            break;
+          case 1:
+            q[x] = Gamma::fix(rgba.g);
+            break;
+          case 2:
+            q[x] = Gamma::fix(rgba.b);
+            break;
+          case 3:
+            q[x] = rgba.a * 257;
+            break;
+        }
       }
-
-      if(Gui::updateProgress(y) < 0)
-        return;
     }
-
-    Gui::hideProgress();
   }
 
-  void begin()
+  inline int planeLevel(const uint16_t &val)
   {
-    pushUndo();
-    apply();
+    return val;
   }
-}
 
-namespace Equalize
-{
-  void apply()
+  inline int planeLevel(const float &val)
   {
-    std::vector<int> list_r(256, 0);
-    std::vector<int> list_g(256, 0);
-    std::vector<int> list_b(256, 0);
+    return clamp((int)(val + 0.5f), 65535);
+  }
 
-    const int size = bmp->cw * bmp->ch;
+  // writes one channel of a plane into dest (the size of the clipped
+  // image), the channels before it must already be there
+  // progress is counted in rows over all four channels
+  // returns false if the user cancelled
+  template <typename T>
+  bool unpackPlane(Bitmap *dest, const T *buf, const int channel)
+  {
+    const int w = bmp->cw;
+    const int h = bmp->ch;
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int y = 0; y < h; y++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        rgba_type rgba = getRgba(*p);
+      int *p = dest->row[y];
+      const T *q = buf + w * y;
 
-        const int r = rgba.r;
-        const int g = rgba.g;
-        const int b = rgba.b;
+      for(int x = 0; x < w; x++)
+      {
+        const rgba_type rgba = getRgba(p[x]);
+        const int val = planeLevel(q[x]);
 
-        list_r[r]++;
-        list_g[g]++;
-        list_b[b]++;
+        switch(channel)
+        {
+          case 0:
+            p[x] = makeRgba(Gamma::unfix(val), 0, 0, 0);
+            break;
+          case 1:
+            p[x] = makeRgba(rgba.r, Gamma::unfix(val), 0, 0);
+            break;
+          case 2:
+            p[x] = makeRgba(rgba.r, rgba.g, Gamma::unfix(val), 0);
+            break;
+          case 3:
+            p[x] = makeRgba(rgba.r, rgba.g, rgba.b, val / 257);
+            break;
+        }
       }
-    }
 
-    for(int j = 255; j >= 0; j--)
-    {
-      for(int i = 0; i < j; i++)
-      {
-        list_r[j] += list_r[i];
-        list_g[j] += list_g[i];
-        list_b[j] += list_b[i];
-      }
+      if(Gui::updateProgress(channel * h + y) < 0)
+        return false;
     }
 
-    const double scale = 255.0 / size;
+    return true;
+  }
 
-    Gui::showProgress(bmp->h);
+  // keeps one channel of a plane for the wide image, planes holds all
+  // four interleaved like the wide image (the size of the clipped area)
+  // so it only changes once the filter is done
+  template <typename T>
+  void keepWidePlane(std::vector<float> *planes, const T *buf,
+                     const int channel)
+  {
+    const int size = bmp->cw * bmp->ch;
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
-    {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        rgba_type rgba = getRgba(*p);
-
-        int r = rgba.r;
-        int g = rgba.g;
-        int b = rgba.b;
+    planes->resize(size * 4);
 
-        r = list_r[r] * scale;
-        g = list_g[g] * scale;
-        b = list_b[b] * scale;
-
-        *p = makeRgba(r, g, b, rgba.a);
-      }
+    for(int i = 0; i < size; i++)
+      (*planes)[i * 4 + channel] = buf[i];
+  }
 
-      if(Gui::updateProgress(y) < 0)
-        return;
-    }
+  // once a filter has changed the clipped part of the wide image,
+  // reduces it into the image so they match again
+  void finishWide()
+  {
+    if(!Project::wide)
+      return;
 
-    Gui::hideProgress();
+    Project::wide->toBitmap(bmp, bmp->cl, bmp->ct);
+    Project::wide_stale = false;
+    Stats::invalidate();
   }
 
-  void begin()
+  // a cancelled filter leaves the image as it was, so the wide image
+  // still matches it
+  void cancelWide()
   {
-    pushUndo();
-    apply();
+    Project::wide_stale = false;
   }
-}
 
-namespace ValueStretch
-{
-  void apply()
+  // the same for a filter that kept its planes, they are blended with
+  // the wide image like Blend::trans first
+  void finishWide(const std::vector<float> &planes, const int blend)
   {
-    std::vector<int> list_r(256, 0);
-    std::vector<int> list_g(256, 0);
-    std::vector<int> list_b(256, 0);
-
-    double rr = 0;
-    double gg = 0;
-    double bb = 0;
-    int count = 0;
-
-    // determine overall color cast
-    for(int y = bmp->ct; y <= bmp->cb; y++)
-    {
-      for(int x = bmp->cl; x <= bmp->cr; x++)
-      {
-        rgba_type rgba = getRgba(bmp->getpixel(x, y));
-
-        rr += rgba.r;
-        gg += rgba.g;
-        bb += rgba.b;
-
-        count++;
-      }
-    }
+    Raster<float> *wide = Project::wide;
 
-    rr /= count;
-    gg /= count;
-    bb /= count;
+    if(!wide || planes.empty())
+      return;
 
-    const int size = bmp->cw * bmp->ch;
+    const int w = bmp->cw;
+    const int h = bmp->ch;
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int y = 0; y < h; y++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        rgba_type rgba = getRgba(*p);
+      float *p = wide->row[y + bmp->ct] + bmp->cl * 4;
+      const float *q = &planes[w * y * 4];
 
-        const int r = rgba.r;
-        const int g = rgba.g;
-        const int b = rgba.b;
+      for(int x = 0; x < w * 4; x++)
+      {
+        const float val = q[x] + blend * (p[x] - q[x]) / 255;
 
-        list_r[r]++;
-        list_g[g]++;
-        list_b[b]++;
+        p[x] = std::max(0.0f, std::min(val, 65535.0f));
       }
     }
 
-    for(int j = 255; j >= 0; j--)
-    {
-      for(int i = 0; i < j; i++)
-      {
-        list_r[j] += list_r[i];
-        list_g[j] += list_g[i];
-        list_b[j] += list_b[i];
-      }
-    }
+    finishWide();
+  }
 
-    double scale = 255.0 / size;
+  // convolves the clipped image with an arbitrary kernel into dest
+  // (which must be the same size), color is gamma-linearized first
+  // a wide image is convolved into wide_planes for finishWide
+  // returns false if the user cancelled
+  bool convolveImage(Bitmap *dest, const float *kernel, int kw, int kh,
+                     std::vector<float> *wide_planes)
+  {
+    const int w = bmp->cw;
+    const int h = bmp->ch;
 
-    Gui::showProgress(bmp->h);
+    std::vector<float> buf(w * h);
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    Gui::showProgress(h * 4);
+
+    for(int channel = 0; channel < 4; channel++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        rgba_type rgba = getRgba(*p);
+      packPlane(&buf[0], channel);
+      ExtraMath::convolve(&buf[0], w, h, kernel, kw, kh);
 
-        int r = rgba.r;
-        int g = rgba.g;
-        int b = rgba.b;
+      if(Project::wide)
+        keepWidePlane(wide_planes, &buf[0], channel);
 
-        const int ra = list_r[r] * scale;
-        const int ga = list_g[g] * scale;
-        const int ba = list_b[b] * scale;
+      if(!unpackPlane(dest, &buf[0], channel))
+        return false;
+    }
 
-        r = ((ra * rr) + (r * (255 - rr))) / 255;
-        g = ((ga * gg) + (g * (255 - gg))) / 255;
-        b = ((ba * bb) + (b * (255 - bb))) / 255;
+    return true;
+  }
 
-        r = clamp(r, 255);
-        g = clamp(g, 255);
-        b = clamp(b, 255);
+  // scales a kernel so it sums to one
+  void normalizeKernel(std::vector<float> *kernel)
+  {
+    float sum = 0;
 
-        *p = makeRgba(r, g, b, rgba.a);
-      }
+    for(int i = 0; i < (int)kernel->size(); i++)
+      sum += (*kernel)[i];
 
-      if(Gui::updateProgress(y) < 0)
-        return;
+    if(sum > 0)
+    {
+      for(int i = 0; i < (int)kernel->size(); i++)
+        (*kernel)[i] /= sum;
     }
-
-    Gui::hideProgress();
   }
 
-  void begin()
+  // point operations
+  //
+  // per-pixel color filters are described as a list of operations and
+  // applied to the image in a single pass, operations are either
+  // per-channel tables (neighboring tables are merged into one) or
+  // functions of the whole color, alpha is always left alone
+  //
+  // with at most one function in the list every pixel is computed
+  // exactly, otherwise the list is baked into a 3D table first and
+  // pixels are interpolated from it
+  typedef int (*color_func_type)(const int &, const void *);
+
+  struct point_op_type
   {
-    pushUndo();
-    apply();
-  }
-}
+    color_func_type func;
+    const void *data;
+    std::vector<int> table;
+  };
 
-namespace Saturate
-{
-  void apply()
+  struct pipeline_type
   {
-    std::vector<int> list_s(256, 0);
+    std::vector<point_op_type> ops;
+  };
 
-    const int size = bmp->cw * bmp->ch;
+  void addTables(pipeline_type *pipe,
+                 const int *lut_r, const int *lut_g, const int *lut_b)
+  {
+    const int *lut[3] = { lut_r, lut_g, lut_b };
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    if(!pipe->ops.empty() && pipe->ops.back().func == 0)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        rgba_type rgba = getRgba(*p);
+      std::vector<int> &table = pipe->ops.back().table;
 
-        const int r = rgba.r;
-        const int g = rgba.g;
-        const int b = rgba.b;
-
-        int h, s, v;
-        Blend::rgbToHsv(r, g, b, &h, &s, &v);
+      for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 256; j++)
+          table[i * 256 + j] = clamp(lut[i][table[i * 256 + j]], 255);
 
-        list_s[s]++;
-      }
+      return;
     }
 
-    for(int j = 255; j >= 0; j--)
-      for(int i = 0; i < j; i++)
-        list_s[j] += list_s[i];
+    point_op_type op;
 
-    const double scale = 255.0 / size;
+    op.func = 0;
+    op.data = 0;
+    op.table.resize(3 * 256);
 
-    Gui::showProgress(bmp->h);
+    for(int i = 0; i < 3; i++)
+      for(int j = 0; j < 256; j++)
+        op.table[i * 256 + j] = clamp(lut[i][j], 255);
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
-    {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        rgba_type rgba = getRgba(*p);
+    pipe->ops.push_back(op);
+  }
 
-        int r = rgba.r;
-        int g = rgba.g;
-        int b = rgba.b;
+  void addFunc(pipeline_type *pipe, color_func_type func, const void *data)
+  {
+    point_op_type op;
 
-        const int l = getl(*p);
-        int h, s, v;
+    op.func = func;
+    op.data = data;
+    pipe->ops.push_back(op);
+  }
 
-        Blend::rgbToHsv(r, g, b, &h, &s, &v);
+  int countFuncs(const pipeline_type *pipe)
+  {
+    int count = 0;
 
-        // don't try to saturate grays
-        if(s == 0)
-          continue;
+    for(int i = 0; i < (int)pipe->ops.size(); i++)
+      if(pipe->ops[i].func)
+        count++;
 
-        const int temp = s;
-        s = list_s[s] * scale;
+    return count;
+  }
 
-        if(s < temp)
-          s = temp;
+  inline int runOps(const pipeline_type *pipe, int c)
+  {
+    for(int i = 0; i < (int)pipe->ops.size(); i++)
+    {
+      const point_op_type &op = pipe->ops[i];
 
-        Blend::hsvToRgb(h, s, v, &r, &g, &b);
-        *p = Blend::trans(*p, Blend::keepLum(makeRgba(r, g, b, rgba.a), l), 255 - s);
+      if(op.func)
+      {
+        c = op.func(c, op.data);
       }
+      else
+      {
+        const int *table = &op.table[0];
+        const rgba_type rgba = getRgba(c);
 
-      if(Gui::updateProgress(y) < 0)
-        return;
+        c = makeRgba(table[rgba.r], table[256 + rgba.g],
+                     table[512 + rgba.b], rgba.a);
+      }
     }
 
-    Gui::hideProgress();
+    return c;
   }
 
-  void begin()
+  // 3D table, nodes are "step" apart on each axis from 0 to 256, the
+  // last node is extrapolated from the ones before so both ends of the
+  // range are exact
+  struct lut3d_type
   {
-    pushUndo();
-    apply();
-  }
-}
+    int step;
+    int shift;
+    int size;
+    std::vector<int> node;
+  };
 
-namespace RotateHue
-{
-  namespace Items
+  struct bake_type
   {
-    DialogWindow *dialog;
-    InputInt *angle;
-    CheckBox *preserve_lum;
-    Fl_Button *ok;
-    Fl_Button *cancel;
-  }
+    const pipeline_type *pipe;
+    lut3d_type *lut;
+  };
 
-  void apply(int amount)
+  void bakeSlices(int first, int last, int, void *data)
   {
-    const int hh = amount * 4.277;
-    const bool keep_lum = Items::preserve_lum->value();
+    const bake_type *bake = (bake_type *)data;
+    lut3d_type *lut = bake->lut;
+    const int size = lut->size;
+    const int step = lut->step;
 
-    Gui::showProgress(bmp->h);
-
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int b = first; b <= last; b++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        int c = *p;
-
-        rgba_type rgba = getRgba(c);
-
-        const int l = getl(c);
-        int r = rgba.r;
-        int g = rgba.g;
-        int b = rgba.b;
-        int h, s, v;
+      const int vb = std::min(b * step, 255);
 
-        Blend::rgbToHsv(r, g, b, &h, &s, &v);
-        h += hh;
-
-        if(h >= 1536)
-          h -= 1536;
+      for(int g = 0; g < size; g++)
+      {
+        const int vg = std::min(g * step, 255);
 
-        Blend::hsvToRgb(h, s, v, &r, &g, &b);
-        c = makeRgba(r, g, b, rgba.a);
+        for(int r = 0; r < size; r++)
+        {
+          const int vr = std::min(r * step, 255);
+          const int c = runOps(bake->pipe, makeRgba(vr, vg, vb, 255));
+          int *n = &lut->node[((b * size + g) * size + r) * 3];
 
-        if(keep_lum)
-          *p = Blend::keepLum(c, l);
-        else
-          *p = c;
+          n[0] = getr(c);
+          n[1] = getg(c);
+          n[2] = getb(c);
+        }
       }
-
-      if(Gui::updateProgress(y) < 0)
-        return;
     }
-
-    Gui::hideProgress();
   }
 
-  void close()
+  void bakeLut(const pipeline_type *pipe, lut3d_type *lut, int step)
   {
-    Items::dialog->hide();
-    pushUndo();
+    lut->step = step;
+    lut->shift = step == 4 ? 2 : 3;
+    lut->size = 256 / step + 1;
 
-    int angle = atoi(Items::angle->value());
+    const int size = lut->size;
 
-    if(angle < 0)
-      angle += 360;
+    lut->node.resize(size * size * size * 3);
 
-    apply(angle);
-  }
+    bake_type bake;
 
-  void quit()
-  {
-    Gui::hideProgress();
-    Items::dialog->hide();
-  }
+    bake.pipe = pipe;
+    bake.lut = lut;
+    Threads::run(bakeSlices, 0, size - 1, &bake, 1);
 
-  void begin()
-  {
-    Items::dialog->show();
-  }
+    // replace the nodes at 256 (computed at 255) by extrapolation
+    const int last = size - 1;
+    const int span = 255 - (last - 1) * step;
 
-  void init()
-  {
-    int y1 = 8;
+    for(int b = 0; b < size; b++)
+    {
+      for(int g = 0; g < size; g++)
+      {
+        for(int r = 0; r < size; r++)
+        {
+          if(r != last && g != last && b != last)
+            continue;
 
-    Items::dialog = new DialogWindow(256, 0, "Rotate Hue");
-    Items::angle = new InputInt(Items::dialog, 0, y1, 96, 24, "Angle:", 0, -359, 359);
-    y1 += 24 + 8;
-    Items::angle->maximum_size(4);
-    Items::angle->value("60");
-    Items::angle->center();
-    Items::preserve_lum = new CheckBox(Items::dialog, 0, y1, 16, 16, "Preserve Luminosity", 0);
-    Items::preserve_lum->center();
-    y1 += 16 + 8;
-    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
-    Items::ok->callback((Fl_Callback *)close);
-    Items::cancel->callback((Fl_Callback *)quit);
-    Items::dialog->set_modal();
-    Items::dialog->end();
+          // step back along the diagonal to the previous node
+          const int pr = r == last ? r - 1 : r;
+          const int pg = g == last ? g - 1 : g;
+          const int pb = b == last ? b - 1 : b;
+
+          int *n = &lut->node[((b * size + g) * size + r) * 3];
+          const int *p = &lut->node[((pb * size + pg) * size + pr) * 3];
+
+          for(int i = 0; i < 3; i++)
+            n[i] += (n[i] - p[i]) / span;
+        }
+      }
+    }
   }
-}
 
-namespace Invert
-{
-  void apply()
+  // tetrahedral interpolation
+  inline int lookupLut(const lut3d_type *lut, const int &c)
   {
-    Gui::showProgress(bmp->h);
-
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    const rgba_type rgba = getRgba(c);
+    const int size = lut->size;
+    const int step = lut->step;
+    const int mask = step - 1;
+
+    const int fr = rgba.r & mask;
+    const int fg = rgba.g & mask;
+    const int fb = rgba.b & mask;
+
+    const int dr = 3;
+    const int dg = size * 3;
+    const int db = size * size * 3;
+
+    const int *n0 = &lut->node[(rgba.b >> lut->shift) * db
+                               + (rgba.g >> lut->shift) * dg
+                               + (rgba.r >> lut->shift) * dr];
+    const int *n3 = n0 + dr + dg + db;
+    const int *n1, *n2;
+    int w0, w1, w2, w3;
+
+    if(fr >= fg)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      if(fg >= fb)
+      {
+        n1 = n0 + dr;
+        n2 = n0 + dr + dg;
+        w0 = step - fr; w1 = fr - fg; w2 = fg - fb; w3 = fb;
+      }
+      else if(fr >= fb)
+      {
+        n1 = n0 + dr;
+        n2 = n0 + dr + db;
+        w0 = step - fr; w1 = fr - fb; w2 = fb - fg; w3 = fg;
+      }
+      else
+      {
+        n1 = n0 + db;
+        n2 = n0 + dr + db;
+        w0 = step - fb; w1 = fb - fr; w2 = fr - fg; w3 = fg;
+      }
+    }
+    else
+    {
+      if(fb >= fg)
+      {
+        n1 = n0 + db;
+        n2 = n0 + dg + db;
+        w0 = step - fb; w1 = fb - fg; w2 = fg - fr; w3 = fr;
+      }
+      else if(fb >= fr)
+      {
+        n1 = n0 + dg;
+        n2 = n0 + dg + db;
+        w0 = step - fg; w1 = fg - fb; w2 = fb - fr; w3 = fr;
+      }
+      else
       {
-        *p = Blend::invert(*p, 0, 0);
+        n1 = n0 + dg;
+        n2 = n0 + dr + dg;
+        w0 = step - fg; w1 = fg - fr; w2 = fr - fb; w3 = fb;
       }
+    }
 
-      if(Gui::updateProgress(y) < 0)
-        return;
+    const int half = step / 2;
+    int out[3];
+
+    for(int i = 0; i < 3; i++)
+    {
+      const int v = n0[i] * w0 + n1[i] * w1 + n2[i] * w2 + n3[i] * w3;
+
+      out[i] = clamp((v + half) >> lut->shift, 255);
     }
 
-    Gui::hideProgress();
+    return makeRgba(out[0], out[1], out[2], rgba.a);
   }
 
-  void begin()
+  struct point_job_type
   {
-    pushUndo();
-    apply();
-  }
-}
+    const pipeline_type *pipe;
+    const lut3d_type *lut;
+  };
 
-namespace InvertAlpha
-{
-  void apply()
+  void runPointRows(int first, int last, int, void *data)
   {
-    Gui::showProgress(bmp->h);
+    const point_job_type *job = (point_job_type *)data;
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int y = first; y <= last; y++)
     {
       int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+
+      if(job->lut)
       {
-        const rgba_type rgba = getRgba(*p);
-        *p = makeRgba(rgba.r, rgba.g, rgba.b, 255 - rgba.a);
+        for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+          *p = lookupLut(job->lut, *p);
+      }
+      else
+      {
+        for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+          *p = runOps(job->pipe, *p);
       }
-
-      if(Gui::updateProgress(y) < 0)
-        return;
     }
-
-    Gui::hideProgress();
   }
 
-  void begin()
+  // applies the pipeline to the clipped image and keeps the image
+  // statistics in step, returns false if the user cancelled
+  bool runPipeline(const pipeline_type *pipe)
   {
-    pushUndo();
-    apply();
+    if(pipe->ops.empty())
+      return true;
+
+    lut3d_type lut;
+    point_job_type job;
+
+    job.pipe = pipe;
+    job.lut = 0;
+
+    // finer table for larger images, where baking is cheap in comparison
+    if(countFuncs(pipe) > 1)
+    {
+      bakeLut(pipe, &lut, bmp->cw * bmp->ch >= 1 << 22 ? 4 : 8);
+      job.lut = &lut;
+    }
+
+    const int batch = std::max(16, (1 << 20) / std::max(bmp->cw, 1));
+
+    Gui::showProgress(bmp->ch);
+
+    for(int y = bmp->ct; y <= bmp->cb; y += batch)
+    {
+      const int y2 = std::min(y + batch - 1, bmp->cb);
+
+      Threads::run(runPointRows, y, y2, &job);
+
+      if(!updateRows(y, y2))
+      {
+        Stats::invalidate();
+        return false;
+      }
+    }
+
+    Gui::hideProgress();
+
+    if(pipe->ops.size() == 1 && pipe->ops[0].func == 0)
+    {
+      const int *table = &pipe->ops[0].table[0];
+
+      Stats::remap(table, table + 256, table + 512);
+    }
+    else
+    {
+      Stats::invalidate();
+    }
+
+    return true;
+  }
+}
+
+namespace Normalize
+{
+/*
+  (ignore, temporary thing i did to generate a color chart, saving the code)
+
+  static char *font[] =
+  {
+    "01110",
+    "10001",
+    "10001",
+    "10001",
+    "10001",
+    "10001",
+    "01110",
+
+    "00100",
+    "01100",
+    "00100",
+    "00100",
+    "00100",
+    "00100",
+    "11111",
+
+    "01110",
+    "10001",
+    "00001",
+    "00010",
+    "00100",
+    "01000",
+    "11111",
+
+    "11111",
+    "00010",
+    "00100",
+    "00010",
+    "00001",
+    "10001",
+    "01110",
+
+    "00010",
+    "00110",
+    "01010",
+    "10010",
+    "11111",
+    "00010",
+    "00010",
+
+    "11111",
+    "10000",
+    "11110",
+    "00001",
+    "00001",
+    "00001",
+    "11110",
+
+    "00111",
+    "01000",
+    "10000",
+    "11110",
+    "10001",
+    "10001",
+    "01110",
+
+    "11111",
+    "00001",
+    "00010",
+    "00100",
+    "01000",
+    "01000",
+    "01000",
+
+    "01110",
+    "10001",
+    "10001",
+    "01110",
+    "10001",
+    "10001",
+    "01110",
+
+    "01110",
+    "10001",
+    "10001",
+    "01111",
+    "00001",
+    "00010",
+    "11100",
+
+    "01110",
+    "10001",
+    "10001",
+    "10001",
+    "11111",
+    "10001",
+    "10001",
+
+    "11110",
+    "10001",
+    "10001",
+    "11110",
+    "10001",
+    "10001",
+    "11110",
+
+    "01110",
+    "10001",
+    "10000",
+    "10000",
+    "10000",
+    "10001",
+    "01110",
+
+    "11100",
+    "10010",
+    "10001",
+    "10001",
+    "10001",
+    "10010",
+    "11100",
+
+    "11111",
+    "10000",
+    "10000",
+    "11110",
+    "10000",
+    "10000",
+    "11111",
+
+    "11111",
+    "10000",
+    "10000",
+    "11110",
+    "10000",
+    "10000",
+    "10000"
+  };
+
+  void drawHex(int xx, int yy, int i)
+  {
+    int r = (i >> 0) & 0xF;
+    int g = (i >> 4) & 0xF;
+    int b = (i >> 8) & 0xF;
+
+    for(int y = 0; y < 7; y++)
+    {
+      for(int x = 0; x < 5; x++)
+      {
+        if(font[r * 7 + y][x] == '1')
+          bmp->setpixelSolid(xx + x, yy + y, makeRgb(255, 255, 255), 96);
+      }
+    }
+  }
+    
+  void apply()
+  {
+    int x = bmp->cl;
+    int y = bmp->ct;
+
+    fl_font(FL_COURIER, 10);
+
+    for(int i = 0; i < 4096; i++)
+    {
+      int r = (i >> 0) & 0xF;
+      int g = (i >> 4) & 0xF;
+      int b = (i >> 8) & 0xF;
+
+      int rr = r | r << 4;
+      int gg = g | g << 4;
+      int bb = b | b << 4;
+
+      int c = makeRgb(rr, gg, bb);
+
+      bmp->rectfill(x, y, x + 31, y + 31, c, 0);
+      bmp->rect(x, y, x + 31, y + 31, makeRgb(0, 0, 0), 128);
+      bmp->rect(x + 3, y + 3, x + 23, y + 13, makeRgb(0, 0, 0), 160);
+      bmp->rectfill(x + 4, y + 4, x + 22, y + 12, makeRgb(0, 0, 0), 96);
+      drawHex(x + 5, y + 5, r);
+      drawHex(x + 11, y + 5, g);
+      drawHex(x + 17, y + 5, b);
+
+      x += 32;
+      if(x >= bmp->cl + 32 * 64)
+      {
+        x = bmp->cl;
+        y += 32;
+      }
+    }
+  }
+*/
+
+  // adds the filter to a pipeline, stats are updated to match
+  void addTo(pipeline_type *pipe, Stats::stats_type *stats)
+  {
+    int lut[3][256];
+
+    // scale each channel from its lowest to highest value
+    for(int i = 0; i < 3; i++)
+    {
+      const int low = stats->min[i];
+      int high = stats->max[i];
+
+      if(!(high - low))
+        high++;
+
+      const double scale = 255.0 / (high - low);
+
+      for(int j = 0; j < 256; j++)
+        lut[i][j] = (j - low) * scale;
+    }
+
+    addTables(pipe, lut[0], lut[1], lut[2]);
+    Stats::remap(stats, lut[0], lut[1], lut[2]);
+  }
+
+  void apply()
+  {
+    Stats::stats_type stats = *Stats::get(bmp, Stats::RGB);
+    pipeline_type pipe;
+
+    addTo(&pipe, &stats);
+    runPipeline(&pipe);
+  }
+
+  void begin()
+  {
+    pushUndoKeepStats();
+    apply();
+  }
+}
+
+namespace Equalize
+{
+  struct wide_type
+  {
+    Raster<float> *wide;
+    std::vector<uint16_t> *levels;
+    const std::vector<int> *lut;
+  };
+
+  // gamma-corrected 16-bit levels of the clipped wide image
+  void findLevels(int y1, int y2, int, void *data)
+  {
+    const wide_type *eq = (wide_type *)data;
+    const int w = bmp->cw;
+
+    for(int y = y1; y <= y2; y++)
+    {
+      const float *p = eq->wide->row[y + bmp->ct] + bmp->cl * 4;
+      uint16_t *q = &(*eq->levels)[w * 3 * y];
+
+      for(int x = 0; x < w; x++, p += 4, q += 3)
+      {
+        q[0] = gammaLevel(p[0]);
+        q[1] = gammaLevel(p[1]);
+        q[2] = gammaLevel(p[2]);
+      }
+    }
+  }
+
+  void remapLevels(int y1, int y2, int, void *data)
+  {
+    const wide_type *eq = (wide_type *)data;
+    const int w = bmp->cw;
+
+    for(int y = y1; y <= y2; y++)
+    {
+      float *p = eq->wide->row[y + bmp->ct] + bmp->cl * 4;
+      const uint16_t *q = &(*eq->levels)[w * 3 * y];
+
+      for(int x = 0; x < w; x++, p += 4, q += 3)
+      {
+        p[0] = linearLevel(eq->lut[0][q[0]]);
+        p[1] = linearLevel(eq->lut[1][q[1]]);
+        p[2] = linearLevel(eq->lut[2][q[2]]);
+      }
+    }
+  }
+
+  // the same on a wide image, with 16-bit histograms
+  void applyWide()
+  {
+    const int w = bmp->cw;
+    const int h = bmp->ch;
+
+    std::vector<uint16_t> levels(w * h * 3);
+    std::vector<int> lut[3];
+
+    wide_type eq;
+    eq.wide = Project::wide;
+    eq.levels = &levels;
+    eq.lut = lut;
+
+    Threads::run(findLevels, 0, h - 1, &eq);
+
+    // cumulative histograms
+    const double scale = 65535.0 / (w * h);
+
+    for(int i = 0; i < 3; i++)
+    {
+      lut[i].resize(65536, 0);
+
+      for(int j = i; j < w * h * 3; j += 3)
+        lut[i][levels[j]]++;
+
+      int sum = 0;
+
+      for(int j = 0; j < 65536; j++)
+      {
+        sum += lut[i][j];
+        lut[i][j] = sum * scale;
+      }
+    }
+
+    Threads::run(remapLevels, 0, h - 1, &eq);
+    finishWide();
+  }
+
+  void apply()
+  {
+    if(Project::wide)
+    {
+      applyWide();
+      return;
+    }
+
+    const Stats::stats_type *stats = Stats::get(bmp, Stats::RGB);
+    const double scale = 255.0 / stats->count;
+    int lut[3][256];
+
+    // cumulative histograms
+    for(int i = 0; i < 3; i++)
+    {
+      int sum = 0;
+
+      for(int j = 0; j < 256; j++)
+      {
+        sum += stats->hist[i][j];
+        lut[i][j] = sum * scale;
+      }
+    }
+
+    pipeline_type pipe;
+
+    addTables(&pipe, lut[0], lut[1], lut[2]);
+    runPipeline(&pipe);
+  }
+
+  void begin()
+  {
+    pushUndoKeepStats();
+    apply();
+  }
+}
+
+namespace ValueStretch
+{
+  void apply()
+  {
+    const Stats::stats_type *stats = Stats::get(bmp, Stats::RGB);
+    const double scale = 255.0 / stats->count;
+    int lut[3][256];
+
+    // equalize, weighted by the overall color cast
+    for(int i = 0; i < 3; i++)
+    {
+      const double mean = stats->mean[i];
+      int sum = 0;
+
+      for(int j = 0; j < 256; j++)
+      {
+        sum += stats->hist[i][j];
+
+        const int a = sum * scale;
+        const int v = ((a * mean) + (j * (255 - mean))) / 255;
+
+        lut[i][j] = clamp(v, 255);
+      }
+    }
+
+    pipeline_type pipe;
+
+    addTables(&pipe, lut[0], lut[1], lut[2]);
+    runPipeline(&pipe);
+  }
+
+  void begin()
+  {
+    pushUndoKeepStats();
+    apply();
+  }
+}
+
+namespace Saturate
+{
+  struct saturate_type
+  {
+    const int *list_s;
+    double scale;
+  };
+
+  int mapColor(const int &c, const void *data)
+  {
+    const saturate_type *sat = (const saturate_type *)data;
+    const rgba_type rgba = getRgba(c);
+
+    int r = rgba.r;
+    int g = rgba.g;
+    int b = rgba.b;
+
+    const int l = getl(c);
+    int h, s, v;
+
+    Blend::rgbToHsv(r, g, b, &h, &s, &v);
+
+    // don't try to saturate grays
+    if(s == 0)
+      return c;
+
+    const int temp = s;
+    s = sat->list_s[s] * sat->scale;
+
+    if(s < temp)
+      s = temp;
+
+    Blend::hsvToRgb(h, s, v, &r, &g, &b);
+
+    return Blend::trans(c, Blend::keepLum(makeRgba(r, g, b, rgba.a), l), 255 - s);
+  }
+
+  void apply()
+  {
+    const Stats::stats_type *stats = Stats::get(bmp, Stats::SAT);
+    std::vector<int> list_s(256, 0);
+
+    const int size = stats->count;
+
+    for(int j = 0, sum = 0; j < 256; j++)
+    {
+      sum += stats->sat[j];
+      list_s[j] = sum;
+    }
+
+    saturate_type sat;
+
+    sat.list_s = &list_s[0];
+    sat.scale = 255.0 / size;
+
+    pipeline_type pipe;
+
+    addFunc(&pipe, mapColor, &sat);
+    runPipeline(&pipe);
+  }
+
+  void begin()
+  {
+    pushUndoKeepStats();
+    apply();
+  }
+}
+
+namespace RotateHue
+{
+  namespace Items
+  {
+    DialogWindow *dialog;
+    InputInt *angle;
+    CheckBox *preserve_lum;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
+
+  struct hue_type
+  {
+    int hh;
+    bool keep_lum;
+  };
+
+  int mapColor(const int &c, const void *data)
+  {
+    const hue_type *hue = (const hue_type *)data;
+    const rgba_type rgba = getRgba(c);
+
+    const int l = getl(c);
+    int r = rgba.r;
+    int g = rgba.g;
+    int b = rgba.b;
+    int h, s, v;
+
+    Blend::rgbToHsv(r, g, b, &h, &s, &v);
+    h += hue->hh;
+
+    if(h >= 1536)
+      h -= 1536;
+
+    Blend::hsvToRgb(h, s, v, &r, &g, &b);
+
+    const int c2 = makeRgba(r, g, b, rgba.a);
+
+    if(hue->keep_lum)
+      return Blend::keepLum(c2, l);
+    else
+      return c2;
+  }
+
+  void apply(int amount)
+  {
+    hue_type hue;
+
+    hue.hh = amount * 4.277;
+    hue.keep_lum = Items::preserve_lum->value();
+
+    pipeline_type pipe;
+
+    addFunc(&pipe, mapColor, &hue);
+    runPipeline(&pipe);
+  }
+
+  void close()
+  {
+    Items::dialog->hide();
+    pushUndoKeepStats();
+
+    int angle = atoi(Items::angle->value());
+
+    if(angle < 0)
+      angle += 360;
+
+    apply(angle);
+  }
+
+  void quit()
+  {
+    Gui::hideProgress();
+    Items::dialog->hide();
+  }
+
+  void begin()
+  {
+    Items::dialog->show();
+  }
+
+  void init()
+  {
+    int y1 = 8;
+
+    Items::dialog = new DialogWindow(256, 0, "Rotate Hue");
+    Items::angle = new InputInt(Items::dialog, 0, y1, 96, 24, "Angle:", 0, -359, 359);
+    y1 += 24 + 8;
+    Items::angle->maximum_size(4);
+    Items::angle->value("60");
+    Items::angle->center();
+    Items::preserve_lum = new CheckBox(Items::dialog, 0, y1, 16, 16, "Preserve Luminosity", 0);
+    Items::preserve_lum->center();
+    y1 += 16 + 8;
+    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
+    Items::ok->callback((Fl_Callback *)close);
+    Items::cancel->callback((Fl_Callback *)quit);
+    Items::dialog->set_modal();
+    Items::dialog->end();
+  }
+}
+
+namespace Invert
+{
+  // adds the filter to a pipeline, stats are updated to match
+  void addTo(pipeline_type *pipe, Stats::stats_type *stats)
+  {
+    int lut[256];
+
+    for(int j = 0; j < 256; j++)
+      lut[j] = 255 - j;
+
+    addTables(pipe, lut, lut, lut);
+    Stats::remap(stats, lut, lut, lut);
+  }
+
+  void apply()
+  {
+    int lut[256];
+
+    for(int j = 0; j < 256; j++)
+      lut[j] = 255 - j;
+
+    pipeline_type pipe;
+
+    addTables(&pipe, lut, lut, lut);
+    runPipeline(&pipe);
+  }
+
+  void begin()
+  {
+    pushUndoKeepStats();
+    apply();
+  }
+}
+
+namespace InvertAlpha
+{
+  void apply()
+  {
+    Gui::showProgress(bmp->h);
+
+    for(int y = bmp->ct; y <= bmp->cb; y++)
+    {
+      int *p = bmp->row[y] + bmp->cl;
+      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      {
+        const rgba_type rgba = getRgba(*p);
+        *p = makeRgba(rgba.r, rgba.g, rgba.b, 255 - rgba.a);
+      }
+
+      if(Gui::updateProgress(y) < 0)
+        return;
+    }
+
+    Gui::hideProgress();
+  }
+
+  void begin()
+  {
+    pushUndo();
+    apply();
+  }
+}
+
+// Corrects uneven dye fading in photographs (especially when there is a severe
+// color cast, such as when one of the dyes have faded almost completely).
+//
+// Sometimes works better before or after the restore filter depending on
+// the image.
+namespace CorrectionMatrix
+{
+  int mapColor(const int &c, const void *)
+  {
+    const rgba_type rgba = getRgba(c);
+
+    int r = rgba.r;
+    int g = rgba.g;
+    int b = rgba.b;
+    int l = getl(c);
+
+    // correction matrix
+    int ra = r;
+    int ga = (r * 4 + g * 8 + b * 1) / 13;
+    int ba = (r * 2 + g * 4 + b * 8) / 14;
+
+    ra = clamp(ra, 255);
+    ga = clamp(ga, 255);
+    ba = clamp(ba, 255);
+
+    return Blend::keepLum(makeRgba(ra, ga, ba, rgba.a), l);
+  }
+
+  void apply()
+  {
+    pipeline_type pipe;
+
+    addFunc(&pipe, mapColor, 0);
+    runPipeline(&pipe);
+  }
+
+  void begin()
+  {
+    pushUndoKeepStats();
+    apply();
+  }
+}
+
+// tries to automatically fix color/contrast problems
+namespace AutoCorrect
+{
+  namespace Items
+  {
+    DialogWindow *dialog;
+    Fl_Box *box;
+    CheckBox *normalize;
+    CheckBox *invert;
+    CheckBox *preserve_lum;
+    CheckBox *fading;
+    InputInt *hue;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
+
+  int mapColor(const int &c, const void *data)
+  {
+    const int (*lut)[256] = (const int (*)[256])data;
+    const rgba_type rgba = getRgba(c);
+    const int r = lut[0][rgba.r];
+    const int g = lut[1][rgba.g];
+    const int b = lut[2][rgba.b];
+
+    return Blend::keepLum(makeRgba(r, g, b, rgba.a), getl(c));
+  }
+
+  // the optional normalize and invert steps are part of the same pass,
+  // with the statistics they'd produce worked out from the histograms,
+  // and so are the optional dye fading correction and hue rotation after
+  // it (they don't need statistics)
+  void apply()
+  {
+    const bool keep_lum = Items::preserve_lum->value();
+    const bool invert = Items::invert->value();
+    Stats::stats_type stats = *Stats::get(bmp, Stats::RGB);
+    pipeline_type pipe;
+    int lut[3][256];
+
+    if(Items::normalize->value())
+      Normalize::addTo(&pipe, &stats);
+    if(invert)
+      Invert::addTo(&pipe, &stats);
+
+    for(int i = 0; i < 3; i++)
+    {
+      // adjustment factor from the overall color cast
+      const double mean = stats.mean[i];
+      const double adjust = (256.0f / (256 - mean))
+                              / std::sqrt(256.0f / (mean + 1));
+
+      for(int j = 0; j < 256; j++)
+      {
+        const int v = 255 * pow((double)j / 255, adjust);
+
+        lut[i][j] = clamp(v, 255);
+      }
+    }
+
+    if(keep_lum)
+      addFunc(&pipe, mapColor, lut);
+    else
+      addTables(&pipe, lut[0], lut[1], lut[2]);
+
+    if(invert)
+      Invert::addTo(&pipe, &stats);
+
+    if(Items::fading->value())
+      addFunc(&pipe, CorrectionMatrix::mapColor, 0);
+
+    RotateHue::hue_type hue;
+    int angle = atoi(Items::hue->value()) % 360;
+
+    if(angle < 0)
+      angle += 360;
+
+    if(angle)
+    {
+      hue.hh = angle * 4.277;
+      hue.keep_lum = keep_lum;
+      addFunc(&pipe, RotateHue::mapColor, &hue);
+    }
+
+    runPipeline(&pipe);
+  }
+
+  void close()
+  {
+    Items::dialog->hide();
+    pushUndoKeepStats();
+    apply();
+  }
+
+  void quit()
+  {
+    Gui::hideProgress();
+    Items::dialog->hide();
+  }
+
+  void begin()
+  {
+    Items::dialog->show();
+  }
+
+  void init()
+  {
+    int y1 = 8;
+
+    Items::dialog = new DialogWindow(384, 0, "Auto-Correct");
+    Items::box = new Fl_Box(FL_FLAT_BOX, 8, 8, 368, 32, "Automatically restores color/contrast to a bad image.");
+    Items::box->align(FL_ALIGN_INSIDE | FL_ALIGN_TOP);
+    Items::box->labelsize(12);
+    y1 += 32;
+    Items::normalize = new CheckBox(Items::dialog, 0, y1, 16, 16, "Normalize First", 0);
+    y1 += 16 + 8;
+    Items::normalize->value(1);
+    Items::normalize->center();
+    Items::invert = new CheckBox(Items::dialog, 0, y1, 16, 16, "Invert First", 0);
+    Items::invert->center();
+    y1 += 16 + 8;
+    Items::preserve_lum = new CheckBox(Items::dialog, 8, y1, 16, 16, "Preserve Luminosity", 0);
+    y1 += 16 + 8;
+    Items::preserve_lum->center();
+    Items::fading = new CheckBox(Items::dialog, 0, y1, 16, 16, "Correct Dye Fading After", 0);
+    Items::fading->center();
+    y1 += 16 + 8;
+    Items::hue = new InputInt(Items::dialog, 0, y1, 96, 24, "Rotate Hue After:", 0, -359, 359);
+    y1 += 24 + 8;
+    Items::hue->maximum_size(4);
+    Items::hue->value("0");
+    Items::hue->center();
+    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
+    Items::ok->callback((Fl_Callback *)close);
+    Items::cancel->callback((Fl_Callback *)quit);
+    Items::dialog->set_modal();
+    Items::dialog->end();
+  }
+}
+
+// Based on Geoff Daniell's restoration algorithm but differs from the
+// original Gimp plugin in the following ways:
+//
+// -Side absorption corrections are not implemented.
+// -The palette generator is not the same, and produces different results.
+// -No "make less blue" option.
+//
+// Please refer to the original Gimp plugin source in redist directory.
+namespace Restore
+{
+  namespace Items
+  {
+    DialogWindow *dialog;
+    Fl_Box *box;
+    InputInt *contrast;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
+
+  // for storing floating-point adjustment factors etc
+  class Triplet
+  {
+  public:
+    Triplet(float x, float y, float z)
+    {
+      set(x, y, z);
+    }
+
+    ~Triplet()
+    {
+    }
+
+    void set(float x, float y, float z)
+    {
+      value[0] = x;
+      value[1] = y;
+      value[2] = z;
+    }
+
+    void copy(Triplet src)
+    {
+      value[0] = src.value[0];
+      value[1] = src.value[1];
+      value[2] = src.value[2];
+    }
+
+    float value[3];
+  };
+
+  // this stores one channel from a palette into the destination buffer
+  void getSlice(const Palette *pal, const int channel, int *dest)
+  {
+    switch(channel)
+    {
+      case 0:
+        for(int i = 0; i < pal->max; i++)
+          dest[i] = getr(pal->data[i]);
+        break;
+      case 1:
+        for(int i = 0; i < pal->max; i++)
+          dest[i] = getg(pal->data[i]);
+        break;
+      case 2:
+        for(int i = 0; i < pal->max; i++)
+          dest[i] = getb(pal->data[i]);
+        break;
+    }
+  }
+
+  // scale/gamma
+  inline float levels_value(const float &value,
+                          const int &in_min, const int &in_max,
+                          const float &gamma,
+                          const int &out_min, const int &out_max)
+  {
+//    float v = (float)(value - in_min) / ((in_max - in_min) + 1);
+//    v = powf(v, 1.0f / gamma);
+//    v = v * (out_max - out_min) + out_min;
+    float v;
+
+    if(in_max != in_min)
+      v = (float)(value - in_min) / ((in_max - in_min) + 1);
+    else
+      v = (float)(value - in_min) / 255;
+
+    if(v > 1.0f)
+      v = 1.0f;
+    if(v < 0)
+      v = 0;
+
+    v = powf(v, 1.0f / gamma);
+
+    if(out_max >= out_min)
+      v = v * (out_max - out_min) + out_min;
+    else if(out_max < out_min)
+      v = out_min - v * (out_min - out_max);
+
+//    return clamp((int)v, 255);
+    return v;
+  }
+
+  // this emulates the levels function in GIMP
+  void levels(Bitmap *temp,
+              const int channel,
+              const int in_min, const int in_max,
+              const float gamma,
+              const int out_min, const int out_max)
+  {
+    for(int y = temp->ct; y < temp->cb; y++)
+    {
+      int *p = temp->row[y] + temp->cl;
+      for(int x = temp->cl; x < temp->cr; x++, p++)
+      {
+        const rgba_type rgba = getRgba(*p);
+        int r = rgba.r;
+        int g = rgba.g;
+        int b = rgba.b;
+
+        switch(channel)
+        {
+          case 0:
+            r = (int)levels_value(r, in_min, in_max, gamma, out_min, out_max);
+            break;
+          case 1:
+            g = (int)levels_value(g, in_min, in_max, gamma, out_min, out_max);
+            break;
+          case 2:
+            b = (int)levels_value(b, in_min, in_max, gamma, out_min, out_max);
+            break;
+        }
+
+        *p = makeRgb(r, g, b);
+      }
+    }
+  }
+
+  // the same on the wide image, levels are still given on an 8-bit
+  // scale but the result keeps the wide image's precision
+  void levelsWide(const int channel,
+                  const int in_min, const int in_max,
+                  const float gamma,
+                  const int out_min, const int out_max)
+  {
+    Raster<float> *wide = Project::wide;
+
+    for(int y = bmp->ct; y < bmp->cb; y++)
+    {
+      float *p = wide->row[y] + bmp->cl * 4;
+
+      for(int x = bmp->cl; x < bmp->cr; x++, p += 4)
+      {
+        const float v = levels_value(gammaLevel(p[channel]) / 257.0f,
+                                     in_min, in_max, gamma, out_min, out_max);
+
+        p[channel] = linearLevel(clamp((int)(v * 257 + 0.5f), 65535));
+        p[3] = 65535;
+      }
+    }
+  }
+
+  // find m through successive approximation
+  float percentile(const int *c, const float &f, const int &max)
+  {
+    int n = 0;
+
+    for(int i = 0; i < max; i++)
+    {
+      if(c[i] > 0)
+        n++;
+    }
+
+    const int nf = (int)(n * f);
+    int m = -1;
+    int k = 0;
+
+    while(k < nf)
+    {
+      m++;
+      k = 0;
+
+      for(int i = 0; i < max; i++)
+      {
+        if(c[i] > 0 && c[i] <= m)
+          k++;
+      }
+    }
+
+    return (float)m;
+  }
+
+  struct color_range_type
+  {
+    float hi[3], lo[3];
+  };
+
+  struct color_range_type colormap(Bitmap *src,
+                                   Triplet alpha, Triplet m,
+                                   float top, float bot)
+  {
+    // duplicate image
+    Bitmap small_copy(src->w, src->h);
+    src->blit(&small_copy, 0, 0, 0, 0, src->w, src->h);
+
+    // restore
+    for(int i = 0; i < 3; i++)
+      levels(&small_copy, i, 0, m.value[i], alpha.value[i], 0, 255);
+
+    // get new colormap
+    Palette pal;
+    Quantize::fast(&small_copy, &pal, 256);
+
+    // return color range
+    int slice[256];
+    color_range_type color_range;
+
+    for(int i = 0; i < 3; i++)
+    {
+      getSlice(&pal, i, slice);
+      color_range.hi[i] = percentile(slice, top, pal.max);
+      color_range.lo[i] = percentile(slice, bot, pal.max);
+    }
+
+    return color_range;
+  }
+
+  void apply(float contrast)
+  {
+    // make small copy
+    Bitmap small_image(bmp->w / 10, bmp->h / 10);
+    bmp->scale(&small_image);
+
+    // get initial percentiles
+    float top = 1.0f;
+    float bot = 0.1f;
+
+    struct color_range_type color_range;
+    color_range = colormap(&small_image,
+                           Triplet(1.0f, 1.0f, 1.0f),
+                           Triplet(255, 255, 255),
+                           top,
+                           bot);
+
+    // get initial m and alpha
+    Triplet init_alpha(0, 0, 0);
+    Triplet init_m(0, 0, 0);
+
+    for(int i = 0; i < 3; i++)
+    {
+      float hi = color_range.hi[i];
+      float lo = color_range.lo[i];
+
+      init_m.value[i] = expf((logf(top) * logf(lo) - logf(bot) * logf(hi))
+                            / (logf(top) - logf(bot)));
+      init_alpha.value[i] = (logf(lo) - logf(init_m.value[i])) / logf(bot);
+    }
+
+    // iterate to get correct m and alpha
+    Triplet alpha(0, 0, 0);
+    Triplet m(0, 0, 0);
+    alpha.copy(init_alpha);
+    m.copy(init_m);
+    Triplet d_alpha(1.0f, 1.0f, 1.0f);
+    Triplet d_m(0, 0, 0);
+
+    int iter = 0;
+
+    while(std::max(ExtraMath::abs(d_alpha.value[0]),
+                   std::max(ExtraMath::abs(d_alpha.value[1]),
+                            ExtraMath::abs(d_alpha.value[2]))) > 0.02f)
+    {
+      iter++;
+      if(iter == 10)
+        break;
+
+      for(int i = 0; i < 3; i++)
+      {
+        if(alpha.value[i] < 0.1f || alpha.value[i] > 10.0f)
+        {
+          Dialog::message("Error", "The image has deteriorated too far to restore.");
+          return;
+        }
+      }
+
+      color_range = colormap(&small_image, alpha, m, top, bot);
+        
+      for(int i = 0; i < 3; i++)
+      {
+        float hi = color_range.hi[i];
+        float lo = color_range.lo[i];
+
+        d_alpha.value[i] = alpha.value[i] * alpha.value[i]
+                           * (lo / (255.0f * bot) - 1) / logf(bot);
+        d_m.value[i] = alpha.value[i] * (hi - 255.0f * top);
+
+        if(ExtraMath::abs(d_alpha.value[i]) > 0.2f * alpha.value[i])
+        {
+          d_alpha.value[i] = 0.2f * alpha.value[i] * d_alpha.value[i]
+                                    / ExtraMath::abs(d_alpha.value[i]);
+        }
+
+        alpha.value[i] += d_alpha.value[i];
+        m.value[i] += d_m.value[i];
+      }
+    }
+
+    // if loop failed to converge use initial values
+    if(iter == 10)
+    {
+      Dialog::message("Error", "The image has deteriorated badly, the restoration\n is probably poor but may be an improvement on the original.");
+      alpha.copy(init_alpha);
+      m.copy(init_m);
+    }
+
+    // create restored image
+    for(int i = 0; i < 3; i++)
+      levels(&small_image, i, 0, m.value[i], alpha.value[i], 0, 255);
+
+    // get color map of restored image
+    Palette pal;
+    Quantize::fast(&small_image, &pal, 256);
+
+    float newc[3][256];
+
+    for(int i = 0; i < 3; i++)
+    {
+      int temp[256];
+
+      getSlice(&pal, i, temp);
+
+      for(int j = 0; j < pal.max; j++)
+        newc[i][j] = (float)temp[j];
+    }
+
+    // average color
+    float av[256];
+
+    for(int i = 0; i < pal.max; i++)
+      av[i] = (newc[0][i] + newc[1][i] + newc[2][i]) / (3 * 255);
+
+    // tweak restoration
+    Triplet lambda(1.0f, 1.0f, 1.0f);
+    Triplet sigma(1.0f, 1.0f, 1.0f);
+
+    bool ok = true;
+
+    for(int i = 0; i < 3; i++)
+    {
+      float lambda_c = 1.0f;
+      float d_lambda_c = 1.0f;
+      float l[256]; 
+
+      for(int j = 0; j < pal.max; j++)
+        l[j] = logf((newc[i][j] + 1.0f) / 255);
+
+      iter = 0;
+      float sig = 0;
+
+      while(ExtraMath::abs(d_lambda_c) > 1e-4f)
+      {
+        iter++;
+        if(iter >= 20)
+          break;
+
+        float pc[256];
+        float ppl = 0;
+        float ppll = 0;
+        float pp = 0;
+        float ap = 0;
+        float apl = 0;
+        float apll = 0;
+
+        for(int j = 0; j < pal.max; j++)
+        {
+          pc[j] = powf(newc[i][j] / 255, lambda_c);
+          ppl += pc[j] * pc[j] * l[j];
+          ppll += pc[j] * pc[j] * l[j] * l[j];
+          pp += pc[j] * pc[j];
+          ap += av[j] * pc[j];
+          apl += av[j] * pc[j] * l[j];
+          apll += av[j] * pc[j] * l[j] * l[j];
+        }
+
+        sig = ap / pp;
+        d_lambda_c = -(apl - sig * ppl) / (apll - 2 * sig * ppll);
+        lambda_c += d_lambda_c;
+      }   
+
+      lambda.value[i] = lambda_c;
+      sigma.value[i] = sig;
+
+      if(iter == 20)
+        ok = false;
+    }
+
+    // if loop fails to converge use default values
+    if(!ok)
+    {
+      lambda.set(1.0f, 1.0f, 1.0f);
+      sigma.set(1.0f, 1.0f, 1.0f);
+    }
+
+    float smin = std::min(sigma.value[0],
+                          std::min(sigma.value[1], sigma.value[2]));
+
+    // adjust parameters
+    for(int i = 0; i < 3; i++)
+    {
+      alpha.value[i] /= lambda.value[i];
+      sigma.value[i] /= smin;
+      m.value[i] /= powf(sigma.value[i], alpha.value[i]);
+    }
+
+    // implement degree of restoration and restore
+    contrast /= 100;
+
+    for(int i = 0; i < 3; i++)
+    {
+      alpha.value[i] = 1.0f - contrast * (1.0f - alpha.value[i]);
+      m.value[i] = 255.0f - contrast * (255.0f - m.value[i]);
+
+      if(Project::wide)
+        levelsWide(i, 0, m.value[i], alpha.value[i], 0, 255);
+      else
+        levels(bmp, i, 0, m.value[i], alpha.value[i], 0, 255);
+    }
+
+    finishWide();
+
+    // correct side absorptions
+    Gui::hideProgress();
+  }
+
+  void close()
+  {
+    Items::dialog->hide();
+    pushUndo();
+
+    apply(atoi(Items::contrast->value()));
+  }
+
+  void quit()
+  {
+    Gui::hideProgress();
+    Items::dialog->hide();
+  }
+
+  void begin()
+  {
+    Items::dialog->show();
+  }
+
+  void init()
+  {
+    int y1 = 8;
+
+    Items::dialog = new DialogWindow(384, 0, "Restore");
+    Items::box = new Fl_Box(FL_FLAT_BOX, 8, 8, 368, 48, "Restores faded color photographs and slides.\n (Based Geoff Daniell's Restore algorithm, but is not identical.)");
+    Items::box->align(FL_ALIGN_INSIDE | FL_ALIGN_TOP);
+    Items::box->labelsize(12);
+    y1 += 48;
+    Items::contrast = new InputInt(Items::dialog, 0, y1, 96, 24, "Contrast:", 0, 1, 150);
+    y1 += 24 + 8;
+    Items::contrast->maximum_size(4);
+    Items::contrast->value("100");
+    Items::contrast->center();
+//    y1 += 16 + 8;
+    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
+    Items::ok->callback((Fl_Callback *)close);
+    Items::cancel->callback((Fl_Callback *)quit);
+    Items::dialog->set_modal();
+    Items::dialog->end();
+  }
+}
+
+namespace RemoveDust
+{
+  namespace Items
+  {
+    DialogWindow *dialog;
+    Fl_Box *box;
+    InputInt *amount;
+    CheckBox *invert;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
+
+  void kernel(const tile_type &tile, void *data)
+  {
+    const int amount = *(int *)data;
+
+    for(int y = 0; y < tile.h; y++)
+    {
+      const int *above = tile.srcRow(y - 1);
+      const int *p = tile.srcRow(y);
+      const int *below = tile.srcRow(y + 1);
+      int *d = tile.destRow(y);
+
+      for(int x = 0; x < tile.w; x++)
+      {
+        const int test = p[x];
+        int c[8];
+
+        c[0] = p[x + 1];
+        c[1] = p[x - 1];
+        c[2] = below[x];
+        c[3] = above[x];
+        c[4] = above[x - 1];
+        c[5] = above[x + 1];
+        c[6] = below[x - 1];
+        c[7] = below[x + 1];
+
+        int r = 0;
+        int g = 0;
+        int b = 0;
+
+        for(int i = 0; i < 8; i++)
+        {
+          rgba_type rgba = getRgba(c[i]);
+          r += rgba.r;
+          g += rgba.g;
+          b += rgba.b;
+        }
+
+        const int avg = makeRgba(r / 8, g / 8, b / 8, geta(test));
+
+        if((getl(avg) - getl(test)) > amount)
+          d[x] = avg;
+        else
+          d[x] = test;
+      }
+    }
+  }
+
+  void apply(int amount)
+  {
+    filterTiles(kernel, &amount, 1);
+  }
+
+  void close()
+  {
+    Items::dialog->hide();
+    pushUndo();
+
+    if(Items::invert->value())
+      Invert::apply();
+
+    apply(atoi(Items::amount->value()));
+
+    if(Items::invert->value())
+      Invert::apply();
+  }
+
+  void quit()
+  {
+    Gui::hideProgress();
+    Items::dialog->hide();
+  }
+
+  void begin()
+  {
+    Items::dialog->show();
+  }
+
+  void init()
+  {
+    int y1 = 8;
+
+    Items::dialog = new DialogWindow(384, 0, "Remove Dust");
+    Items::box = new Fl_Box(FL_FLAT_BOX, 8, 8, 368, 32, "Removes dust from scanned images.");
+    Items::box->align(FL_ALIGN_INSIDE | FL_ALIGN_TOP);
+    Items::box->labelsize(12);
+    y1 += 32;
+    Items::amount = new InputInt(Items::dialog, 0, y1, 96, 24, "Amount:", 0, 1, 10);
+    y1 += 24 + 8;
+    Items::amount->value("4");
+    Items::amount->center();
+    Items::invert = new CheckBox(Items::dialog, 0, y1, 16, 16, "Invert First", 0);
+    y1 += 16 + 8;
+    Items::invert->center();
+    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
+    Items::ok->callback((Fl_Callback *)close);
+    Items::cancel->callback((Fl_Callback *)quit);
+    Items::dialog->set_modal();
+    Items::dialog->end();
+  }
+}
+
+namespace Median
+{
+  namespace Items
+  {
+    DialogWindow *dialog;
+    InputInt *radius;
+    InputInt *percentile;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
+
+  struct median_type
+  {
+    int radius;
+    int percentile;
+  };
+
+  // Perreault & Hebert, "Median Filtering in Constant Time"
+  // each column keeps a histogram of the pixels in the window height,
+  // moving down a row updates every column with one add and one remove,
+  // moving right updates the window histogram with one column added
+  // and one removed, histograms are split into 16 coarse bins and the
+  // fine bins of the window are only brought up to date when the search
+  // lands in them
+  void kernel(const tile_type &tile, void *data)
+  {
+    const median_type *m = (median_type *)data;
+    const int r = m->radius;
+    const int size = r * 2 + 1;
+    const int rank = (size * size - 1) * m->percentile / 100;
+    const int cols = tile.w + r * 2;
+
+    std::vector<uint16_t> coarse(cols * 16);
+    std::vector<uint16_t> fine(cols * 256);
+    uint16_t window_coarse[16];
+    uint16_t window_fine[256];
+    int last[16];
+
+    for(int channel = 0; channel < 4; channel++)
+    {
+      const int shift = channel * 8;
+
+      std::fill(coarse.begin(), coarse.end(), 0);
+      std::fill(fine.begin(), fine.end(), 0);
+
+      for(int v = -r; v <= r; v++)
+      {
+        const int *s = tile.srcRow(v) - r;
+
+        for(int i = 0; i < cols; i++)
+        {
+          const int c = (s[i] >> shift) & 255;
+
+          coarse[i * 16 + (c >> 4)]++;
+          fine[i * 256 + c]++;
+        }
+      }
+
+      for(int y = 0; y < tile.h; y++)
+      {
+        if(y > 0)
+        {
+          const int *out = tile.srcRow(y - r - 1) - r;
+          const int *in = tile.srcRow(y + r) - r;
+
+          for(int i = 0; i < cols; i++)
+          {
+            const int c1 = (out[i] >> shift) & 255;
+            const int c2 = (in[i] >> shift) & 255;
+
+            coarse[i * 16 + (c1 >> 4)]--;
+            fine[i * 256 + c1]--;
+            coarse[i * 16 + (c2 >> 4)]++;
+            fine[i * 256 + c2]++;
+          }
+        }
+
+        for(int k = 0; k < 16; k++)
+        {
+          window_coarse[k] = 0;
+          last[k] = -size - 1;
+        }
+
+        for(int i = 0; i < size; i++)
+          for(int k = 0; k < 16; k++)
+            window_coarse[k] += coarse[i * 16 + k];
+
+        int *d = tile.destRow(y);
+
+        for(int x = 0; x < tile.w; x++)
+        {
+          if(x > 0)
+          {
+            const uint16_t *in = &coarse[(x + r * 2) * 16];
+            const uint16_t *out = &coarse[(x - 1) * 16];
+
+            for(int k = 0; k < 16; k++)
+              window_coarse[k] += in[k] - out[k];
+          }
+
+          int sum = 0;
+          int c = 0;
+
+          while(sum + window_coarse[c] <= rank)
+            sum += window_coarse[c++];
+
+          uint16_t *wf = window_fine + c * 16;
+
+          if(x - last[c] > r)
+          {
+            for(int k = 0; k < 16; k++)
+              wf[k] = 0;
+
+            for(int i = x; i < x + size; i++)
+            {
+              const uint16_t *f = &fine[i * 256 + c * 16];
+
+              for(int k = 0; k < 16; k++)
+                wf[k] += f[k];
+            }
+          }
+          else
+          {
+            for(int j = last[c] + 1; j <= x; j++)
+            {
+              const uint16_t *in = &fine[(j + r * 2) * 256 + c * 16];
+              const uint16_t *out = &fine[(j - 1) * 256 + c * 16];
+
+              for(int k = 0; k < 16; k++)
+                wf[k] += in[k] - out[k];
+            }
+          }
+
+          last[c] = x;
+
+          int f = 0;
+
+          while(sum + wf[f] <= rank)
+            sum += wf[f++];
+
+          const unsigned int val = c * 16 + f;
+
+          if(channel == 0)
+            d[x] = val;
+          else
+            d[x] = (int)(((unsigned int)d[x] & ~(255u << shift))
+                         | (val << shift));
+        }
+      }
+    }
+  }
+
+  void apply(int radius, int percentile)
+  {
+    median_type m;
+
+    m.radius = radius;
+    m.percentile = percentile;
+
+    filterTiles(kernel, &m, radius);
+  }
+
+  void close()
+  {
+    Items::dialog->hide();
+    pushUndo();
+    apply(atoi(Items::radius->value()), atoi(Items::percentile->value()));
+  }
+
+  void quit()
+  {
+    Gui::hideProgress();
+    Items::dialog->hide();
+  }
+
+  void begin()
+  {
+    Items::dialog->show();
+  }
+
+  void init()
+  {
+    int y1 = 8;
+
+    Items::dialog = new DialogWindow(256, 0, "Median");
+    Items::radius = new InputInt(Items::dialog, 0, y1, 96, 24, "Radius:", 0, 1, 100);
+    y1 += 24 + 8;
+    Items::radius->value("2");
+    Items::radius->center();
+    Items::percentile = new InputInt(Items::dialog, 0, y1, 96, 24, "Percentile:", 0, 0, 100);
+    y1 += 24 + 8;
+    Items::percentile->value("50");
+    Items::percentile->center();
+    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
+    Items::ok->callback((Fl_Callback *)close);
+    Items::cancel->callback((Fl_Callback *)quit);
+    Items::dialog->set_modal();
+    Items::dialog->end();
+  }
+}
+
+namespace Desaturate
+{
+  int mapColor(const int &c, const void *)
+  {
+    const int l = getl(c);
+
+    return makeRgba(l, l, l, geta(c));
+  }
+
+  void apply()
+  {
+    pipeline_type pipe;
+
+    addFunc(&pipe, mapColor, 0);
+    runPipeline(&pipe);
+  }
+
+  void begin()
+  {
+    pushUndoKeepStats();
+    apply();
+  }
+}
+
+namespace Colorize
+{
+  int mapColor(const int &c, const void *data)
+  {
+    const rgba_type *rgba_color = (const rgba_type *)data;
+    const rgba_type rgba = getRgba(c);
+
+    int r = rgba.r;
+    int g = rgba.g;
+    int b = rgba.b;
+    int h, s, v;
+
+    Blend::rgbToHsv(r, g, b, &h, &s, &v);
+
+    int sat = s;
+
+    if(sat < 64)
+      sat = 64;
+
+    r = rgba_color->r;
+    g = rgba_color->g;
+    b = rgba_color->b;
+    Blend::rgbToHsv(r, g, b, &h, &s, &v);
+    Blend::hsvToRgb(h, (sat * s) / (sat + s), v, &r, &g, &b);
+
+    return Blend::colorizeLuminosity(c, makeRgba(r, g, b, rgba.a), 0);
+  }
+
+  void apply()
+  {
+    const rgba_type rgba_color = getRgba(Project::brush->color);
+    pipeline_type pipe;
+
+    addFunc(&pipe, mapColor, &rgba_color);
+    runPipeline(&pipe);
+  }
+
+  void begin()
+  {
+    pushUndoKeepStats();
+    apply();
+  }
+}
+
+namespace DitherImage
+{
+  namespace Items
+  {
+    DialogWindow *dialog;
+    Fl_Choice *mode;
+    CheckBox *gamma;
+    CheckBox *lum_only;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
+
+  enum
+  {
+    THRESHOLD,
+    FLOYD,
+    JARVIS,
+    STUCKI,
+    ATKINSON,
+    SIERRA,
+    BAYER2,
+    BAYER4,
+    BAYER8,
+    BAYER16,
+    BLUE_NOISE
+  };
+ 
+  namespace Threshold
+  {
+    int matrix[3][5] =
+    {
+      { 0, 0, 0, 0, 0 },
+      { 0, 0, 0, 0, 0 },
+      { 0, 0, 0, 0, 0 },
+    };
+
+    const int div = 1;
   }
-}
 
-// tries to automatically fix color/contrast problems
-namespace AutoCorrect
-{
-  namespace Items
+  namespace Floyd
   {
-    DialogWindow *dialog;
-    Fl_Box *box;
-    CheckBox *normalize;
-    CheckBox *invert;
-    CheckBox *preserve_lum;
-    Fl_Button *ok;
-    Fl_Button *cancel;
+    int matrix[3][5] =
+    {
+      { 0, 0, 0, 7, 0 },
+      { 0, 3, 5, 1, 0 },
+      { 0, 0, 0, 0, 0 },
+    };
+
+    const int div = 16;
   }
 
-  void apply()
+  namespace Jarvis
   {
-    double rr = 0;
-    double gg = 0;
-    double bb = 0;
-    int count = 0;
+    int matrix[3][5] =
+    {
+      { 0, 0, 0, 7, 5 },
+      { 3, 5, 7, 5, 3 },
+      { 1, 3, 5, 3, 1 }
+    };
 
-    const bool keep_lum = Items::preserve_lum->value();
+    const int div = 48;
+  }
 
-    // determine overall color cast
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+  namespace Stucki
+  {
+    int matrix[3][5] =
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      { 0, 0, 0, 8, 4 },
+      { 2, 4, 8, 4, 2 },
+      { 1, 2, 4, 2, 1 }
+    };
+
+    const int div = 42;
+  }
+
+  namespace Atkinson
+  {
+    int matrix[3][5] =
+    {
+      { 0, 0, 0, 1, 1 },
+      { 0, 1, 1, 1, 0 },
+      { 0, 0, 1, 0, 0 }
+    };
+
+    const int div = 8;
+  }
+
+  namespace Sierra
+  {
+    int matrix[3][5] =
+    {
+      { 0, 0, 0, 5, 3 },
+      { 2, 4, 5, 4, 2 },
+      { 0, 2, 3, 2, 0 }
+    };
+
+    const int div = 32;
+  }
+
+  // ordered dithering, a threshold pattern is tiled over the image and
+  // shifts each pixel by up to half the typical palette spacing before
+  // the palette lookup, so every pixel can be done independently
+  // (there's no error to carry, so this works on the stored values and
+  // ignores the gamma option)
+  namespace Ordered
+  {
+    // recursive Bayer matrix, size is a power of two
+    void makeBayer(std::vector<int> *rank, int size)
+    {
+      rank->assign(1, 0);
+
+      for(int n = 1; n < size; n *= 2)
       {
-        const rgba_type rgba = getRgba(*p);
+        std::vector<int> next(n * 2 * n * 2);
 
-        rr += rgba.r;
-        gg += rgba.g;
-        bb += rgba.b;
+        for(int y = 0; y < n; y++)
+        {
+          for(int x = 0; x < n; x++)
+          {
+            const int m = (*rank)[y * n + x] * 4;
 
-        count++;
+            next[y * n * 2 + x] = m;
+            next[y * n * 2 + x + n] = m + 2;
+            next[(y + n) * n * 2 + x] = m + 3;
+            next[(y + n) * n * 2 + x + n] = m + 1;
+          }
+        }
+
+        rank->swap(next);
       }
     }
 
-    rr /= count;
-    gg /= count;
-    bb /= count;
+    // adds (sign 1) or removes (sign -1) a point's share of the energy
+    void splat(std::vector<float> *energy, const std::vector<float> &kernel,
+               int size, int index, float sign)
+    {
+      const int px = index % size;
+      const int py = index / size;
 
-    // adjustment factors
-    const double ra = (256.0f / (256 - rr)) / std::sqrt(256.0f / (rr + 1));
-    const double ga = (256.0f / (256 - gg)) / std::sqrt(256.0f / (gg + 1));
-    const double ba = (256.0f / (256 - bb)) / std::sqrt(256.0f / (bb + 1));
+      for(int y = 0; y < size; y++)
+      {
+        const int ky = (y - py + size) % size;
 
-    // begin restore
-    Gui::showProgress(bmp->h);
+        for(int x = 0; x < size; x++)
+        {
+          const int kx = (x - px + size) % size;
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+          (*energy)[y * size + x] += sign * kernel[ky * size + kx];
+        }
+      }
+    }
+
+    // tightest cluster (state 1) or largest void (state 0)
+    int findPoint(const std::vector<float> &energy,
+                  const std::vector<char> &on, int state)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      int best = -1;
+
+      for(int i = 0; i < (int)on.size(); i++)
       {
-        const rgba_type rgba = getRgba(*p);
-        int r = rgba.r;
-        int g = rgba.g;
-        int b = rgba.b;
-        const int l = getl(*p);
+        if(on[i] != state)
+          continue;
 
-        // apply adjustments
-        r = 255 * pow((double)r / 255, ra);
-        g = 255 * pow((double)g / 255, ga);
-        b = 255 * pow((double)b / 255, ba);
+        if(best < 0 || (state ? energy[i] > energy[best]
+                              : energy[i] < energy[best]))
+        {
+          best = i;
+        }
+      }
 
-        r = clamp(r, 255);
-        g = clamp(g, 255);
-        b = clamp(b, 255);
+      return best;
+    }
 
-        if(keep_lum)
-          *p = Blend::keepLum(makeRgba(r, g, b, rgba.a), l);
-        else
-          *p = makeRgba(r, g, b, rgba.a);
+    // tileable blue noise using the void-and-cluster method, the ranks
+    // of points follow the order they're added to the pattern
+    void makeBlueNoise(std::vector<int> *rank, int size)
+    {
+      const int count = size * size;
+      const double sigma = 1.5;
+      std::vector<float> kernel(count);
+      std::vector<float> energy(count, 0);
+      std::vector<char> on(count, 0);
+
+      // wrapped gaussian
+      for(int y = 0; y < size; y++)
+      {
+        for(int x = 0; x < size; x++)
+        {
+          const int dx = std::min(x, size - x);
+          const int dy = std::min(y, size - y);
+
+          kernel[y * size + x] =
+            std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
       }
 
-      if(Gui::updateProgress(y) < 0)
-        return;
-    }
+      // random initial pattern, the same every time
+      unsigned int seed = 12345;
+      int ones = 0;
 
-    Gui::hideProgress();
-  }
+      while(ones < count / 10)
+      {
+        seed = seed * 1103515245 + 12345;
 
-  void close()
-  {
-    Items::dialog->hide();
-    pushUndo();
+        const int i = (seed >> 8) % count;
 
-    if(Items::normalize->value())
-      Normalize::apply();
-    if(Items::invert->value())
-      Invert::apply();
+        if(!on[i])
+        {
+          on[i] = 1;
+          splat(&energy, kernel, size, i, 1);
+          ones++;
+        }
+      }
 
-    apply();
+      // spread it out until moving the tightest cluster changes nothing
+      for(int i = 0; i < count; i++)
+      {
+        const int cluster = findPoint(energy, on, 1);
 
-    if(Items::invert->value())
-      Invert::apply();
-  }
+        on[cluster] = 0;
+        splat(&energy, kernel, size, cluster, -1);
 
-  void quit()
-  {
-    Gui::hideProgress();
-    Items::dialog->hide();
-  }
+        const int gap = findPoint(energy, on, 0);
 
-  void begin()
-  {
-    Items::dialog->show();
-  }
+        on[gap] = 1;
+        splat(&energy, kernel, size, gap, 1);
 
-  void init()
-  {
-    int y1 = 8;
+        if(gap == cluster)
+          break;
+      }
 
-    Items::dialog = new DialogWindow(384, 0, "Auto-Correct");
-    Items::box = new Fl_Box(FL_FLAT_BOX, 8, 8, 368, 32, "Automatically restores color/contrast to a bad image.");
-    Items::box->align(FL_ALIGN_INSIDE | FL_ALIGN_TOP);
-    Items::box->labelsize(12);
-    y1 += 32;
-    Items::normalize = new CheckBox(Items::dialog, 0, y1, 16, 16, "Normalize First", 0);
-    y1 += 16 + 8;
-    Items::normalize->value(1);
-    Items::normalize->center();
-    Items::invert = new CheckBox(Items::dialog, 0, y1, 16, 16, "Invert First", 0);
-    Items::invert->center();
-    y1 += 16 + 8;
-    Items::preserve_lum = new CheckBox(Items::dialog, 8, y1, 16, 16, "Preserve Luminosity", 0);
-    y1 += 16 + 8;
-    Items::preserve_lum->center();
-    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
-    Items::ok->callback((Fl_Callback *)close);
-    Items::cancel->callback((Fl_Callback *)quit);
-    Items::dialog->set_modal();
-    Items::dialog->end();
-  }
-}
+      rank->resize(count);
 
-// Based on Geoff Daniell's restoration algorithm but differs from the
-// original Gimp plugin in the following ways:
-//
-// -Side absorption corrections are not implemented.
-// -The palette generator is not the same, and produces different results.
-// -No "make less blue" option.
-//
-// Please refer to the original Gimp plugin source in redist directory.
-namespace Restore
-{
-  namespace Items
-  {
-    DialogWindow *dialog;
-    Fl_Box *box;
-    InputInt *contrast;
-    Fl_Button *ok;
-    Fl_Button *cancel;
-  }
+      // rank the initial points by removing them
+      std::vector<float> saved_energy = energy;
+      std::vector<char> saved_on = on;
 
-  // for storing floating-point adjustment factors etc
-  class Triplet
-  {
-  public:
-    Triplet(float x, float y, float z)
-    {
-      set(x, y, z);
-    }
+      for(int r = ones - 1; r >= 0; r--)
+      {
+        const int cluster = findPoint(energy, on, 1);
 
-    ~Triplet()
-    {
-    }
+        on[cluster] = 0;
+        splat(&energy, kernel, size, cluster, -1);
+        (*rank)[cluster] = r;
+      }
 
-    void set(float x, float y, float z)
-    {
-      value[0] = x;
-      value[1] = y;
-      value[2] = z;
-    }
+      // then fill the remaining voids
+      energy = saved_energy;
+      on = saved_on;
 
-    void copy(Triplet src)
-    {
-      value[0] = src.value[0];
-      value[1] = src.value[1];
-      value[2] = src.value[2];
-    }
+      for(int r = ones; r < count; r++)
+      {
+        const int gap = findPoint(energy, on, 0);
 
-    float value[3];
-  };
+        on[gap] = 1;
+        splat(&energy, kernel, size, gap, 1);
+        (*rank)[gap] = r;
+      }
+    }
 
-  // this stores one channel from a palette into the destination buffer
-  void getSlice(const Palette *pal, const int channel, int *dest)
-  {
-    switch(channel)
+    // ranks for the selected mode, built once
+    const std::vector<int> &getRanks(int mode, int *size)
     {
-      case 0:
-        for(int i = 0; i < pal->max; i++)
-          dest[i] = getr(pal->data[i]);
-        break;
-      case 1:
-        for(int i = 0; i < pal->max; i++)
-          dest[i] = getg(pal->data[i]);
-        break;
-      case 2:
-        for(int i = 0; i < pal->max; i++)
-          dest[i] = getb(pal->data[i]);
-        break;
-    }
-  }
+      static std::vector<int> bayer[4];
+      static std::vector<int> blue_noise;
 
-  // scale/gamma
-  inline int levels_value(const int &value,
-                          const int &in_min, const int &in_max,
-                          const float &gamma,
-                          const int &out_min, const int &out_max)
-  {
-//    float v = (float)(value - in_min) / ((in_max - in_min) + 1);
-//    v = powf(v, 1.0f / gamma);
-//    v = v * (out_max - out_min) + out_min;
-    float v;
+      if(mode == BLUE_NOISE)
+      {
+        *size = 64;
 
-    if(in_max != in_min)
-      v = (float)(value - in_min) / ((in_max - in_min) + 1);
-    else
-      v = (float)(value - in_min) / 255;
+        if(blue_noise.empty())
+          makeBlueNoise(&blue_noise, *size);
 
-    if(v > 1.0f)
-      v = 1.0f;
-    if(v < 0)
-      v = 0;
+        return blue_noise;
+      }
 
-    v = powf(v, 1.0f / gamma);
+      const int index = mode - BAYER2;
 
-    if(out_max >= out_min)
-      v = v * (out_max - out_min) + out_min;
-    else if(out_max < out_min)
-      v = out_min - v * (out_min - out_max);
+      *size = 2 << index;
 
-//    return clamp((int)v, 255);
-    return (int)v;
-  }
+      if(bayer[index].empty())
+        makeBayer(&bayer[index], *size);
 
-  // this emulates the levels function in GIMP
-  void levels(Bitmap *temp,
-              const int channel,
-              const int in_min, const int in_max,
-              const float gamma,
-              const int out_min, const int out_max)
-  {
-    for(int y = temp->ct; y < temp->cb; y++)
+      return bayer[index];
+    }
+
+    // typical distance between palette colors (median of the distances
+    // to the nearest other color)
+    int getSpread(bool lum_only)
     {
-      int *p = temp->row[y] + temp->cl;
-      for(int x = temp->cl; x < temp->cr; x++, p++)
+      const int *data = Project::palette->data;
+      const int max = Project::palette->max;
+      std::vector<int> nearest;
+
+      for(int i = 0; i < max; i++)
       {
-        const rgba_type rgba = getRgba(*p);
-        int r = rgba.r;
-        int g = rgba.g;
-        int b = rgba.b;
+        int best = -1;
 
-        switch(channel)
+        for(int j = 0; j < max; j++)
         {
-          case 0:
-            r = levels_value(r, in_min, in_max, gamma, out_min, out_max);
-            break;
-          case 1:
-            g = levels_value(g, in_min, in_max, gamma, out_min, out_max);
-            break;
-          case 2:
-            b = levels_value(b, in_min, in_max, gamma, out_min, out_max);
-            break;
+          const rgba_type c1 = getRgba(data[i]);
+          const rgba_type c2 = getRgba(data[j]);
+          int d;
+
+          if(lum_only)
+            d = std::abs(getl(data[i]) - getl(data[j]));
+          else
+            d = std::max(std::abs(c1.r - c2.r),
+                std::max(std::abs(c1.g - c2.g), std::abs(c1.b - c2.b)));
+
+          if(d > 0 && (best < 0 || d < best))
+            best = d;
         }
 
-        *p = makeRgb(r, g, b);
+        if(best > 0)
+          nearest.push_back(best);
       }
-    }
-  }
 
-  // find m through successive approximation
-  float percentile(const int *c, const float &f, const int &max)
-  {
-    int n = 0;
+      if(nearest.empty())
+        return 0;
 
-    for(int i = 0; i < max; i++)
-    {
-      if(c[i] > 0)
-        n++;
+      std::nth_element(nearest.begin(), nearest.begin() + nearest.size() / 2,
+                       nearest.end());
+
+      return nearest[nearest.size() / 2];
     }
 
-    const int nf = (int)(n * f);
-    int m = -1;
-    int k = 0;
+    struct ordered_type
+    {
+      int size;
+      const int *offset;
+      bool lum_only;
+    };
 
-    while(k < nf)
+    void ditherRows(int first, int last, int, void *data)
     {
-      m++;
-      k = 0;
+      const ordered_type *job = (ordered_type *)data;
+      const int mask = job->size - 1;
 
-      for(int i = 0; i < max; i++)
+      for(int y = first; y <= last; y++)
       {
-        if(c[i] > 0 && c[i] <= m)
-          k++;
+        int *p = bmp->row[y] + bmp->cl;
+        const int *offset = job->offset + (y & mask) * job->size;
+
+        for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+        {
+          const int off = offset[x & mask];
+          const rgba_type rgba = getRgba(*p);
+          int c;
+
+          if(job->lum_only)
+            c = Blend::keepLum(*p, clamp(getl(*p) + off, 255));
+          else
+            c = makeRgba(clamp(rgba.r + off, 255), clamp(rgba.g + off, 255),
+                         clamp(rgba.b + off, 255), rgba.a);
+
+          const int pal_index = (int)Project::palette->lookup(c);
+          const rgba_type pal = getRgba(Project::palette->data[pal_index]);
+
+          *p = makeRgba(pal.r, pal.g, pal.b, rgba.a);
+        }
       }
     }
 
-    return (float)m;
+    void apply(int mode)
+    {
+      ordered_type job;
+
+      job.lum_only = Items::lum_only->value();
+
+      const std::vector<int> &rank = getRanks(mode, &job.size);
+      const int count = job.size * job.size;
+      const int spread = getSpread(job.lum_only);
+      std::vector<int> offset(count);
+
+      // thresholds centered on zero
+      for(int i = 0; i < count; i++)
+        offset[i] = ((rank[i] * 2 + 1 - count) * spread) / (count * 2);
+
+      job.offset = &offset[0];
+
+      const int batch = std::max(64, Threads::count() * 16);
+
+      Gui::showProgress(bmp->ch);
+
+      for(int y = bmp->ct; y <= bmp->cb; y += batch)
+      {
+        const int y2 = std::min(y + batch - 1, bmp->cb);
+
+        Threads::run(ditherRows, y, y2, &job, 4);
+
+        if(!updateRows(y, y2))
+          return;
+      }
+
+      Gui::hideProgress();
+    }
   }
 
-  struct color_range_type
+  // error diffusion runs as a wavefront: each row waits for the rows
+  // above to get far enough ahead, and each pixel gathers the error
+  // from its already finished neighbors, in the order the serial
+  // version would have spread it, so the result is the same
+  struct dither_job_type
   {
-    float hi[3], lo[3];
+    int (*matrix)[5];
+    int div;
+    int lag;
+    bool waits[3];
+    bool fix_gamma;
+    bool lum_only;
+    int last_row;
+    int next_row;
+    int ring;
+    int planes;
+    std::vector<int> *done;
+    std::vector<int> *error;
   };
 
-  struct color_range_type colormap(Bitmap *src,
-                                   Triplet alpha, Triplet m,
-                                   float top, float bot)
+  // columns handed over to the next row at once
+  const int chunk = 32;
+
+  void waitForRow(dither_job_type *job, int row, int count)
   {
-    // duplicate image
-    Bitmap small_copy(src->w, src->h);
-    src->blit(&small_copy, 0, 0, 0, 0, src->w, src->h);
+    if(row < 0)
+      return;
 
-    // restore
-    for(int i = 0; i < 3; i++)
-      levels(&small_copy, i, 0, m.value[i], alpha.value[i], 0, 255);
+    int *done = &(*job->done)[row];
 
-    // get new colormap
-    Palette pal;
-    Quantize::fast(&small_copy, &pal, 256);
+    while(__sync_fetch_and_add(done, 0) < count)
+      sched_yield();
+  }
 
-    // return color range
-    int slice[256];
-    color_range_type color_range;
+  // applies a neighbor's share of the error to color c
+  inline int addError(const dither_job_type *job, int c, const int *e,
+                      const int &weight)
+  {
+    if(job->lum_only)
+    {
+      int l = getl(c);
 
-    for(int i = 0; i < 3; i++)
+      if(job->fix_gamma)
+      {
+        l = Gamma::fix(l);
+        l += (e[0] * weight) / job->div;
+        l = Gamma::unfix(clamp(l, 65535));
+      }
+      else
+      {
+        l += (e[0] * weight) / job->div;
+        l = clamp(l, 255);
+      }
+
+      return Blend::keepLum(c, l);
+    }
+
+    const rgba_type rgba = getRgba(c);
+    int r, g, b;
+
+    if(job->fix_gamma)
     {
-      getSlice(&pal, i, slice);
-      color_range.hi[i] = percentile(slice, top, pal.max);
-      color_range.lo[i] = percentile(slice, bot, pal.max);
+      r = Gamma::fix(rgba.r) + (e[0] * weight) / job->div;
+      g = Gamma::fix(rgba.g) + (e[1] * weight) / job->div;
+      b = Gamma::fix(rgba.b) + (e[2] * weight) / job->div;
+      r = Gamma::unfix(clamp(r, 65535));
+      g = Gamma::unfix(clamp(g, 65535));
+      b = Gamma::unfix(clamp(b, 65535));
+    }
+    else
+    {
+      r = clamp(rgba.r + (e[0] * weight) / job->div, 255);
+      g = clamp(rgba.g + (e[1] * weight) / job->div, 255);
+      b = clamp(rgba.b + (e[2] * weight) / job->div, 255);
     }
 
-    return color_range;
+    return makeRgba(r, g, b, rgba.a);
   }
 
-  void apply(float contrast)
+  void ditherRow(dither_job_type *job, int row)
   {
-    // make small copy
-    Bitmap small_image(bmp->w / 10, bmp->h / 10);
-    bmp->scale(&small_image);
+    const int w = bmp->cw;
+    const int ring = job->ring;
+    const int plane_size = ring * w;
+    int *p = bmp->row[bmp->ct + row] + bmp->cl;
+    int *done = &(*job->done)[row];
 
-    // get initial percentiles
-    float top = 1.0f;
-    float bot = 0.1f;
+    for(int x1 = 0; x1 < w; x1 += chunk)
+    {
+      const int x2 = std::min(x1 + chunk, w);
 
-    struct color_range_type color_range;
-    color_range = colormap(&small_image,
-                           Triplet(1.0f, 1.0f, 1.0f),
-                           Triplet(255, 255, 255),
-                           top,
-                           bot);
+      for(int j = 1; j < 3; j++)
+        if(job->waits[j])
+          waitForRow(job, row - j, std::min(x2 + job->lag, w));
 
-    // get initial m and alpha
-    Triplet init_alpha(0, 0, 0);
-    Triplet init_m(0, 0, 0);
+      for(int x = x1; x < x2; x++)
+      {
+        int c = p[x];
 
-    for(int i = 0; i < 3; i++)
-    {
-      float hi = color_range.hi[i];
-      float lo = color_range.lo[i];
+        // error from the rows above, then from the left
+        for(int j = 2; j >= 0; j--)
+        {
+          const int sy = row - j;
 
-      init_m.value[i] = expf((logf(top) * logf(lo) - logf(bot) * logf(hi))
-                            / (logf(top) - logf(bot)));
-      init_alpha.value[i] = (logf(lo) - logf(init_m.value[i])) / logf(bot);
-    }
+          if(sy < 0)
+            continue;
 
-    // iterate to get correct m and alpha
-    Triplet alpha(0, 0, 0);
-    Triplet m(0, 0, 0);
-    alpha.copy(init_alpha);
-    m.copy(init_m);
-    Triplet d_alpha(1.0f, 1.0f, 1.0f);
-    Triplet d_m(0, 0, 0);
+          const int *e_row = &(*job->error)[(sy % ring) * w];
 
-    int iter = 0;
+          for(int i = 4; i >= 0; i--)
+          {
+            const int weight = job->matrix[j][i];
+            const int sx = x + 2 - i;
 
-    while(std::max(ExtraMath::abs(d_alpha.value[0]),
-                   std::max(ExtraMath::abs(d_alpha.value[1]),
-                            ExtraMath::abs(d_alpha.value[2]))) > 0.02f)
-    {
-      iter++;
-      if(iter == 10)
-        break;
+            if(weight <= 0 || sx < 0 || sx >= w || (j == 0 && sx >= x))
+              continue;
 
-      for(int i = 0; i < 3; i++)
-      {
-        if(alpha.value[i] < 0.1f || alpha.value[i] > 10.0f)
-        {
-          Dialog::message("Error", "The image has deteriorated too far to restore.");
-          return;
-        }
-      }
+            int e[3];
 
-      color_range = colormap(&small_image, alpha, m, top, bot);
-        
-      for(int i = 0; i < 3; i++)
-      {
-        float hi = color_range.hi[i];
-        float lo = color_range.lo[i];
+            for(int k = 0; k < job->planes; k++)
+              e[k] = e_row[plane_size * k + sx];
 
-        d_alpha.value[i] = alpha.value[i] * alpha.value[i]
-                           * (lo / (255.0f * bot) - 1) / logf(bot);
-        d_m.value[i] = alpha.value[i] * (hi - 255.0f * top);
+            c = addError(job, c, e, weight);
+          }
+        }
 
-        if(ExtraMath::abs(d_alpha.value[i]) > 0.2f * alpha.value[i])
+        const int alpha = geta(c);
+        int *e = &(*job->error)[(row % ring) * w + x];
+
+        if(job->lum_only)
         {
-          d_alpha.value[i] = 0.2f * alpha.value[i] * d_alpha.value[i]
-                                    / ExtraMath::abs(d_alpha.value[i]);
+          const int old_l = getl(c);
+          const int pal_index =
+            (int)Project::palette->lookup(Blend::keepLum(c, old_l));
+          const rgba_type rgba = getRgba(Project::palette->data[pal_index]);
+
+          p[x] = makeRgba(rgba.r, rgba.g, rgba.b, alpha);
+
+          const int new_l = getl(p[x]);
+
+          if(job->fix_gamma)
+            e[0] = Gamma::fix(old_l) - Gamma::fix(new_l);
+          else
+            e[0] = old_l - new_l;
         }
+        else
+        {
+          const rgba_type old_rgba = getRgba(c);
+          const int pal_index = (int)Project::palette->lookup(c);
+          const rgba_type rgba = getRgba(Project::palette->data[pal_index]);
 
-        alpha.value[i] += d_alpha.value[i];
-        m.value[i] += d_m.value[i];
+          p[x] = makeRgba(rgba.r, rgba.g, rgba.b, alpha);
+
+          if(job->fix_gamma)
+          {
+            e[0] = Gamma::fix(old_rgba.r) - Gamma::fix(rgba.r);
+            e[plane_size] = Gamma::fix(old_rgba.g) - Gamma::fix(rgba.g);
+            e[plane_size * 2] = Gamma::fix(old_rgba.b) - Gamma::fix(rgba.b);
+          }
+          else
+          {
+            e[0] = old_rgba.r - rgba.r;
+            e[plane_size] = old_rgba.g - rgba.g;
+            e[plane_size * 2] = old_rgba.b - rgba.b;
+          }
+        }
       }
-    }
 
-    // if loop failed to converge use initial values
-    if(iter == 10)
-    {
-      Dialog::message("Error", "The image has deteriorated badly, the restoration\n is probably poor but may be an improvement on the original.");
-      alpha.copy(init_alpha);
-      m.copy(init_m);
+      // publish the finished columns
+      __sync_fetch_and_add(done, x2 - x1);
     }
+  }
 
-    // create restored image
-    for(int i = 0; i < 3; i++)
-      levels(&small_image, i, 0, m.value[i], alpha.value[i], 0, 255);
+  void ditherRows(int, int, int, void *data)
+  {
+    dither_job_type *job = (dither_job_type *)data;
 
-    // get color map of restored image
-    Palette pal;
-    Quantize::fast(&small_image, &pal, 256);
+    while(true)
+    {
+      const int row = __sync_fetch_and_add(&job->next_row, 1);
 
-    float newc[3][256];
+      if(row > job->last_row)
+        break;
 
-    for(int i = 0; i < 3; i++)
+      ditherRow(job, row);
+    }
+  }
+
+  void apply(int mode)
+  {
+    if(mode >= BAYER2)
     {
-      int temp[256];
+      Ordered::apply(mode);
+      return;
+    }
 
-      getSlice(&pal, i, temp);
+    int (*matrix)[5] = Threshold::matrix;
+    int div = 1;
 
-      for(int j = 0; j < pal.max; j++)
-        newc[i][j] = (float)temp[j];
+    switch(mode)
+    {
+      case THRESHOLD:
+        matrix = Threshold::matrix;
+        div = Threshold::div;
+        break;
+      case FLOYD:
+        matrix = Floyd::matrix;
+        div = Floyd::div;
+        break;
+      case JARVIS:
+        matrix = Jarvis::matrix;
+        div = Jarvis::div;
+        break;
+      case STUCKI:
+        matrix = Stucki::matrix;
+        div = Stucki::div;
+        break;
+      case ATKINSON:
+        matrix = Atkinson::matrix;
+        div = Atkinson::div;
+        break;
+      case SIERRA:
+        matrix = Sierra::matrix;
+        div = Sierra::div;
+        break;
+      default:
+        matrix = Threshold::matrix;
+        div = Threshold::div;
+        break;
     }
 
-    // average color
-    float av[256];
-
-    for(int i = 0; i < pal.max; i++)
-      av[i] = (newc[0][i] + newc[1][i] + newc[2][i]) / (3 * 255);
+    dither_job_type job;
 
-    // tweak restoration
-    Triplet lambda(1.0f, 1.0f, 1.0f);
-    Triplet sigma(1.0f, 1.0f, 1.0f);
+    job.matrix = matrix;
+    job.div = div;
+    job.fix_gamma = Items::gamma->value();
+    job.lum_only = Items::lum_only->value();
+    job.planes = job.lum_only ? 1 : 3;
 
-    bool ok = true;
+    // which rows above are read from, and how far they have to be ahead
+    // (a matrix without any, like threshold, runs every row at once)
+    job.lag = 0;
+    job.waits[0] = false;
 
-    for(int i = 0; i < 3; i++)
+    for(int j = 1; j < 3; j++)
     {
-      float lambda_c = 1.0f;
-      float d_lambda_c = 1.0f;
-      float l[256]; 
-
-      for(int j = 0; j < pal.max; j++)
-        l[j] = logf((newc[i][j] + 1.0f) / 255);
+      job.waits[j] = false;
 
-      iter = 0;
-      float sig = 0;
-
-      while(ExtraMath::abs(d_lambda_c) > 1e-4f)
+      for(int i = 0; i < 5; i++)
       {
-        iter++;
-        if(iter >= 20)
-          break;
-
-        float pc[256];
-        float ppl = 0;
-        float ppll = 0;
-        float pp = 0;
-        float ap = 0;
-        float apl = 0;
-        float apll = 0;
-
-        for(int j = 0; j < pal.max; j++)
+        if(matrix[j][i] > 0)
         {
-          pc[j] = powf(newc[i][j] / 255, lambda_c);
-          ppl += pc[j] * pc[j] * l[j];
-          ppll += pc[j] * pc[j] * l[j] * l[j];
-          pp += pc[j] * pc[j];
-          ap += av[j] * pc[j];
-          apl += av[j] * pc[j] * l[j];
-          apll += av[j] * pc[j] * l[j] * l[j];
+          job.waits[j] = true;
+          job.lag = std::max(job.lag, 2 - i);
         }
-
-        sig = ap / pp;
-        d_lambda_c = -(apl - sig * ppl) / (apll - 2 * sig * ppll);
-        lambda_c += d_lambda_c;
-      }   
-
-      lambda.value[i] = lambda_c;
-      sigma.value[i] = sig;
-
-      if(iter == 20)
-        ok = false;
-    }
-
-    // if loop fails to converge use default values
-    if(!ok)
-    {
-      lambda.set(1.0f, 1.0f, 1.0f);
-      sigma.set(1.0f, 1.0f, 1.0f);
+      }
     }
 
-    float smin = std::min(sigma.value[0],
-                          std::min(sigma.value[1], sigma.value[2]));
+    // enough rows per batch to keep every thread busy, the error buffer
+    // holds one batch plus the two rows before it
+    const int batch = std::max(64, Threads::count() * 4);
+    std::vector<int> done(bmp->ch, 0);
+    std::vector<int> error((batch + 2) * bmp->cw * job.planes);
 
-    // adjust parameters
-    for(int i = 0; i < 3; i++)
-    {
-      alpha.value[i] /= lambda.value[i];
-      sigma.value[i] /= smin;
-      m.value[i] /= powf(sigma.value[i], alpha.value[i]);
-    }
+    job.ring = batch + 2;
+    job.done = &done;
+    job.error = &error;
 
-    // implement degree of restoration and restore
-    contrast /= 100;
+    Gui::showProgress(bmp->ch);
 
-    for(int i = 0; i < 3; i++)
+    for(int row = 0; row < bmp->ch; row += batch)
     {
-      alpha.value[i] = 1.0f - contrast * (1.0f - alpha.value[i]);
-      m.value[i] = 255.0f - contrast * (255.0f - m.value[i]);
-      levels(bmp, i, 0, m.value[i], alpha.value[i], 0, 255);
+      job.next_row = row;
+      job.last_row = std::min(row + batch, bmp->ch) - 1;
+      Threads::run(ditherRows, 0, Threads::count() - 1, &job, 1);
+
+      if(!updateRows(bmp->ct + row, bmp->ct + job.last_row))
+        return;
     }
 
-    // correct side absorptions
     Gui::hideProgress();
   }
 
@@ -1284,8 +3118,7 @@ namespace Restore
   {
     Items::dialog->hide();
     pushUndo();
-
-    apply(atoi(Items::contrast->value()));
+    apply(Items::mode->value());
   }
 
   void quit()
@@ -1299,21 +3132,38 @@ namespace Restore
     Items::dialog->show();
   }
 
+  void dither_callback()
+  {
+    Items::dialog->redraw();
+  }
+
   void init()
   {
     int y1 = 8;
 
-    Items::dialog = new DialogWindow(384, 0, "Restore");
-    Items::box = new Fl_Box(FL_FLAT_BOX, 8, 8, 368, 48, "Restores faded color photographs and slides.\n (Based Geoff Daniell's Restore algorithm, but is not identical.)");
-    Items::box->align(FL_ALIGN_INSIDE | FL_ALIGN_TOP);
-    Items::box->labelsize(12);
-    y1 += 48;
-    Items::contrast = new InputInt(Items::dialog, 0, y1, 96, 24, "Contrast:", 0, 1, 150);
+    Items::dialog = new DialogWindow(256, 0, "Dither Image");
+    Items::mode = new Fl_Choice(96, y1, 128, 24, "Dither:");
+    Items::mode->tooltip("Dither");
+    Items::mode->textsize(10);
+    Items::mode->add("Threshold");
+    Items::mode->add("Floyd-Steinberg");
+    Items::mode->add("Jarvis, Judice and Ninke");
+    Items::mode->add("Stucki");
+    Items::mode->add("Atkinson");
+    Items::mode->add("Sierra");
+    Items::mode->add("Bayer 2x2");
+    Items::mode->add("Bayer 4x4");
+    Items::mode->add("Bayer 8x8");
+    Items::mode->add("Bayer 16x16");
+    Items::mode->add("Blue Noise");
+    Items::mode->value(0);
     y1 += 24 + 8;
-    Items::contrast->maximum_size(4);
-    Items::contrast->value("100");
-    Items::contrast->center();
-//    y1 += 16 + 8;
+    Items::gamma = new CheckBox(Items::dialog, 0, y1, 16, 16, "Gamma Correction", 0);
+    Items::gamma->center();
+    y1 += 16 + 8;
+    Items::lum_only = new CheckBox(Items::dialog, 0, y1, 16, 16, "Luminosity-Based", 0);
+    Items::lum_only->center();
+    y1 += 16 + 8;
     Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
     Items::ok->callback((Fl_Callback *)close);
     Items::cancel->callback((Fl_Callback *)quit);
@@ -1322,108 +3172,299 @@ namespace Restore
   }
 }
 
-// Corrects uneven dye fading in photographs (especially when there is a severe
-// color cast, such as when one of the dyes have faded almost completely).
-//
-// Sometimes works better before or after the restore filter depending on
-// the image.
-namespace CorrectionMatrix
+namespace StainedGlass
 {
-  void apply()
+  namespace Items
   {
-    Gui::showProgress(bmp->h);
+    DialogWindow *dialog;
+    InputInt *detail;
+    InputInt *edge;
+    CheckBox *uniform;
+    CheckBox *sat_alpha;
+    CheckBox *draw_edges;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+  inline int isEdge(Bitmap *b, const int &x, const int &y,
+                           const int &div)
+  {
+    const int c0 = getl(b->getpixel(x, y)) / div;
+    const int c1 = getl(b->getpixel(x + 1, y)) / div;
+    const int c2 = getl(b->getpixel(x, y + 1)) / div;
+    const int c3 = getl(b->getpixel(x + 1, y + 1)) / div;
+
+    if((c0 == c1) && (c0 == c2) && (c0 == c3))
+      return 0;
+    else
+      return 1;
+  }
+
+  // seeds bucketed into a uniform grid, cell size is chosen so each
+  // cell holds a couple of seeds on average
+  struct grid_type
+  {
+    int cell;
+    int gw, gh;
+    std::vector<int> start;
+    std::vector<int> seeds;
+    const int *seedx;
+    const int *seedy;
+  };
+
+  void makeGrid(grid_type *grid, const std::vector<int> &seedx,
+                const std::vector<int> &seedy, const int w, const int h)
+  {
+    const int size = seedx.size();
+
+    grid->cell = std::max(1, (int)std::sqrt(2.0 * w * h / size));
+    grid->gw = w / grid->cell + 1;
+    grid->gh = h / grid->cell + 1;
+    grid->start.assign(grid->gw * grid->gh + 1, 0);
+    grid->seeds.resize(size);
+    grid->seedx = &seedx[0];
+    grid->seedy = &seedy[0];
+
+    for(int i = 0; i < size; i++)
+    {
+      const int c = grid->gw * (seedy[i] / grid->cell)
+                      + seedx[i] / grid->cell;
+
+      grid->start[c + 1]++;
+    }
+
+    for(int c = 0; c < grid->gw * grid->gh; c++)
+      grid->start[c + 1] += grid->start[c];
+
+    std::vector<int> fill(grid->start.begin(), grid->start.end() - 1);
+
+    // seeds stay in index order within each cell
+    for(int i = 0; i < size; i++)
+    {
+      const int c = grid->gw * (seedy[i] / grid->cell)
+                      + seedx[i] / grid->cell;
+
+      grid->seeds[fill[c]++] = i;
+    }
+  }
+
+  // searches rings of cells outwards until no closer seed can exist,
+  // ties go to the lowest seed index like a linear scan would
+  int nearestSeed(const grid_type *grid, const int x, const int y)
+  {
+    const int cx = x / grid->cell;
+    const int cy = y / grid->cell;
+    int nearest = 0x7FFFFFFF;
+    int use = -1;
+
+    for(int r = 0; ; r++)
+    {
+      const int x1 = cx - r;
+      const int y1 = cy - r;
+      const int x2 = cx + r;
+      const int y2 = cy + r;
+
+      if(x1 < 0 && y1 < 0 && x2 >= grid->gw && y2 >= grid->gh)
+        break;
+
+      for(int j = std::max(y1, 0); j <= std::min(y2, grid->gh - 1); j++)
+      {
+        const bool full_row = (j == y1 || j == y2);
+        const int step = full_row ? 1 : x2 - x1;
+
+        for(int i = x1; i <= x2; i += step)
+        {
+          if(i < 0 || i >= grid->gw)
+            continue;
+
+          const int c = grid->gw * j + i;
+
+          for(int k = grid->start[c]; k < grid->start[c + 1]; k++)
+          {
+            const int seed = grid->seeds[k];
+            const int dx = x - grid->seedx[seed];
+            const int dy = y - grid->seedy[seed];
+            const int distance = dx * dx + dy * dy;
+
+            if(distance < nearest || (distance == nearest && seed < use))
+            {
+              nearest = distance;
+              use = seed;
+            }
+          }
+        }
+      }
+
+      // seeds in the next ring are at least this far away
+      const int reach = r * grid->cell + 1;
+
+      if(use != -1 && nearest < reach * reach)
+        break;
+    }
+
+    return use;
+  }
+
+  struct segments_type
+  {
+    const grid_type *grid;
+    const int *color;
+    int *id;
+    unsigned char *edge;
+  };
+
+  void findSegments(int y1, int y2, int, void *data)
+  {
+    const segments_type *seg = (segments_type *)data;
+
+    for(int y = y1; y <= y2; y++)
     {
       int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      int *id = seg->id + bmp->cw * (y - bmp->ct);
+
+      for(int x = 0; x < bmp->cw; x++)
       {
-        rgba_type rgba = getRgba(*p);
+        id[x] = nearestSeed(seg->grid, x + bmp->cl, y);
+        p[x] = seg->color[id[x]];
+      }
+    }
+  }
 
-        int r = rgba.r;
-        int g = rgba.g;
-        int b = rgba.b;
-        int l = getl(*p);
+  // a pixel is on an edge when a neighbor below or to the right
+  // belongs to another segment
+  void findEdges(int y1, int y2, int, void *data)
+  {
+    const segments_type *seg = (segments_type *)data;
+    const int w = bmp->cw;
+    const int h = bmp->ch;
+
+    for(int y = y1; y <= y2; y++)
+    {
+      const int *id = seg->id + w * y;
+      const int *below = seg->id + w * std::min(y + 1, h - 1);
+      unsigned char *edge = seg->edge + w * y;
+
+      for(int x = 0; x < w; x++)
+      {
+        const int xx = std::min(x + 1, w - 1);
+
+        edge[x] = (id[x] != id[xx] || id[x] != below[x]
+                   || id[x] != below[xx]);
+      }
+    }
+  }
+
+  // each edge pixel covers itself and spreads onto its right and lower
+  // neighbors, the same weights as sampling it 4x4 with setpixelAA
+  void drawEdges(int y1, int y2, int, void *data)
+  {
+    const segments_type *seg = (segments_type *)data;
+    const int w = bmp->cw;
+
+    for(int y = y1; y <= y2; y++)
+    {
+      const unsigned char *edge = seg->edge + w * y;
+      const unsigned char *above = y > 0 ? edge - w : 0;
+      int *p = bmp->row[y + bmp->ct] + bmp->cl;
+
+      for(int x = 0; x < w; x++)
+      {
+        int c = edge[x] * 100;
+
+        if(x > 0)
+          c += edge[x - 1] * 60;
+
+        if(above)
+        {
+          c += above[x] * 60;
+
+          if(x > 0)
+            c += above[x - 1] * 36;
+        }
+
+        if(c > 0)
+          p[x] = Blend::trans(p[x], makeRgb(0, 0, 0), 255 - std::min(c, 255));
+      }
+    }
+  }
+
+  void apply(int size, int div)
+  {
+    std::vector<int> seedx(size);
+    std::vector<int> seedy(size);
+    std::vector<int> color(size);
+
+    // each seed/attempt has its own random stream
+    const int key = ExtraMath::rnd();
+
+    for(int i = 0; i < size; i++)
+    {
+      if(Items::uniform->value())
+      {
+        seedx[i] = ExtraMath::rnd(key, i, 0, 0) % bmp->w; 
+        seedy[i] = ExtraMath::rnd(key, i, 0, 1) % bmp->h; 
+      }
+      else
+      {
+        int count = 0;
+
+        do
+        {
+          seedx[i] = ExtraMath::rnd(key, i, count, 0) % bmp->w; 
+          seedy[i] = ExtraMath::rnd(key, i, count, 1) % bmp->h; 
+          count++;
+        }
+        while(!isEdge(bmp, seedx[i], seedy[i], div) && count < 10000);
+      }
+
+      color[i] = bmp->getpixel(seedx[i], seedy[i]);
 
-        // correction matrix
-        int ra = r;
-        int ga = (r * 4 + g * 8 + b * 1) / 13;
-        int ba = (r * 2 + g * 4 + b * 8) / 14;
+      if(Items::sat_alpha->value())
+      {
+        rgba_type rgba = getRgba(color[i]);
 
-        ra = clamp(ra, 255);
-        ga = clamp(ga, 255);
-        ba = clamp(ba, 255);
+        int h, s, v;
 
-        *p = Blend::keepLum(makeRgba(ra, ga, ba, rgba.a), l);
+        Blend::rgbToHsv(rgba.r, rgba.g, rgba.b, &h, &s, &v);
+        color[i] = makeRgba(rgba.r, rgba.g, rgba.b,
+                            std::min(192, s / 2 + 128));
       }
-
-      if(Gui::updateProgress(y) < 0)
-        return;
     }
 
-    Gui::hideProgress();
-  }
+    grid_type grid;
+    makeGrid(&grid, seedx, seedy, bmp->w, bmp->h);
 
-  void begin()
-  {
-    pushUndo();
-    apply();
-  }
-}
+    std::vector<int> id(bmp->cw * bmp->ch);
 
-namespace RemoveDust
-{
-  namespace Items
-  {
-    DialogWindow *dialog;
-    Fl_Box *box;
-    InputInt *amount;
-    CheckBox *invert;
-    Fl_Button *ok;
-    Fl_Button *cancel;
-  }
+    segments_type seg;
+    seg.grid = &grid;
+    seg.color = &color[0];
+    seg.id = &id[0];
 
-  void apply(int amount)
-  {
     Gui::showProgress(bmp->h);
 
-    for(int y = bmp->ct + 1; y <= bmp->cb - 1; y++)
-    {
-      int *p = bmp->row[y] + bmp->cl + 1;
-      for(int x = bmp->cl + 1; x <= bmp->cr - 1; x++, p++)
-      {
-        const int test = *p;
-        int c[8];
-
-        c[0] = bmp->getpixel(x + 1, y);
-        c[1] = bmp->getpixel(x - 1, y);
-        c[2] = bmp->getpixel(x, y + 1);
-        c[3] = bmp->getpixel(x, y - 1);
-        c[4] = bmp->getpixel(x - 1, y - 1);
-        c[5] = bmp->getpixel(x + 1, y - 1);
-        c[6] = bmp->getpixel(x - 1, y + 1);
-        c[7] = bmp->getpixel(x + 1, y + 1);
+    // draw segments
+    const int batch = 64;
 
-        int r = 0;
-        int g = 0;
-        int b = 0;
+    for(int y = bmp->ct; y <= bmp->cb; y += batch)
+    {
+      const int y2 = std::min(y + batch - 1, bmp->cb);
 
-        for(int i = 0; i < 8; i++)
-        {
-          rgba_type rgba = getRgba(c[i]);
-          r += rgba.r;
-          g += rgba.g;
-          b += rgba.b;
-        }
+      Threads::run(findSegments, y, y2, &seg, 4);
 
-        const int avg = makeRgba(r / 8, g / 8, b / 8, geta(test));
+      for(int yy = y; yy <= y2; yy++)
+        if(Gui::updateProgress(yy) < 0)
+          return;
+    }
 
-        if((getl(avg) - getl(test)) > amount)
-          *p = avg;
-      }
+    // draw edges
+    if(Items::draw_edges->value())
+    {
+      std::vector<unsigned char> edge(bmp->cw * bmp->ch);
 
-      if(Gui::updateProgress(y) < 0)
-        return;
+      seg.edge = &edge[0];
+      Threads::run(findEdges, 0, bmp->ch - 1, &seg);
+      Threads::run(drawEdges, 0, bmp->ch - 1, &seg);
     }
 
     Gui::hideProgress();
@@ -1433,14 +3474,7 @@ namespace RemoveDust
   {
     Items::dialog->hide();
     pushUndo();
-
-    if(Items::invert->value())
-      Invert::apply();
-
-    apply(atoi(Items::amount->value()));
-
-    if(Items::invert->value())
-      Invert::apply();
+    apply(atoi(Items::detail->value()), atoi(Items::edge->value()));
   }
 
   void quit()
@@ -1458,18 +3492,24 @@ namespace RemoveDust
   {
     int y1 = 8;
 
-    Items::dialog = new DialogWindow(384, 0, "Remove Dust");
-    Items::box = new Fl_Box(FL_FLAT_BOX, 8, 8, 368, 32, "Removes dust from scanned images.");
-    Items::box->align(FL_ALIGN_INSIDE | FL_ALIGN_TOP);
-    Items::box->labelsize(12);
-    y1 += 32;
-    Items::amount = new InputInt(Items::dialog, 0, y1, 96, 24, "Amount:", 0, 1, 10);
+    Items::dialog = new DialogWindow(256, 0, "Stained Glass");
+    Items::detail = new InputInt(Items::dialog, 0, y1, 96, 24, "Detail:", 0, 1, 50000);
     y1 += 24 + 8;
-    Items::amount->value("4");
-    Items::amount->center();
-    Items::invert = new CheckBox(Items::dialog, 0, y1, 16, 16, "Invert First", 0);
+    Items::detail->value("5000");
+    Items::detail->center();
+    Items::edge = new InputInt(Items::dialog, 0, y1, 96, 24, "Edge Detect:", 0, 1, 50);
+    y1 += 24 + 8;
+    Items::edge->value("16");
+    Items::edge->center();
+    Items::uniform = new CheckBox(Items::dialog, 0, y1, 16, 16, "Uniform", 0);
+    Items::uniform->center();
+    y1 += 16 + 8;
+    Items::sat_alpha = new CheckBox(Items::dialog, 0, y1, 16, 16, "Saturation to Alpha", 0);
+    Items::sat_alpha->center();
+    y1 += 16 + 8;
+    Items::draw_edges = new CheckBox(Items::dialog, 0, y1, 16, 16, "Draw Edges", 0);
+    Items::draw_edges->center();
     y1 += 16 + 8;
-    Items::invert->center();
     Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
     Items::ok->callback((Fl_Callback *)close);
     Items::cancel->callback((Fl_Callback *)quit);
@@ -1478,387 +3518,410 @@ namespace RemoveDust
   }
 }
 
-namespace Desaturate
+namespace GaussianBlur
 {
-  void apply()
+  namespace Items
   {
-    Gui::showProgress(bmp->h);
+    DialogWindow *dialog;
+    InputInt *radius;
+    InputInt *blend;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+  template <typename T>
+  struct plane_type
+  {
+    const T *src;
+    T *dest;
+    int w, h;
+    int r;
+  };
+
+  inline uint16_t boxAverage(const int &sum, const int &div)
+  {
+    return (sum + div / 2) / div;
+  }
+
+  inline float boxAverage(const double &sum, const int &div)
+  {
+    return sum / div;
+  }
+
+  // box blur along rows, edges are clamped
+  // S holds the running sums (int for 16-bit planes, double for float)
+  template <typename T, typename S>
+  void boxRows(int y1, int y2, int, void *data)
+  {
+    const plane_type<T> *plane = (plane_type<T> *)data;
+    const int w = plane->w;
+    const int r = plane->r;
+    const int div = r * 2 + 1;
+
+    for(int y = y1; y <= y2; y++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        const int l = getl(*p);
+      const T *s = plane->src + w * y;
+      T *d = plane->dest + w * y;
+      S sum = (S)s[0] * (r + 1);
 
-        *p = makeRgba(l, l, l, geta(*p));
+      for(int i = 1; i <= r; i++)
+        sum += s[std::min(i, w - 1)];
+
+      for(int x = 0; x < w; x++)
+      {
+        d[x] = boxAverage(sum, div);
+        sum += (S)s[std::min(x + r + 1, w - 1)] - s[std::max(x - r, 0)];
       }
+    }
+  }
 
-      if(Gui::updateProgress(y) < 0)
-        return;
+  // box blur along columns, keeps a running sum for each column
+  // so the image is still read row by row
+  template <typename T, typename S>
+  void boxColumns(int x1, int x2, int, void *data)
+  {
+    const plane_type<T> *plane = (plane_type<T> *)data;
+    const int w = plane->w;
+    const int h = plane->h;
+    const int r = plane->r;
+    const int div = r * 2 + 1;
+
+    std::vector<S> sum(x2 - x1 + 1);
+
+    for(int x = x1; x <= x2; x++)
+    {
+      sum[x - x1] = (S)plane->src[x] * (r + 1);
+
+      for(int i = 1; i <= r; i++)
+        sum[x - x1] += plane->src[w * std::min(i, h - 1) + x];
     }
 
-    Gui::hideProgress();
+    for(int y = 0; y < h; y++)
+    {
+      const T *add = plane->src + w * std::min(y + r + 1, h - 1);
+      const T *sub = plane->src + w * std::max(y - r, 0);
+      T *d = plane->dest + w * y;
+
+      for(int x = x1; x <= x2; x++)
+      {
+        S *s = &sum[x - x1];
+
+        d[x] = boxAverage(*s, div);
+        *s += (S)add[x] - sub[x];
+      }
+    }
   }
 
-  void begin()
+  // approximates a gaussian with three box blurs, so the cost
+  // doesn't depend on the radius
+  // (see Kutskir, "Fastest Gaussian Blur (in linear time)")
+  template <typename T, typename S>
+  void blurPlane(T *buf, T *temp, int w, int h, double sigma)
   {
-    pushUndo();
-    apply();
+    const int passes = 3;
+    int wl = std::sqrt(12 * sigma * sigma / passes + 1);
+
+    if(!(wl & 1))
+      wl--;
+
+    const int wu = wl + 2;
+    const int m = (int)(((12 * sigma * sigma
+                          - passes * wl * wl - 4 * passes * wl - 3 * passes)
+                          / (-4 * wl - 4)) + 0.5);
+
+    for(int i = 0; i < passes; i++)
+    {
+      plane_type<T> plane;
+
+      plane.w = w;
+      plane.h = h;
+      plane.r = ((i < m ? wl : wu) - 1) / 2;
+
+      plane.src = buf;
+      plane.dest = temp;
+      Threads::run(boxRows<T, S>, 0, h - 1, &plane);
+
+      plane.src = temp;
+      plane.dest = buf;
+      Threads::run(boxColumns<T, S>, 0, w - 1, &plane);
+    }
   }
-}
 
-namespace Colorize
-{
-  void apply()
+  // blurs the clipped area of the image into dest (which must be the
+  // same size), works on gamma-linearized planes
+  // a wide image is blurred into wide_planes for finishWide, if given
+  // returns false if the user cancelled
+  template <typename T, typename S>
+  bool blur(Bitmap *dest, int radius, std::vector<float> *wide_planes)
   {
-    rgba_type rgba_color = getRgba(Project::brush->color);
+    const int w = bmp->cw;
+    const int h = bmp->ch;
 
-    Gui::showProgress(bmp->h);
+    // same spread as the old kernel, exp(-x^2 / ((b * b) / 2))
+    const int b = radius + 1;
+    const double sigma = std::sqrt(((b * b) / 2) / 2.0);
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    std::vector<T> buf(w * h);
+    std::vector<T> temp(w * h);
+
+    Gui::showProgress(h * 4);
+
+    for(int channel = 0; channel < 4; channel++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        rgba_type rgba = getRgba(*p);
+      packPlane(&buf[0], channel);
+      blurPlane<T, S>(&buf[0], &temp[0], w, h, sigma);
 
-        int r = rgba.r;
-        int g = rgba.g;
-        int b = rgba.b;
-        int h, s, v;
+      if(Project::wide && wide_planes)
+        keepWidePlane(wide_planes, &buf[0], channel);
+
+      if(!unpackPlane(dest, &buf[0], channel))
+        return false;
+    }
 
-        Blend::rgbToHsv(r, g, b, &h, &s, &v);
+    return true;
+  }
 
-        int sat = s;
+  struct blend_type
+  {
+    Bitmap *blurred;
+    int blend;
+  };
 
-        if(sat < 64)
-          sat = 64;
+  void kernel(const tile_type &tile, void *data)
+  {
+    const blend_type *b = (blend_type *)data;
 
-        r = rgba_color.r;
-        g = rgba_color.g;
-        b = rgba_color.b;
-        Blend::rgbToHsv(r, g, b, &h, &s, &v);
-        Blend::hsvToRgb(h, (sat * s) / (sat + s), v, &r, &g, &b);
+    for(int y = 0; y < tile.h; y++)
+    {
+      const int *p = tile.srcRow(y);
+      const int *q = b->blurred->row[tile.y1 - bmp->ct + y]
+                       + (tile.x1 - bmp->cl);
+      int *d = tile.destRow(y);
 
-        *p = Blend::colorizeLuminosity(*p, makeRgba(r, g, b, rgba.a), 0);
-      }
+      for(int x = 0; x < tile.w; x++)
+        d[x] = Blend::trans(p[x], q[x], b->blend);
+    }
+  }
 
-      if(Gui::updateProgress(y) < 0)
+  void apply(int radius, int blend)
+  {
+    Bitmap temp(bmp->cw, bmp->ch);
+    std::vector<float> wide_planes;
+
+    // a wide image keeps its precision in float planes
+    if(Project::wide)
+    {
+      if(!blur<float, double>(&temp, radius, &wide_planes))
+      {
+        cancelWide();
+        return;
+      }
+    }
+    else
+    {
+      if(!blur<uint16_t, int>(&temp, radius, 0))
         return;
     }
 
+    blend_type b;
+    b.blurred = &temp;
+    b.blend = blend;
+
+    if(filterTiles(kernel, &b, 0))
+      finishWide(wide_planes, blend);
+    else
+      cancelWide();
+  }
+
+  void close()
+  {
+    Items::dialog->hide();
+    pushUndo();
+    apply(atoi(Items::radius->value()), atoi(Items::blend->value()) * 2.55);
+  }
+
+  void quit()
+  {
     Gui::hideProgress();
+    Items::dialog->hide();
   }
 
   void begin()
   {
-    pushUndo();
-    apply();
+    Items::dialog->show();
+  }
+
+  void init()
+  {
+    int y1 = 8;
+
+    Items::dialog = new DialogWindow(256, 0, "Gaussian Blur");
+    Items::radius = new InputInt(Items::dialog, 0, y1, 96, 24, "Radius:", 0, 1, 100);
+    y1 += 24 + 8;
+    Items::radius->value("1");
+    Items::radius->center();
+    Items::blend = new InputInt(Items::dialog, 0, y1, 96, 24, "Blend:", 0, 0, 100);
+    y1 += 24 + 8;
+    Items::blend->value("0");
+    Items::blend->center();
+    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
+    Items::ok->callback((Fl_Callback *)close);
+    Items::cancel->callback((Fl_Callback *)quit);
+    Items::dialog->set_modal();
+    Items::dialog->end();
   }
 }
 
-namespace DitherImage
+namespace Sharpen
 {
   namespace Items
   {
     DialogWindow *dialog;
-    Fl_Choice *mode;
-    CheckBox *gamma;
-    CheckBox *lum_only;
+    InputInt *amount;
     Fl_Button *ok;
     Fl_Button *cancel;
   }
 
-  enum
-  {
-    THRESHOLD,
-    FLOYD,
-    JARVIS,
-    STUCKI,
-    ATKINSON,
-    SIERRA
-  };
- 
-  namespace Threshold
+  void kernel(const tile_type &tile, void *data)
   {
-    int matrix[3][5] =
+    const int amount = *(int *)data;
+
+    for(int y = 0; y < tile.h; y++)
     {
-      { 0, 0, 0, 0, 0 },
-      { 0, 0, 0, 0, 0 },
-      { 0, 0, 0, 0, 0 },
-    };
+      int *d = tile.destRow(y);
 
-    const int div = 1;
-  }
+      for(int x = 0; x < tile.w; x++)
+      {
+        int lum = 0;
 
-  namespace Floyd
-  {
-    int matrix[3][5] =
-    {
-      { 0, 0, 0, 7, 0 },
-      { 0, 3, 5, 1, 0 },
-      { 0, 0, 0, 0, 0 },
-    };
+        for(int j = 0; j < 3; j++) 
+        {
+          const int *p = tile.srcRow(y + j - 1) + x;
+
+          for(int i = 0; i < 3; i++) 
+            lum += getl(p[i - 1]) * FilterMatrix::sharpen[i][j];
+        }
 
-    const int div = 16;
+        const int c = tile.srcRow(y)[x];
+
+        lum = clamp(lum, 255);
+        d[x] = Blend::trans(c, Blend::keepLum(c, lum), 255 - amount * 2.55);
+      }
+    }
   }
 
-  namespace Jarvis
+  void apply(int amount)
   {
-    int matrix[3][5] =
-    {
-      { 0, 0, 0, 7, 5 },
-      { 3, 5, 7, 5, 3 },
-      { 1, 3, 5, 3, 1 }
-    };
-
-    const int div = 48;
+    filterTiles(kernel, &amount, 1);
   }
 
-  namespace Stucki
+  void close()
   {
-    int matrix[3][5] =
-    {
-      { 0, 0, 0, 8, 4 },
-      { 2, 4, 8, 4, 2 },
-      { 1, 2, 4, 2, 1 }
-    };
-
-    const int div = 42;
+    Items::dialog->hide();
+    pushUndo();
+    apply(atoi(Items::amount->value()));
   }
 
-  namespace Atkinson
+  void quit()
   {
-    int matrix[3][5] =
-    {
-      { 0, 0, 0, 1, 1 },
-      { 0, 1, 1, 1, 0 },
-      { 0, 0, 1, 0, 0 }
-    };
+    Gui::hideProgress();
+    Items::dialog->hide();
+  }
 
-    const int div = 8;
+  void begin()
+  {
+    Items::dialog->show();
   }
 
-  namespace Sierra
+  void init()
   {
-    int matrix[3][5] =
-    {
-      { 0, 0, 0, 5, 3 },
-      { 2, 4, 5, 4, 2 },
-      { 0, 2, 3, 2, 0 }
-    };
+    int y1 = 8;
 
-    const int div = 32;
+    Items::dialog = new DialogWindow(256, 0, "Sharpen");
+    Items::amount = new InputInt(Items::dialog, 0, y1, 96, 24, "Amount:", 0, 1, 100);
+    y1 += 24 + 8;
+    Items::amount->value("10");
+    Items::amount->center();
+    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
+    Items::ok->callback((Fl_Callback *)close);
+    Items::cancel->callback((Fl_Callback *)quit);
+    Items::dialog->set_modal();
+    Items::dialog->end();
   }
+}
 
-  void apply(int mode)
+namespace UnsharpMask
+{
+  namespace Items
   {
-    int (*matrix)[5] = Threshold::matrix;
-    int w = 5, h = 3;
-    int div = 1;
-
-    switch(mode)
-    {
-      case THRESHOLD:
-        matrix = Threshold::matrix;
-        div = Threshold::div;
-        break;
-      case FLOYD:
-        matrix = Floyd::matrix;
-        div = Floyd::div;
-        break;
-      case JARVIS:
-        matrix = Jarvis::matrix;
-        div = Jarvis::div;
-        break;
-      case STUCKI:
-        matrix = Stucki::matrix;
-        div = Stucki::div;
-        break;
-      case ATKINSON:
-        matrix = Atkinson::matrix;
-        div = Atkinson::div;
-        break;
-      case SIERRA:
-        matrix = Sierra::matrix;
-        div = Sierra::div;
-        break;
-      default:
-        matrix = Threshold::matrix;
-        div = Threshold::div;
-        break;
-    }
+    DialogWindow *dialog;
+    InputInt *radius;
+    InputFloat *amount;
+    InputInt *threshold;
+    Fl_Button *ok;
+    Fl_Button *cancel;
+  }
 
-    Bitmap *bmp = Project::bmp;
-    const bool fix_gamma = Items::gamma->value();
-    const bool lum_only = Items::lum_only->value();
+  struct mask_type
+  {
+    Bitmap *blurred;
+    double amount;
+    int threshold;
+  };
 
-    Gui::showProgress(bmp->h);
+  void kernel(const tile_type &tile, void *data)
+  {
+    const mask_type *mask = (mask_type *)data;
 
-    if(lum_only)
+    for(int y = 0; y < tile.h; y++)
     {
-      for(int y = bmp->ct; y <= bmp->cb; y++)
-      {
-        int *p = bmp->row[y] + bmp->cl;
-        for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-        {
-          const int alpha = geta(*p);
-          const int old_l = getl(*p);
-
-          const int pal_index =
-            (int)Project::palette->lookup(Blend::keepLum(*p, old_l));
-          const int c = Project::palette->data[pal_index];
+      const int *s = tile.srcRow(y);
+      const int *p = mask->blurred->row[tile.y1 - bmp->ct + y]
+                       + (tile.x1 - bmp->cl);
+      int *d = tile.destRow(y);
 
-          struct rgba_type rgba = getRgba(c);
-          *p = makeRgba(rgba.r, rgba.g, rgba.b, alpha);
-
-          const int new_l = getl(*p);
-          int el;
-
-          if(fix_gamma)
-          {
-            el = Gamma::fix(old_l) - Gamma::fix(new_l);
-          }
-          else
-          {
-            el = old_l - new_l;
-          }
+      for(int x = 0; x < tile.w; x++)
+      {
+        const int a = getl(p[x]);
+        const int b = getl(s[x]);
 
-          for(int j = 0; j < h; j++)
-          {
-            for(int i = 0; i < w; i++)
-            {
-              if(matrix[j][i] > 0)
-              {
-                int c = bmp->getpixel(x - w / 2 + i, y + j);
-                int l = getl(c);
-
-                if(fix_gamma)
-                {
-                  l = Gamma::fix(l); 
-                }
-
-                l += (el * matrix[j][i]) / div;
-
-                if(fix_gamma)
-                {
-                  l = Gamma::unfix(clamp(l, 65535));
-                }
-                else
-                {
-                  l = clamp(l, 255);
-                }
-
-                rgba_type rgba = getRgba(Blend::keepLum(c, l));
-
-                bmp->setpixelSolid(x - w / 2 + i, y + j,
-                                 makeRgba(rgba.r, rgba.g, rgba.b, rgba.a), 0);
-              }  
-            }
-          }
+        if(ExtraMath::abs(a - b) >= mask->threshold)
+        {
+          int lum = a - (mask->amount * (a - b)); 
+          lum = clamp(lum, 255);
+          d[x] = Blend::keepLum(p[x], lum);
+        }
+        else
+        {
+          d[x] = s[x];
         }
-
-        if(Gui::updateProgress(y) < 0)
-          return;
       }
     }
-    else
-    {
-      for(int y = bmp->ct; y <= bmp->cb; y++)
-      {
-        int *p = bmp->row[y] + bmp->cl;
-        for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-        {
-          rgba_type rgba = getRgba(*p);
-          const int alpha = rgba.a;
-          const int old_r = rgba.r;
-          const int old_g = rgba.g;
-          const int old_b = rgba.b;
-
-          const int pal_index = (int)Project::palette->lookup(*p);
-          const int c = Project::palette->data[pal_index];
-
-          rgba = getRgba(c);
-          *p = makeRgba(rgba.r, rgba.g, rgba.b, alpha);
-
-          const int new_r = rgba.r;
-          const int new_g = rgba.g;
-          const int new_b = rgba.b;
-          int er, eg, eb;
+  }
 
-          if(fix_gamma)
-          {
-            er = Gamma::fix(old_r) - Gamma::fix(new_r);
-            eg = Gamma::fix(old_g) - Gamma::fix(new_g);
-            eb = Gamma::fix(old_b) - Gamma::fix(new_b);
-          }
-          else
-          {
-            er = old_r - new_r;
-            eg = old_g - new_g;
-            eb = old_b - new_b;
-          }
+  void apply(int radius, double amount, int threshold)
+  {
+    Bitmap temp(bmp->cw, bmp->ch);
 
-          for(int j = 0; j < h; j++)
-          {
-            for(int i = 0; i < w; i++)
-            {
-              if(matrix[j][i] > 0)
-              {
-                rgba_type rgba = getRgba(bmp->getpixel(x - w / 2 + i, y + j));
-                int r, g, b;
-
-                if(fix_gamma)
-                {
-                  r = Gamma::fix(rgba.r); 
-                  g = Gamma::fix(rgba.g); 
-                  b = Gamma::fix(rgba.b);
-                }
-                else
-                {
-                  r = rgba.r; 
-                  g = rgba.g; 
-                  b = rgba.b; 
-                }
-
-                r += (er * matrix[j][i]) / div;
-                g += (eg * matrix[j][i]) / div;
-                b += (eb * matrix[j][i]) / div;
-
-                if(fix_gamma)
-                {
-                  r = Gamma::unfix(clamp(r, 65535));
-                  g = Gamma::unfix(clamp(g, 65535));
-                  b = Gamma::unfix(clamp(b, 65535));
-                }
-                else
-                {
-                  r = clamp(r, 255);
-                  g = clamp(g, 255);
-                  b = clamp(b, 255);
-                }
-
-                bmp->setpixelSolid(x - w / 2 + i, y + j,
-                                 makeRgba(r, g, b, rgba.a), 0);
-              }  
-            }
-          }
-        }
+    // same kernel as the gaussian blur filter
+    if(!GaussianBlur::blur<uint16_t, int>(&temp, radius, 0))
+      return;
 
-        if(Gui::updateProgress(y) < 0)
-          return;
-      }
-    }
+    mask_type mask;
+    mask.blurred = &temp;
+    mask.amount = amount;
+    mask.threshold = threshold;
 
-    Gui::hideProgress();
+    filterTiles(kernel, &mask, 0);
   }
 
   void close()
   {
     Items::dialog->hide();
     pushUndo();
-    apply(Items::mode->value());
+    apply(atoi(Items::radius->value()),
+          atof(Items::amount->value()),
+          atoi(Items::threshold->value()));
   }
 
   void quit()
@@ -1872,33 +3935,23 @@ namespace DitherImage
     Items::dialog->show();
   }
 
-  void dither_callback()
-  {
-    Items::dialog->redraw();
-  }
-
   void init()
   {
     int y1 = 8;
 
-    Items::dialog = new DialogWindow(256, 0, "Dither Image");
-    Items::mode = new Fl_Choice(96, y1, 128, 24, "Dither:");
-    Items::mode->tooltip("Dither");
-    Items::mode->textsize(10);
-    Items::mode->add("Threshold");
-    Items::mode->add("Floyd-Steinberg");
-    Items::mode->add("Jarvis, Judice and Ninke");
-    Items::mode->add("Stucki");
-    Items::mode->add("Atkinson");
-    Items::mode->add("Sierra");
-    Items::mode->value(0);
+    Items::dialog = new DialogWindow(256, 0, "Unsharp Mask");
+    Items::radius = new InputInt(Items::dialog, 0, y1, 96, 24, "Radius:", 0, 1, 100);
     y1 += 24 + 8;
-    Items::gamma = new CheckBox(Items::dialog, 0, y1, 16, 16, "Gamma Correction", 0);
-    Items::gamma->center();
-    y1 += 16 + 8;
-    Items::lum_only = new CheckBox(Items::dialog, 0, y1, 16, 16, "Luminosity-Based", 0);
-    Items::lum_only->center();
-    y1 += 16 + 8;
+    Items::radius->value("1");
+    Items::radius->center();
+    Items::amount = new InputFloat(Items::dialog, 0, y1, 96, 24, "Amount:", 0, 0.1, 10.0);
+    y1 += 24 + 8;
+    Items::amount->value("1.5");
+    Items::amount->center();
+    Items::threshold = new InputInt(Items::dialog, 0, y1, 72, 24, "Threshold:", 0, 0, 255);
+    y1 += 24 + 8;
+    Items::threshold->value("0");
+    Items::threshold->center();
     Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
     Items::ok->callback((Fl_Callback *)close);
     Items::cancel->callback((Fl_Callback *)quit);
@@ -1907,403 +3960,477 @@ namespace DitherImage
   }
 }
 
-namespace StainedGlass
+namespace ConvolutionMatrix
 {
   namespace Items
   {
     DialogWindow *dialog;
-    InputInt *detail;
-    InputInt *edge;
-    CheckBox *uniform;
-    CheckBox *sat_alpha;
-    CheckBox *draw_edges;
+    Fl_Choice *mode;
+    Fl_Multiline_Input *matrix;
+    InputInt *divisor;
+    InputInt *amount;
+    CheckBox *lum_only;
     Fl_Button *ok;
     Fl_Button *cancel;
   }
 
-  inline int isEdge(Bitmap *b, const int &x, const int &y,
-                           const int &div)
+  enum
   {
-    const int c0 = getl(b->getpixel(x, y)) / div;
-    const int c1 = getl(b->getpixel(x + 1, y)) / div;
-    const int c2 = getl(b->getpixel(x, y + 1)) / div;
-    const int c3 = getl(b->getpixel(x + 1, y + 1)) / div;
+    BOX_BLUR,
+    GAUSSIAN_BLUR,
+    SHARPEN,
+    EDGE_DETECT,
+    EMBOSS,
+    EMBOSS_REVERSE
+  };
 
-    if((c0 == c1) && (c0 == c2) && (c0 == c3))
-      return 0;
-    else
-      return 1;
+  const int max_size = 31;
+  const int max_weight = 1000;
+
+  // kernels that can't be separated and are larger than this go through
+  // ExtraMath::convolve, which uses fft tiles when that is cheaper
+  const int max_direct_size = 9;
+ 
+  struct filter_type
+  {
+    int size;
+    std::vector<int> matrix;
+    bool separable;
+    std::vector<int> col;
+    std::vector<int> row;
+    int div;
+    int amount;
+    bool lum_only;
+
+    // sums for the whole clipped image, one plane after another,
+    // when they were found by ExtraMath::convolve
+    std::vector<int> sums;
+  };
+
+  int gcd(int a, int b)
+  {
+    while(b)
+    {
+      const int t = a % b;
+      a = b;
+      b = t;
+    }
+
+    return ExtraMath::abs(a);
   }
 
-  inline int isSegmentEdge(Bitmap *b, const int &x, const int &y)
-  {
-    const int c0 = b->getpixel(x, y);
-    const int c1 = b->getpixel(x + 1, y);
-    const int c2 = b->getpixel(x, y + 1);
-    const int c3 = b->getpixel(x + 1, y + 1);
+  // checks whether the matrix is the outer product of a column and a row
+  // of integers, so it can be applied in two passes of n taps each
+  // instead of one of n * n taps with exactly the same result
+  void findFactors(filter_type *filter)
+  {
+    const int n = filter->size;
+    const int *m = &filter->matrix[0];
+
+    filter->separable = false;
+    filter->col.assign(n, 0);
+    filter->row.assign(n, 0);
+
+    int j0 = -1;
+    int i0 = -1;
+
+    for(int i = 0; i < n * n; i++)
+    {
+      if(m[i] != 0)
+      {
+        j0 = i / n;
+        i0 = i % n;
+        break;
+      }
+    }
+
+    if(j0 < 0)
+      return;
+
+    int g = 0;
+
+    for(int i = 0; i < n; i++)
+      g = gcd(g, m[n * j0 + i]);
+
+    for(int i = 0; i < n; i++)
+      filter->row[i] = m[n * j0 + i] / g;
+
+    for(int j = 0; j < n; j++)
+    {
+      if(m[n * j + i0] % filter->row[i0] != 0)
+        return;
+
+      filter->col[j] = m[n * j + i0] / filter->row[i0];
 
-    if((c0 == c1) && (c0 == c2) && (c0 == c3))
-      return 0;
-    else
-      return 1;
+      for(int i = 0; i < n; i++)
+        if(m[n * j + i] != filter->col[j] * filter->row[i])
+          return;
+    }
+
+    filter->separable = true;
   }
 
-  void apply(int size, int div)
+  // reads rows of integers (one row per line), the matrix must be square
+  // with an odd size
+  bool parseMatrix(const char *text, filter_type *filter)
   {
-    std::vector<int> seedx(size);
-    std::vector<int> seedy(size);
-    std::vector<int> color(size);
+    std::vector<std::vector<int> > rows;
+    std::vector<int> row;
+    const char *s = text;
 
-    for(int i = 0; i < size; i++)
+    while(true)
     {
-      if(Items::uniform->value())
+      if(*s == '\n' || *s == '\0')
       {
-        seedx[i] = ExtraMath::rnd() % bmp->w; 
-        seedy[i] = ExtraMath::rnd() % bmp->h; 
+        if(row.size() > 0)
+          rows.push_back(row);
+
+        row.clear();
+
+        if(*s == '\0')
+          break;
+
+        s++;
+      }
+      else if(*s == ' ' || *s == '\t' || *s == ',' || *s == '\r')
+      {
+        s++;
       }
       else
       {
-        seedx[i] = ExtraMath::rnd() % bmp->w; 
-        seedy[i] = ExtraMath::rnd() % bmp->h; 
-  
-        int count = 0;
+        char *end;
+        const long val = strtol(s, &end, 10);
 
-        do
-        {
-          seedx[i] = ExtraMath::rnd() % bmp->w; 
-          seedy[i] = ExtraMath::rnd() % bmp->h; 
-          count++;
-        }
-        while(!isEdge(bmp, seedx[i], seedy[i], div) && count < 10000);
-      }
+        if(end == s || val < -max_weight || val > max_weight)
+          return false;
 
-      color[i] = bmp->getpixel(seedx[i], seedy[i]);
+        row.push_back(val);
+        s = end;
+      }
     }
 
-    Gui::showProgress(bmp->h);
-
-    // draw segments
-    for(int y = bmp->ct; y <= bmp->cb; y++)
-    {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        // find nearest color
-        int nearest = 999999999;
-        int use = -1;
+    const int n = rows.size();
 
-        for(int i = 0; i < size; i++)
-        {
-          const int dx = x - seedx[i];
-          const int dy = y - seedy[i];
-          const int distance = dx * dx + dy * dy;
+    if(n < 1 || n > max_size || (n & 1) == 0)
+      return false;
 
-          if(distance < nearest)
-          {
-            nearest = distance;
-            use = i;
-          }
-        }
+    filter->size = n;
+    filter->matrix.resize(n * n);
 
-        if(use != -1)
-        {
-          if(Items::sat_alpha->value())
-          {
-            rgba_type rgba = getRgba(color[use]);
+    for(int j = 0; j < n; j++)
+    {
+      if((int)rows[j].size() != n)
+        return false;
 
-            int h, s, v;
+      for(int i = 0; i < n; i++)
+        filter->matrix[n * j + i] = rows[j][i];
+    }
 
-            Blend::rgbToHsv(rgba.r, rgba.g, rgba.b, &h, &s, &v);
-            *p = makeRgba(rgba.r, rgba.g, rgba.b, std::min(192, s / 2 + 128));
-          }
-          else
-          {
-            *p = color[use];
-          }
-        }
-      }
+    return true;
+  }
 
-      if(Gui::updateProgress(y) < 0)
-        return;
-    }
+  // one channel of a tile (including the halo) in a plane of ints, the
+  // inner loops are plain multiply-adds along a row so the compiler can
+  // vectorize them
+  void convolvePlane(const filter_type *filter, const int *src,
+                     const int w, const int h, int *dest,
+                     std::vector<int> *temp)
+  {
+    const int n = filter->size;
+    const int stride = w + n - 1;
 
-    // draw edges
-    if(Items::draw_edges->value())
+    if(filter->separable)
     {
-      Map *map = Project::map;
-      map->clear(0);
+      temp->resize(w * (h + n - 1));
 
-      for(int y = bmp->ct * 4; y <= bmp->cb * 4; y++)
+      for(int y = 0; y < h + n - 1; y++)
       {
-        for(int x = bmp->cl * 4; x <= bmp->cr * 4; x++)
+        int *t = &(*temp)[w * y];
+
+        std::fill(t, t + w, 0);
+
+        for(int i = 0; i < n; i++)
         {
-          if(isSegmentEdge(bmp, x / 4, y / 4))
-            map->setpixelAA(x, y, 255);
+          const int k = filter->row[i];
+          const int *p = src + stride * y + i;
+
+          if(k == 0)
+            continue;
+
+          for(int x = 0; x < w; x++)
+            t[x] += p[x] * k;
         }
       }
 
-      for(int y = bmp->ct; y <= bmp->cb; y++)
+      for(int y = 0; y < h; y++)
       {
-        int *p = bmp->row[y] + bmp->cl;
-        for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+        int *d = dest + w * y;
+
+        std::fill(d, d + w, 0);
+
+        for(int j = 0; j < n; j++)
         {
-          const int c = map->getpixel(x, y);
+          const int k = filter->col[j];
+          const int *t = &(*temp)[w * (y + j)];
 
-          *p = Blend::trans(*p, makeRgb(0, 0, 0), 255 - c);
+          if(k == 0)
+            continue;
+
+          for(int x = 0; x < w; x++)
+            d[x] += t[x] * k;
         }
       }
     }
+    else
+    {
+      for(int y = 0; y < h; y++)
+      {
+        int *d = dest + w * y;
 
-    Gui::hideProgress();
-  }
+        std::fill(d, d + w, 0);
 
-  void close()
-  {
-    Items::dialog->hide();
-    pushUndo();
-    apply(atoi(Items::detail->value()), atoi(Items::edge->value()));
-  }
+        for(int j = 0; j < n; j++)
+        {
+          for(int i = 0; i < n; i++)
+          {
+            const int k = filter->matrix[n * j + i];
+            const int *p = src + stride * (y + j) + i;
 
-  void quit()
-  {
-    Gui::hideProgress();
-    Items::dialog->hide();
-  }
+            if(k == 0)
+              continue;
 
-  void begin()
-  {
-    Items::dialog->show();
+            for(int x = 0; x < w; x++)
+              d[x] += p[x] * k;
+          }
+        }
+      }
+    }
   }
 
-  void init()
+  // divides the sums for one pixel (planes are size apart) and blends
+  // the result with the original color
+  inline int finishPixel(const filter_type *filter, const int c,
+                         const int *sum, const int size, const int trans)
   {
-    int y1 = 8;
+    if(filter->lum_only)
+    {
+      const int lum = clamp(sum[0] / filter->div, 255);
 
-    Items::dialog = new DialogWindow(256, 0, "Stained Glass");
-    Items::detail = new InputInt(Items::dialog, 0, y1, 96, 24, "Detail:", 0, 1, 50000);
-    y1 += 24 + 8;
-    Items::detail->value("5000");
-    Items::detail->center();
-    Items::edge = new InputInt(Items::dialog, 0, y1, 96, 24, "Edge Detect:", 0, 1, 50);
-    y1 += 24 + 8;
-    Items::edge->value("16");
-    Items::edge->center();
-    Items::uniform = new CheckBox(Items::dialog, 0, y1, 16, 16, "Uniform", 0);
-    Items::uniform->center();
-    y1 += 16 + 8;
-    Items::sat_alpha = new CheckBox(Items::dialog, 0, y1, 16, 16, "Saturation to Alpha", 0);
-    Items::sat_alpha->center();
-    y1 += 16 + 8;
-    Items::draw_edges = new CheckBox(Items::dialog, 0, y1, 16, 16, "Draw Edges", 0);
-    Items::draw_edges->center();
-    y1 += 16 + 8;
-    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
-    Items::ok->callback((Fl_Callback *)close);
-    Items::cancel->callback((Fl_Callback *)quit);
-    Items::dialog->set_modal();
-    Items::dialog->end();
-  }
-}
+      return Blend::trans(c, Blend::keepLum(c, lum), trans);
+    }
+    else
+    {
+      const int r = clamp(sum[0] / filter->div, 255);
+      const int g = clamp(sum[size] / filter->div, 255);
+      const int b = clamp(sum[size * 2] / filter->div, 255);
 
-namespace GaussianBlur
-{
-  namespace Items
-  {
-    DialogWindow *dialog;
-    InputInt *radius;
-    InputInt *blend;
-    Fl_Button *ok;
-    Fl_Button *cancel;
+      return Blend::trans(c, makeRgba(r, g, b, geta(c)), trans);
+    }
   }
 
-  void apply(int radius, int blend)
+  void kernel(const tile_type &tile, void *data)
   {
-    radius = (radius + 1) * 2 + 1;
-
-    std::vector<int> kernel(radius);
-    int div = 0;
-
-    // bell curve
-    const int b = radius / 2;
-
-    for(int x = 0; x < radius; x++)
-    {
-      kernel[x] = 255 * std::exp(-((double)((x - b) * (x - b)) /
-                                           ((b * b) / 2)));
-      div += kernel[x];
-    }
+    const filter_type *filter = (filter_type *)data;
+    const int trans = 255 - filter->amount * 2.55;
+    const int half = filter->size / 2;
+    const int stride = tile.w + half * 2;
+    const int planes = filter->lum_only ? 1 : 3;
 
-    Bitmap temp(bmp->cw, bmp->ch);
-    Gui::showProgress(bmp->h);
+    std::vector<int> src(stride * (tile.h + half * 2));
+    std::vector<int> out(tile.w * tile.h * planes);
+    std::vector<int> temp;
 
-    // x direction
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int plane = 0; plane < planes; plane++)
     {
-      int *p = temp.row[y - bmp->ct];
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      for(int y = 0; y < tile.h + half * 2; y++)
       {
-        int rr = 0;
-        int gg = 0;
-        int bb = 0;
-        int aa = 0;
+        const int *p = tile.srcRow(y - half) - half;
+        int *q = &src[stride * y];
 
-        for(int i = 0; i < radius; i++) 
+        for(int x = 0; x < stride; x++)
         {
-          rgba_type rgba = getRgba(bmp->getpixel(x - radius / 2 + i, y));
-          rr += Gamma::fix(rgba.r) * kernel[i];
-          gg += Gamma::fix(rgba.g) * kernel[i];
-          bb += Gamma::fix(rgba.b) * kernel[i];
-          aa += rgba.a * kernel[i];
+          if(filter->lum_only)
+            q[x] = getl(p[x]);
+          else
+            q[x] = (p[x] >> (plane * 8)) & 255;
         }
+      }
 
-        rr /= div;
-        gg /= div;
-        bb /= div;
-        aa /= div;
+      convolvePlane(filter, &src[0], tile.w, tile.h,
+                    &out[tile.w * tile.h * plane], &temp);
+    }
 
-        rr = Gamma::unfix(rr);
-        gg = Gamma::unfix(gg);
-        bb = Gamma::unfix(bb);
+    for(int y = 0; y < tile.h; y++)
+    {
+      int *d = tile.destRow(y);
 
-        *p = makeRgba((int)rr, (int)gg, (int)bb, (int)aa);
+      for(int x = 0; x < tile.w; x++)
+      {
+        d[x] = finishPixel(filter, tile.srcRow(y)[x],
+                           &out[tile.w * y + x], tile.w * tile.h, trans);
       }
-
-      if(Gui::updateProgress(y) < 0)
-        return;
     }
+  }
 
-    Gui::showProgress(bmp->h);
+  // finds the sums for the whole image through ExtraMath::convolve
+  // returns false if the user cancelled
+  bool convolveLarge(filter_type *filter)
+  {
+    const int n = filter->size;
+    const int w = bmp->cw;
+    const int h = bmp->ch;
+    const int planes = filter->lum_only ? 1 : 3;
 
-    // y direction
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    std::vector<float> matrix(filter->matrix.begin(), filter->matrix.end());
+    std::vector<float> buf(w * h);
+
+    filter->sums.resize(w * h * planes);
+    Gui::showProgress(h * planes);
+
+    for(int plane = 0; plane < planes; plane++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      for(int y = 0; y < h; y++)
       {
-        int rr = 0;
-        int gg = 0;
-        int bb = 0;
-        int aa = 0;
+        const int *p = bmp->row[y + bmp->ct] + bmp->cl;
+        float *q = &buf[w * y];
 
-        for(int i = 0; i < radius; i++) 
+        for(int x = 0; x < w; x++)
         {
-          rgba_type rgba = getRgba(temp.getpixel(x - bmp->cl,
-                                                 y - radius / 2 + i - bmp->ct));
-          rr += Gamma::fix(rgba.r) * kernel[i];
-          gg += Gamma::fix(rgba.g) * kernel[i];
-          bb += Gamma::fix(rgba.b) * kernel[i];
-          aa += rgba.a * kernel[i];
+          if(filter->lum_only)
+            q[x] = getl(p[x]);
+          else
+            q[x] = (p[x] >> (plane * 8)) & 255;
         }
+      }
 
-        rr /= div;
-        gg /= div;
-        bb /= div;
-        aa /= div;
+      ExtraMath::convolve(&buf[0], w, h, &matrix[0], n, n);
 
-        rr = Gamma::unfix(rr);
-        gg = Gamma::unfix(gg);
-        bb = Gamma::unfix(bb);
+      for(int y = 0; y < h; y++)
+      {
+        const float *q = &buf[w * y];
+        int *d = &filter->sums[w * h * plane + w * y];
 
-        *p = Blend::trans(*p, makeRgba((int)rr, (int)gg, (int)bb, (int)aa), blend);
-      }
+        for(int x = 0; x < w; x++)
+          d[x] = (int)std::floor(q[x] + 0.5f);
 
-      if(Gui::updateProgress(y) < 0)
-        return;
+        if(Gui::updateProgress(h * plane + y) < 0)
+          return false;
+      }
     }
 
-    Gui::hideProgress();
+    return true;
   }
 
-  void close()
+  void finishKernel(const tile_type &tile, void *data)
   {
-    Items::dialog->hide();
-    pushUndo();
-    apply(atoi(Items::radius->value()), atoi(Items::blend->value()) * 2.55);
-  }
+    const filter_type *filter = (filter_type *)data;
+    const int trans = 255 - filter->amount * 2.55;
+    const int w = bmp->cw;
 
-  void quit()
-  {
-    Gui::hideProgress();
-    Items::dialog->hide();
-  }
+    for(int y = 0; y < tile.h; y++)
+    {
+      const int *sum = &filter->sums[w * (tile.y1 - bmp->ct + y)
+                                     + (tile.x1 - bmp->cl)];
+      int *d = tile.destRow(y);
 
-  void begin()
-  {
-    Items::dialog->show();
+      for(int x = 0; x < tile.w; x++)
+      {
+        d[x] = finishPixel(filter, tile.srcRow(y)[x],
+                           sum + x, w * bmp->ch, trans);
+      }
+    }
   }
 
-  void init()
+  void apply(filter_type *filter)
   {
-    int y1 = 8;
+    findFactors(filter);
 
-    Items::dialog = new DialogWindow(256, 0, "Gaussian Blur");
-    Items::radius = new InputInt(Items::dialog, 0, y1, 96, 24, "Radius:", 0, 1, 100);
-    y1 += 24 + 8;
-    Items::radius->value("1");
-    Items::radius->center();
-    Items::blend = new InputInt(Items::dialog, 0, y1, 96, 24, "Blend:", 0, 0, 100);
-    y1 += 24 + 8;
-    Items::blend->value("0");
-    Items::blend->center();
-    Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
-    Items::ok->callback((Fl_Callback *)close);
-    Items::cancel->callback((Fl_Callback *)quit);
-    Items::dialog->set_modal();
-    Items::dialog->end();
+    if(!filter->separable && filter->size > max_direct_size)
+    {
+      if(convolveLarge(filter))
+        filterTiles(finishKernel, filter, 0);
+
+      filter->sums.clear();
+      return;
+    }
+
+    filterTiles(kernel, filter, filter->size / 2);
   }
-}
 
-namespace Sharpen
-{
-  namespace Items
+  // fills in the matrix box from a preset
+  void setPreset(const int m[3][3])
   {
-    DialogWindow *dialog;
-    InputInt *amount;
-    Fl_Button *ok;
-    Fl_Button *cancel;
+    char s[256];
+    int len = 0;
+
+    // presets are stored as [x][y]
+    for(int j = 0; j < 3; j++)
+    {
+      len += snprintf(s + len, sizeof(s) - len, "%d %d %d%s",
+                      m[0][j], m[1][j], m[2][j], j < 2 ? "\n" : "");
+    }
+
+    Items::matrix->value(s);
+    Items::divisor->value("0");
   }
 
-  void apply(int amount)
+  void mode_callback()
   {
-    Bitmap temp(bmp->cw, bmp->ch);
-    Gui::showProgress(bmp->h);
-
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    switch(Items::mode->value())
     {
-      int *p = temp.row[y - bmp->cl];
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        int lum = 0;
+      case BOX_BLUR:
+        setPreset(FilterMatrix::blur);
+        break;
+      case GAUSSIAN_BLUR:
+        setPreset(FilterMatrix::gaussian);
+        break;
+      case SHARPEN:
+        setPreset(FilterMatrix::sharpen);
+        break;
+      case EDGE_DETECT:
+        setPreset(FilterMatrix::edge);
+        break;
+      case EMBOSS:
+        setPreset(FilterMatrix::emboss);
+        break;
+      case EMBOSS_REVERSE:
+        setPreset(FilterMatrix::emboss_reverse);
+        break;
+      default:
+        setPreset(FilterMatrix::identity);
+        break;
+    }
+  }
 
-        for(int j = 0; j < 3; j++) 
-        {
-          for(int i = 0; i < 3; i++) 
-          {
-            lum += getl(bmp->getpixel(x + i - 1, y + j - 1))
-                     * FilterMatrix::sharpen[i][j];
-          }
-        }
+  void close()
+  {
+    filter_type filter;
 
-        const int c = bmp->getpixel(x, y);
+    if(!parseMatrix(Items::matrix->value(), &filter))
+    {
+      Dialog::message("Error", "The matrix must be square with an odd size\n"
+                      "up to 31x31 and weights from -1000 to 1000.");
+      return;
+    }
 
-        lum = clamp(lum, 255);
-        *p = Blend::trans(c, Blend::keepLum(c, lum), 255 - amount * 2.55);
-      }
+    // a divisor of zero means the sum of the weights
+    filter.div = atoi(Items::divisor->value());
 
-      if(Gui::updateProgress(y) < 0)
-        return;
-    }
+    if(filter.div == 0)
+    {
+      for(int i = 0; i < (int)filter.matrix.size(); i++)
+        filter.div += filter.matrix[i];
 
-    temp.blit(bmp, 0, 0, bmp->cl, bmp->ct, temp.w, temp.h);
+      if(filter.div == 0)
+        filter.div = 1;
+    }
 
-    Gui::hideProgress();
-  }
+    filter.amount = atoi(Items::amount->value());
+    filter.lum_only = Items::lum_only->value();
 
-  void close()
-  {
     Items::dialog->hide();
     pushUndo();
-    apply(atoi(Items::amount->value()));
+    apply(&filter);
   }
 
   void quit()
@@ -2321,152 +4448,86 @@ namespace Sharpen
   {
     int y1 = 8;
 
-    Items::dialog = new DialogWindow(256, 0, "Sharpen");
-    Items::amount = new InputInt(Items::dialog, 0, y1, 96, 24, "Amount:", 0, 1, 100);
+    Items::dialog = new DialogWindow(256, 0, "Convolution Matrix");
+    Items::mode = new Fl_Choice(96, y1, 128, 24, "Presets:");
+    Items::mode->tooltip("Presets");
+    Items::mode->textsize(10);
+    Items::mode->add("Box Blur");
+    Items::mode->add("Gaussian Blur");
+    Items::mode->add("Sharpen");
+    Items::mode->add("Edge Detect");
+    Items::mode->add("Emboss");
+    Items::mode->add("Emboss (Inverse)");
+    Items::mode->value(0);
+    Items::mode->callback((Fl_Callback *)mode_callback);
     y1 += 24 + 8;
-    Items::amount->value("10");
+    Items::matrix = new Fl_Multiline_Input(96, y1, 128, 96, "Matrix:");
+    Items::matrix->tooltip("One row per line, up to 31x31");
+    Items::matrix->textsize(12);
+    Items::matrix->labelsize(12);
+    Items::matrix->maximum_size(8192);
+    y1 += 96 + 8;
+    Items::divisor = new InputInt(Items::dialog, 0, y1, 96, 24, "Divisor:", 0, -1000, 1000);
+    Items::divisor->tooltip("0 uses the sum of the weights");
+    Items::divisor->center();
+    y1 += 24 + 8;
+    Items::amount = new InputInt(Items::dialog, 0, y1, 96, 24, "Amount:", 0, 1, 100);
+    Items::amount->value("100");
     Items::amount->center();
+    y1 += 24 + 8;
+    Items::lum_only = new CheckBox(Items::dialog, 0, y1, 16, 16, "Luminosity-Based", 0);
+    Items::lum_only->center();
+    y1 += 16 + 8;
     Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
     Items::ok->callback((Fl_Callback *)close);
     Items::cancel->callback((Fl_Callback *)quit);
     Items::dialog->set_modal();
     Items::dialog->end();
+    mode_callback();
   }
 }
 
-namespace UnsharpMask
+namespace LensBlur
 {
   namespace Items
   {
     DialogWindow *dialog;
     InputInt *radius;
-    InputFloat *amount;
-    InputInt *threshold;
     Fl_Button *ok;
     Fl_Button *cancel;
   }
 
-  void apply(int radius, double amount, int threshold)
+  // flat disc with an antialiased rim
+  void apply(int radius)
   {
-    radius = (radius + 1) * 2 + 1;
-    std::vector<int> kernel(radius);
-    int div = 0;
-
-    // bell curve
-    const int b = radius / 2;
-
-    for(int x = 0; x < radius; x++)
-    {
-      kernel[x] = 255 * std::exp(-((double)((x - b) * (x - b)) /
-                                           ((b * b) / 2)));
-      div += kernel[x];
-    }
-
-    Bitmap temp(bmp->cw, bmp->ch);
-    Gui::showProgress(bmp->h);
+    const int size = radius * 2 + 1;
+    std::vector<float> kernel(size * size);
 
-    // x direction
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int j = 0; j < size; j++)
     {
-      int *p = temp.row[y - bmp->ct];
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      for(int i = 0; i < size; i++)
       {
-        int rr = 0;
-        int gg = 0;
-        int bb = 0;
-        int aa = 0;
-
-        for(int i = 0; i < radius; i++) 
-        {
-          rgba_type rgba = getRgba(bmp->getpixel(x - radius / 2 + i, y));
-          rr += Gamma::fix(rgba.r) * kernel[i];
-          gg += Gamma::fix(rgba.g) * kernel[i];
-          bb += Gamma::fix(rgba.b) * kernel[i];
-          aa += rgba.a * kernel[i];
-        }
-
-        rr /= div;
-        gg /= div;
-        bb /= div;
-        aa /= div;
+        const float d = std::sqrt((float)((i - radius) * (i - radius)
+                                          + (j - radius) * (j - radius)));
 
-        rr = Gamma::unfix(rr);
-        gg = Gamma::unfix(gg);
-        bb = Gamma::unfix(bb);
-
-        *p = makeRgba((int)rr, (int)gg, (int)bb, (int)aa);
+        kernel[size * j + i] = std::max(0.0f, std::min(1.0f,
+                                          radius + 0.5f - d));
       }
-
-      if(Gui::updateProgress(y) < 0)
-        return;
     }
 
-    Bitmap temp2(bmp->cw, bmp->ch);
-    temp.blit(&temp2, 0, 0, 0, 0, temp.w, temp.h);
-
-    Gui::showProgress(bmp->h);
-
-    // y direction
-    for(int y = bmp->ct; y <= bmp->cb; y++)
-    {
-      int *p = temp2.row[y - bmp->ct];
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        int rr = 0;
-        int gg = 0;
-        int bb = 0;
-        int aa = 0;
-
-        for(int i = 0; i < radius; i++) 
-        {
-          rgba_type rgba = getRgba(temp.getpixel(x - bmp->cl,
-                                                 y - radius / 2 + i - bmp->ct));
-          rr += Gamma::fix(rgba.r) * kernel[i];
-          gg += Gamma::fix(rgba.g) * kernel[i];
-          bb += Gamma::fix(rgba.b) * kernel[i];
-          aa += rgba.a * kernel[i];
-        }
-
-        rr /= div;
-        gg /= div;
-        bb /= div;
-        aa /= div;
-
-        rr = Gamma::unfix(rr);
-        gg = Gamma::unfix(gg);
-        bb = Gamma::unfix(bb);
-
-        *p = makeRgba((int)rr, (int)gg, (int)bb, (int)aa);
-      }
+    normalizeKernel(&kernel);
 
-      if(Gui::updateProgress(y) < 0)
-        return;
-    }
+    Bitmap temp(bmp->cw, bmp->ch);
+    std::vector<float> wide_planes;
 
-    // blend
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    if(!convolveImage(&temp, &kernel[0], size, size, &wide_planes))
     {
-      int *d = bmp->row[y] + bmp->cl;
-      int *p = temp2.row[y - bmp->ct];
-
-      for(int x = bmp->cl; x <= bmp->cr; x++)
-      {
-
-        int a = getl(*p);
-        int b = getl(*d);
-
-        if(ExtraMath::abs(a - b) >= threshold)
-        {
-          int lum = a - (amount * (a - b)); 
-          lum = clamp(lum, 255);
-          *d = Blend::keepLum(*p, lum);
-        }
-
-        d++;
-        p++;
-      }
+      cancelWide();
+      return;
     }
 
+    temp.blit(bmp, 0, 0, bmp->cl, bmp->ct, temp.w, temp.h);
+    finishWide(wide_planes, 0);
     Gui::hideProgress();
   }
 
@@ -2474,9 +4535,7 @@ namespace UnsharpMask
   {
     Items::dialog->hide();
     pushUndo();
-    apply(atoi(Items::radius->value()),
-          atof(Items::amount->value()),
-          atoi(Items::threshold->value()));
+    apply(atoi(Items::radius->value()));
   }
 
   void quit()
@@ -2494,19 +4553,11 @@ namespace UnsharpMask
   {
     int y1 = 8;
 
-    Items::dialog = new DialogWindow(256, 0, "Unsharp Mask");
+    Items::dialog = new DialogWindow(256, 0, "Lens Blur");
     Items::radius = new InputInt(Items::dialog, 0, y1, 96, 24, "Radius:", 0, 1, 100);
     y1 += 24 + 8;
-    Items::radius->value("1");
+    Items::radius->value("8");
     Items::radius->center();
-    Items::amount = new InputFloat(Items::dialog, 0, y1, 96, 24, "Amount:", 0, 0.1, 10.0);
-    y1 += 24 + 8;
-    Items::amount->value("1.5");
-    Items::amount->center();
-    Items::threshold = new InputInt(Items::dialog, 0, y1, 72, 24, "Threshold:", 0, 0, 255);
-    y1 += 24 + 8;
-    Items::threshold->value("0");
-    Items::threshold->center();
     Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
     Items::ok->callback((Fl_Callback *)close);
     Items::cancel->callback((Fl_Callback *)quit);
@@ -2515,136 +4566,56 @@ namespace UnsharpMask
   }
 }
 
-namespace ConvolutionMatrix
+namespace MotionBlur
 {
   namespace Items
   {
     DialogWindow *dialog;
-    Fl_Choice *mode;
-    InputInt *amount;
-    CheckBox *lum_only;
+    InputInt *length;
+    InputInt *angle;
     Fl_Button *ok;
     Fl_Button *cancel;
   }
 
-  void copyMatrix(const int src[3][3], int dest[3][3])
+  // line through the center of the kernel, drawn with bilinear weights
+  void apply(int length, int angle)
   {
-    for(int j = 0; j < 3; j++) 
+    const int r = (length + 1) / 2 + 1;
+    const int size = r * 2 + 1;
+    const float dx = std::cos(angle * (float)M_PI / 180);
+    const float dy = -std::sin(angle * (float)M_PI / 180);
+    const int steps = length * 4;
+    std::vector<float> kernel(size * size, 0);
+
+    for(int i = 0; i <= steps; i++)
     {
-      for(int i = 0; i < 3; i++) 
-      {
-        dest[i][j] = src[i][j];
-      }
+      const float t = (float)i / steps * length - length / 2.0f;
+      const float fx = r + t * dx;
+      const float fy = r + t * dy;
+      const int x = (int)std::floor(fx);
+      const int y = (int)std::floor(fy);
+      const float u = fx - x;
+      const float v = fy - y;
+
+      kernel[size * y + x] += (1 - u) * (1 - v);
+      kernel[size * y + x + 1] += u * (1 - v);
+      kernel[size * (y + 1) + x] += (1 - u) * v;
+      kernel[size * (y + 1) + x + 1] += u * v;
     }
-  }
-
-  enum
-  {
-    BOX_BLUR,
-    GAUSSIAN_BLUR,
-    SHARPEN,
-    EDGE_DETECT,
-    EMBOSS,
-    EMBOSS_REVERSE
-  };
- 
-  void apply(int amount, int mode, bool lum_only)
-  {
-    int div = 1;
-    int matrix[3][3];
 
-    switch(mode)
-    {
-      case BOX_BLUR:
-        copyMatrix(FilterMatrix::blur, matrix);
-        div = 9;
-        break;
-      case GAUSSIAN_BLUR:
-        copyMatrix(FilterMatrix::gaussian, matrix);
-        div = 16;
-        break;
-      case SHARPEN:
-        copyMatrix(FilterMatrix::sharpen, matrix);
-        div = 1;
-        break;
-      case EDGE_DETECT:
-        copyMatrix(FilterMatrix::edge, matrix);
-        div = 1;
-        break;
-      case EMBOSS:
-        copyMatrix(FilterMatrix::emboss, matrix);
-        div = 1;
-        break;
-      case EMBOSS_REVERSE:
-        copyMatrix(FilterMatrix::emboss_reverse, matrix);
-        div = 1;
-        break;
-    }
+    normalizeKernel(&kernel);
 
     Bitmap temp(bmp->cw, bmp->ch);
-    Gui::showProgress(bmp->h);
+    std::vector<float> wide_planes;
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    if(!convolveImage(&temp, &kernel[0], size, size, &wide_planes))
     {
-      int *p = temp.row[y - bmp->cl];
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
-      {
-        int lum = 0;
-        int r = 0;
-        int g = 0;
-        int b = 0;
-
-        if(lum_only)
-        {
-          for(int j = 0; j < 3; j++) 
-          {
-            for(int i = 0; i < 3; i++) 
-            {
-              lum += getl(bmp->getpixel(x + i - 1, y + j - 1)) * matrix[i][j];
-            }
-          }
-
-          lum /= div;
-          lum = clamp(lum, 255);
-
-          const int c = bmp->getpixel(x, y);
-
-          *p = Blend::trans(c, Blend::keepLum(c, lum), 255 - amount * 2.55);
-        }
-        else
-        {
-          for(int j = 0; j < 3; j++) 
-          {
-            for(int i = 0; i < 3; i++) 
-            {
-              const rgba_type rgba = getRgba(bmp->getpixel(x + i - 1,
-                                                           y + j - 1));
-              r += rgba.r * matrix[i][j];
-              g += rgba.g * matrix[i][j];
-              b += rgba.b * matrix[i][j];
-            }
-          }
-
-          r /= div;
-          g /= div;
-          b /= div;
-
-          r = clamp(r, 255);
-          g = clamp(g, 255);
-          b = clamp(b, 255);
-
-          const int c = bmp->getpixel(x, y);
-
-          *p = Blend::trans(c, makeRgba(r, g, b, geta(c)), 255 - amount * 2.55);
-        }
-      }
-
-      if(Gui::updateProgress(y) < 0)
-        return;
+      cancelWide();
+      return;
     }
 
     temp.blit(bmp, 0, 0, bmp->cl, bmp->ct, temp.w, temp.h);
-
+    finishWide(wide_planes, 0);
     Gui::hideProgress();
   }
 
@@ -2652,9 +4623,7 @@ namespace ConvolutionMatrix
   {
     Items::dialog->hide();
     pushUndo();
-    apply(atoi(Items::amount->value()),
-               Items::mode->value(),
-               Items::lum_only->value());
+    apply(atoi(Items::length->value()), atoi(Items::angle->value()));
   }
 
   void quit()
@@ -2672,25 +4641,15 @@ namespace ConvolutionMatrix
   {
     int y1 = 8;
 
-    Items::dialog = new DialogWindow(256, 0, "Convolution Matrix");
-    Items::mode = new Fl_Choice(96, y1, 128, 24, "Presets:");
-    Items::mode->tooltip("Presets");
-    Items::mode->textsize(10);
-    Items::mode->add("Box Blur");
-    Items::mode->add("Gaussian Blur");
-    Items::mode->add("Sharpen");
-    Items::mode->add("Edge Detect");
-    Items::mode->add("Emboss");
-    Items::mode->add("Emboss (Inverse)");
-    Items::mode->value(0);
+    Items::dialog = new DialogWindow(256, 0, "Motion Blur");
+    Items::length = new InputInt(Items::dialog, 0, y1, 96, 24, "Length:", 0, 1, 200);
     y1 += 24 + 8;
-    Items::amount = new InputInt(Items::dialog, 0, y1, 96, 24, "Amount:", 0, 1, 100);
-    Items::amount->value("100");
-    Items::amount->center();
+    Items::length->value("16");
+    Items::length->center();
+    Items::angle = new InputInt(Items::dialog, 0, y1, 96, 24, "Angle:", 0, 0, 359);
     y1 += 24 + 8;
-    Items::lum_only = new CheckBox(Items::dialog, 0, y1, 16, 16, "Luminosity-Based", 0);
-    Items::lum_only->center();
-    y1 += 16 + 8;
+    Items::angle->value("0");
+    Items::angle->center();
     Items::dialog->addOkCancelButtons(&Items::ok, &Items::cancel, &y1);
     Items::ok->callback((Fl_Callback *)close);
     Items::cancel->callback((Fl_Callback *)quit);
@@ -2709,42 +4668,66 @@ namespace Painting
     Fl_Button *cancel;
   }
 
-  void apply(int amount)
+  // symmetric nearest neighbor, each pair of pixels mirrored around the
+  // center contributes whichever is closer in color to the center
+  //
+  // the pair at (u, v) and the pair at (-u, -v) are the same two pixels,
+  // so only half the window is visited and each pick is counted twice
+  // (a tie picks each pixel once, as visiting both orders would)
+  void kernel(const tile_type &tile, void *data)
   {
-    Gui::showProgress(bmp->h);
+    const int amount = *(int *)data;
+    const int count = (amount * 2 + 1) * (amount * 2 + 1);
 
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int y = 0; y < tile.h; y++)
     {
-      int *p = bmp->row[y] + bmp->cl;
-      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      const int *row = tile.srcRow(y);
+      int *d = tile.destRow(y);
+
+      for(int x = 0; x < tile.w; x++)
       {
-        int r = 0;
-        int g = 0;
-        int b = 0;
-        int count = 0;
+        const int c3 = row[x];
+        const rgba_type rgba3 = getRgba(c3);
+        int r = rgba3.r;
+        int g = rgba3.g;
+        int b = rgba3.b;
 
-        for(int v = -amount; v <= amount; v++) 
+        for(int v = 0; v <= amount; v++) 
         {
-          for(int u = -amount; u <= amount; u++) 
-          {
-            const int c3 = *p;
-            const int c1 = bmp->getpixel(x + u, y + v);
-            const int c2 = bmp->getpixel(x - u, y - v);
+          const int *p1 = tile.srcRow(y + v) + x;
+          const int *p2 = tile.srcRow(y - v) + x;
 
-            if(diff24(c3, c1) < diff24(c3, c2))
+          for(int u = (v == 0 ? 1 : -amount); u <= amount; u++) 
+          {
+            const rgba_type rgba1 = getRgba(p1[u]);
+            const rgba_type rgba2 = getRgba(p2[-u]);
+            const int r1 = rgba1.r - rgba3.r;
+            const int g1 = rgba1.g - rgba3.g;
+            const int b1 = rgba1.b - rgba3.b;
+            const int r2 = rgba2.r - rgba3.r;
+            const int g2 = rgba2.g - rgba3.g;
+            const int b2 = rgba2.b - rgba3.b;
+            const int d1 = r1 * r1 + g1 * g1 + b1 * b1;
+            const int d2 = r2 * r2 + g2 * g2 + b2 * b2;
+
+            if(d1 < d2)
+            {
+              r += rgba1.r * 2;
+              g += rgba1.g * 2;
+              b += rgba1.b * 2;
+            }
+            else if(d1 > d2)
             {
-              r += getr(c1);
-              g += getg(c1);
-              b += getb(c1);
+              r += rgba2.r * 2;
+              g += rgba2.g * 2;
+              b += rgba2.b * 2;
             }
             else
             {
-              r += getr(c2);
-              g += getg(c2);
-              b += getb(c2);
+              r += rgba1.r + rgba2.r;
+              g += rgba1.g + rgba2.g;
+              b += rgba1.b + rgba2.b;
             }
-
-            count++;
           }
         }
 
@@ -2752,14 +4735,14 @@ namespace Painting
         g /= count;
         b /= count;
 
-        *p = makeRgba(r, g, b, geta(*p));
+        d[x] = makeRgba(r, g, b, rgba3.a);
       }
-
-      if(Gui::updateProgress(y) < 0)
-        return;
     }
+  }
 
-    Gui::hideProgress();
+  void apply(int amount)
+  {
+    filterTiles(kernel, &amount, amount);
   }
 
   void close()
@@ -2810,16 +4793,11 @@ namespace ForwardFFT
 
     std::vector<float> real(w * h, 0);
     std::vector<float> imag(w * h, 0);
-    std::vector<float> real_row(w, 0);
-    std::vector<float> imag_row(w, 0);
-    std::vector<float> real_col(h, 0);
-    std::vector<float> imag_col(h, 0);
 
     Gui::showProgress(3);
 
     for(int channel = 0; channel < 3; channel++)
     {
-      // forward horizontal pass
       for(int y = 0; y < h; y++)
       {
         int *p = bmp->row[y + bmp->ct] + bmp->cl;
@@ -2830,45 +4808,19 @@ namespace ForwardFFT
           switch(channel)
           {
             case 0:
-              real_row[x] = rgba.r;
+              real[x + w * y] = rgba.r;
               break;
             case 1:
-              real_row[x] = rgba.g;
+              real[x + w * y] = rgba.g;
               break;
             case 2:
-              real_row[x] = rgba.b;
+              real[x + w * y] = rgba.b;
               break;
           }
-
-          imag_row[x] = 0;
-        }
-
-        ExtraMath::forwardFFT(&real_row[0], &imag_row[0], w);
-
-        for(int x = 0; x < w; x++)
-        {
-          real[x + w * y] = real_row[x];
-          imag[x + w * y] = imag_row[x];
         }
       }
 
-      // forward vertical pass
-      for(int x = 0; x < w; x++)
-      {
-        for(int y = 0; y < h; y++)
-        {
-          real_col[y] = real[x + w * y];
-          imag_col[y] = imag[x + w * y];
-        }
-
-        ExtraMath::forwardFFT(&real_col[0], &imag_col[0], h);
-
-        for(int y = 0; y < h; y++)
-        {
-          real[x + w * y] = real_col[y];
-          imag[x + w * y] = imag_col[y];
-        }
-      }
+      ExtraMath::forwardFFT2D(&real[0], &imag[0], w, h, true);
 
       // convert to image
       for(int y = 0; y < h; y++)
@@ -2930,10 +4882,6 @@ namespace InverseFFT
 
     std::vector<float> real(w * h, 0);
     std::vector<float> imag(w * h, 0);
-    std::vector<float> real_row(w, 0);
-    std::vector<float> imag_row(w, 0);
-    std::vector<float> real_col(h, 0);
-    std::vector<float> imag_col(h, 0);
 
     Gui::showProgress(3);
 
@@ -2977,41 +4925,7 @@ namespace InverseFFT
         }
       }
 
-      // inverse horizontal pass
-      for(int y = 0; y < h; y++)
-      {
-        for(int x = 0; x < w; x++)
-        {
-          real_row[x] = real[x + w * y];
-          imag_row[x] = imag[x + w * y];
-        }
-
-        ExtraMath::inverseFFT(&real_row[0], &imag_row[0], w);
-
-        for(int x = 0; x < w; x++)
-        {
-          real[x + w * y] = real_row[x];
-          imag[x + w * y] = imag_row[x];
-        }
-      }
-
-      // inverse vertical pass
-      for(int x = 0; x < w; x++)
-      {
-        for(int y = 0; y < h; y++)
-        {
-          real_col[y] = real[x + w * y];
-          imag_col[y] = imag[x + w * y];
-        }
-
-        ExtraMath::inverseFFT(&real_col[0], &imag_col[0], h);
-
-        for(int y = 0; y < h; y++)
-        {
-          real[x + w * y] = real_col[y];
-          imag[x + w * y] = imag_col[y];
-        }
-      }
+      ExtraMath::inverseFFT2D(&real[0], &imag[0], w, h, true);
 
       // convert to image
       for(int y = 0; y < h; y++)
@@ -3061,12 +4975,15 @@ void FX::init()
   AutoCorrect::init();
   Restore::init();
   RemoveDust::init();
+  Median::init();
   DitherImage::init();
   StainedGlass::init();
   GaussianBlur::init();
   Sharpen::init();
   UnsharpMask::init();
   ConvolutionMatrix::init();
+  LensBlur::init();
+  MotionBlur::init();
   Painting::init();
 }
 
@@ -3125,6 +5042,11 @@ void FX::removeDust()
   RemoveDust::begin();
 }
 
+void FX::median()
+{
+  Median::begin();
+}
+
 void FX::desaturate()
 {
   Desaturate::begin();
@@ -3165,6 +5087,16 @@ void FX::convolutionMatrix()
   ConvolutionMatrix::begin();
 }
 
+void FX::lensBlur()
+{
+  LensBlur::begin();
+}
+
+void FX::motionBlur()
+{
+  MotionBlur::begin();
+}
+
 void FX::painting()
 {
   Painting::begin();
@@ -3175,13 +5107,14 @@ void FX::forwardFFT()
   int w = Project::bmp->cw;
   int h = Project::bmp->ch;
 
-  if(ExtraMath::isPowerOfTwo(w) && ExtraMath::isPowerOfTwo(h))
+  if(ExtraMath::isFFTSize(w) && ExtraMath::isFFTSize(h))
   {
     ForwardFFT::begin();
   }
   else
   {
-    Dialog::message("Error", "Image dimensions must be powers of two.");
+    Dialog::message("Error",
+                    "Image dimensions must only have factors of 2, 3 and 5.");
   }
 }
 
@@ -3190,13 +5123,15 @@ void FX::inverseFFT()
   int w = Project::bmp->cw;
   int h = Project::bmp->ch;
 
-  if(ExtraMath::isPowerOfTwo(w) && ExtraMath::isPowerOfTwo(h))
+  // the spectrum is stored as magnitude and phase side by side
+  if((w & 1) == 0 && ExtraMath::isFFTSize(w / 2) && ExtraMath::isFFTSize(h))
   {
     InverseFFT::begin();
   }
   else
   {
-    Dialog::message("Error", "Image dimensions must be powers of two.");
+    Dialog::message("Error",
+                    "Image dimensions must only have factors of 2, 3 and 5.");
   }
 }
 
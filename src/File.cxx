@@ -53,6 +53,8 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 #include "ExtraMath.H"
 #include "Palette.H"
 #include "Project.H"
+#include "Raster.H"
+#include "Stats.H"
 #include "Stroke.H"
 #include "Tool.H"
 #include "Undo.H"
@@ -207,6 +209,64 @@ namespace
     src->pos += length;
   }
 
+  // converts one decoded PNG row, 16-bit rows are also kept in linear
+  // light in wide (one raster row) and reduced the way libpng scales them
+  void convertPngRow(const png_byte *row, int *p, float *wide,
+                     const int w, const int channels, const bool sixteen)
+  {
+    for(int x = 0; x < w; x++)
+    {
+      int rgba[4] = { 0, 0, 0, 255 };
+
+      for(int i = 0; i < channels; i++)
+      {
+        if(sixteen)
+        {
+          const int val = (row[0] << 8) | row[1];
+
+          rgba[i] = (val * 255 + 32895) >> 16;
+          wide[i] = i < 3 ? linearLevel(val) : val;
+          row += 2;
+        }
+        else
+        {
+          rgba[i] = *row++;
+        }
+      }
+
+      if(sixteen)
+      {
+        if(channels == 3)
+          wide[3] = 65535;
+
+        wide += 4;
+      }
+
+      *p++ = makeRgba(rgba[0], rgba[1], rgba[2], rgba[3]);
+    }
+  }
+
+  // the reverse, writes 16-bit samples from one raster row
+  void packPngRow(const float *wide, png_byte *row,
+                  const int w, const bool use_alpha)
+  {
+    const int channels = use_alpha ? 4 : 3;
+
+    for(int x = 0; x < w; x++)
+    {
+      for(int i = 0; i < channels; i++)
+      {
+        const int val = i < 3 ? gammaLevel(wide[i])
+                              : clamp((int)(wide[i] + 0.5f), 65535);
+
+        *row++ = val >> 8;
+        *row++ = val & 0xFF;
+      }
+
+      wide += 4;
+    }
+  }
+
   // reset directories
   int *init()
   {
@@ -261,9 +321,10 @@ int File::loadFile(const char *fn)
   // load to a temporary bitmap first
   int overscroll = Project::overscroll;
   Bitmap *temp = 0;
+  Raster<float> *wide = 0;
 
   if(isPng(header))
-    temp = File::loadPng((const char *)fn, overscroll);
+    temp = File::loadPng((const char *)fn, overscroll, &wide);
   else if(isJpeg(header))
     temp = File::loadJpeg((const char *)fn, overscroll);
   else if(isBmp(header))
@@ -281,6 +342,9 @@ int File::loadFile(const char *fn)
   // and resize the brushstroke map to match the new image size
   delete Project::bmp;
   Project::bmp = temp;
+  Stats::invalidate();
+  Project::indices_stale = true;
+  Project::setWide(wide);
 
   delete Project::map;
   Project::map = new Map(Project::bmp->w, Project::bmp->h);
@@ -582,7 +646,8 @@ Bitmap *File::loadTarga(const char *fn, int overscroll)
   return temp;
 }
 
-Bitmap *File::loadPng(const char *fn, int overscroll)
+// 16-bit images are also stored in *wide, if given
+Bitmap *File::loadPng(const char *fn, int overscroll, Raster<float> **wide)
 {
   FileSP in(fn, "rb");
   if(!in.get())
@@ -598,6 +663,7 @@ Bitmap *File::loadPng(const char *fn, int overscroll)
 
   png_structp png_ptr;
   png_infop info_ptr;
+  Raster<float> *volatile raster = 0;
 
   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
   if(!png_ptr)
@@ -614,6 +680,7 @@ Bitmap *File::loadPng(const char *fn, int overscroll)
   {
     // pnglib does a goto here if there is an error
     png_destroy_read_struct(&png_ptr, &info_ptr, 0);
+    delete raster;
     return 0;
   }
 
@@ -650,9 +717,18 @@ Bitmap *File::loadPng(const char *fn, int overscroll)
   if(png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
     png_set_expand(png_ptr);
 
-  // convert 16-bit images to 8
-  if(bits_per_channel == 16)
+  // keep 16-bit images as they are if they can be stored, otherwise
+  // convert them to 8, rounding rather than dropping the low byte
+  const bool sixteen = bits_per_channel == 16 && wide;
+
+  if(bits_per_channel == 16 && !sixteen)
+  {
+#ifdef PNG_READ_SCALE_16_TO_8_SUPPORTED
+    png_set_scale_16(png_ptr);
+#else
     png_set_strip_16(png_ptr);
+#endif
+  }
 
   // expand grayscale images to RGB
   if(color_type == PNG_COLOR_TYPE_GRAY ||
@@ -672,6 +748,9 @@ Bitmap *File::loadPng(const char *fn, int overscroll)
 
   Bitmap *volatile temp = new Bitmap(w, h, overscroll);
 
+  if(sixteen)
+    raster = new Raster<float>(temp->w, temp->h);
+
   if(interlace)
   {
     // interlaced images require a buffer the size of the entire image
@@ -687,29 +766,9 @@ Bitmap *File::loadPng(const char *fn, int overscroll)
     // convert image
     for(int y = 0; y < h; y++)
     {
-      int *p = temp->row[y + overscroll] + overscroll;
-      int xx = 0;
-
-      png_bytep row = row_pointers[y];
-
-      for(int x = 0; x < w; x++)
-      {
-        if(channels == 3)
-        {
-          *p++ = makeRgb(row[xx + 0] & 0xFF,
-                         row[xx + 1] & 0xFF,
-                         row[xx + 2] & 0xFF);
-        }
-        else if(channels == 4)
-        {
-           *p++ = makeRgba(row[xx + 0] & 0xFF,
-                           row[xx + 1] & 0xFF,
-                           row[xx + 2] & 0xFF,
-                           row[xx + 3] & 0xFF);
-        }
-
-        xx += channels;
-      }
+      convertPngRow(row_pointers[y], temp->row[y + overscroll] + overscroll,
+                    sixteen ? raster->row[y + overscroll] + overscroll * 4 : 0,
+                    w, channels, sixteen);
     }
   }
   else
@@ -719,37 +778,19 @@ Bitmap *File::loadPng(const char *fn, int overscroll)
 
     for(int y = 0; y < h; y++)
     {
-      // read line
       png_read_row(png_ptr, &linebuf[0], 0);
-
-      int *p = temp->row[y + overscroll] + overscroll;
-      int xx = 0;
-
-      // convert line
-      for(int x = 0; x < w; x++)
-      {
-        if(channels == 3)
-        {
-          *p++ = makeRgb(linebuf[xx + 0] & 0xFF,
-                         linebuf[xx + 1] & 0xFF,
-                         linebuf[xx + 2] & 0xFF);
-        }
-        else if(channels == 4)
-        {
-           *p++ = makeRgba(linebuf[xx + 0] & 0xFF,
-                           linebuf[xx + 1] & 0xFF,
-                           linebuf[xx + 2] & 0xFF,
-                           linebuf[xx + 3] & 0xFF);
-        }
-
-        xx += channels;
-      }
+      convertPngRow(&linebuf[0], temp->row[y + overscroll] + overscroll,
+                    sixteen ? raster->row[y + overscroll] + overscroll * 4 : 0,
+                    w, channels, sixteen);
     }
   }
 
   png_read_end(png_ptr, info_ptr);
   png_destroy_read_struct(&png_ptr, &info_ptr, 0);
 
+  if(sixteen)
+    *wide = raster;
+
   return temp;
 }
 
@@ -815,9 +856,15 @@ Bitmap *File::loadPngFromArray(const unsigned char *array, int overscroll)
   if(png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
     png_set_expand(png_ptr);
 
-  // convert 16-bit images to 8
+  // convert 16-bit images to 8, rounding rather than dropping the low byte
   if(bits_per_channel == 16)
+  {
+#ifdef PNG_READ_SCALE_16_TO_8_SUPPORTED
+    png_set_scale_16(png_ptr);
+#else
     png_set_strip_16(png_ptr);
+#endif
+  }
 
   // expand grayscale images to RGB
   if(color_type == PNG_COLOR_TYPE_GRAY ||
@@ -1145,6 +1192,10 @@ int File::savePng(const char *fn)
   int w = bmp->cw;
   int h = bmp->ch;
 
+  // an image loaded with 16 bits per channel is saved the same way
+  Project::checkWide();
+  Raster<float> *wide = use_palette ? 0 : Project::wide;
+
   png_init_io(png_ptr, out.get());
 
   if(use_palette)
@@ -1193,7 +1244,7 @@ int File::savePng(const char *fn)
   }
   else
   {
-    png_set_IHDR(png_ptr, info_ptr, w, h, 8,
+    png_set_IHDR(png_ptr, info_ptr, w, h, wide ? 16 : 8,
                  use_alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
                  PNG_FILTER_TYPE_BASE);
@@ -1206,22 +1257,48 @@ int File::savePng(const char *fn)
     bytes = 4;
   if(use_palette)
     bytes = 1;
+  if(wide)
+    bytes *= 2;
 
   std::vector<png_byte> linebuf(w * bytes);
 
+  // an indexed image is saved with its own indices, others are
+  // converted in one threaded pass
+  Project::updateIndices();
+
+  Map *indices = Project::indices;
+  Map *temp = 0;
+
+  if(use_palette && !indices)
+  {
+    temp = new Map(bmp->w, bmp->h);
+    pal->toIndexed(bmp, temp);
+    indices = temp;
+  }
+
   for(int y = 0; y < h; y++)
   {
+    if(wide)
+    {
+      packPngRow(wide->row[y + overscroll] + overscroll * 4, &linebuf[0],
+                 w, use_alpha);
+      png_write_row(png_ptr, &linebuf[0]);
+      continue;
+    }
+
     int *p = bmp->row[y + overscroll] + overscroll;
 
     for(int x = 0; x < w * bytes; x += bytes)
     {
       if(use_palette)
       {
+        const int index = indices->row[y + overscroll][x + overscroll];
+
         if(use_alpha)
-          linebuf[x] = pal->lookup(*p) +
+          linebuf[x] = index +
                        (int)(pal->max * ((255 - geta(*p)) / (int)alpha_step));
         else
-          linebuf[x] = pal->lookup(*p);
+          linebuf[x] = index;
       }
       else
       {
@@ -1238,6 +1315,8 @@ int File::savePng(const char *fn)
     png_write_row(png_ptr, &linebuf[0]);
   }
 
+  delete temp;
+
   png_write_end(png_ptr, info_ptr);
   png_destroy_write_struct(&png_ptr, &info_ptr);
 
@@ -1318,16 +1397,20 @@ int File::saveJava(const char *fn)
   fprintf(outp, "  static byte array[] = \n");
   fprintf(outp, "  {\n");
 
+  Map indices(bmp->w, bmp->h);
+  Project::palette->toIndexed(bmp, &indices);
+
   int count = 0;
 
   if(option == 0)
   {
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int y = 0; y < h; y++)
     {
-      for(int x = bmp->cl; x <= bmp->cr; x += 2)
+      for(int x = 0; x < w; x += 2)
       {
-        int c1 = Project::palette->lookup(bmp->getpixel(x, y)) & 15;
-        int c2 = Project::palette->lookup(bmp->getpixel(x + 1, y)) & 15;
+        int c1 = indices.row[y + overscroll][x + overscroll] & 15;
+        int c2 = indices.row[y + overscroll]
+                            [std::min(x + 1, w - 1) + overscroll] & 15;
 
         if(count == 0)
           fprintf(outp, "    ");
@@ -1347,11 +1430,11 @@ int File::saveJava(const char *fn)
   }
   else if(option == 1)
   {
-    for(int y = bmp->ct; y <= bmp->cb; y++)
+    for(int y = 0; y < h; y++)
     {
-      for(int x = bmp->cl; x <= bmp->cr; x++)
+      for(int x = 0; x < w; x++)
       {
-        int c = Project::palette->lookup(bmp->getpixel(x, y));
+        int c = indices.row[y + overscroll][x + overscroll];
 
         if(count == 0)
           fprintf(outp, "    ");
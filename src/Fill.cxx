@@ -19,12 +19,15 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 */
 
 #include <algorithm>
+#include <vector>
 
 #include "Bitmap.H"
 #include "Brush.H"
 #include "Fill.H"
 #include "Gui.H"
 #include "Inline.H"
+#include "Map.H"
+#include "Palette.H"
 #include "Project.H"
 #include "Undo.H"
 #include "View.H"
@@ -43,6 +46,83 @@ namespace
     else
       return 0;
   }
+
+  // indexed mode, the area of the clicked index (exactly, the fill range
+  // doesn't apply) gets the palette entry nearest the brush color
+  void fillIndexed(int x, int y)
+  {
+    Bitmap *bmp = Project::bmp;
+    Map *indices = Project::indices;
+    Palette *pal = Project::palette.get();
+    const int index = pal->lookup(Project::brush->color);
+    const int target = indices->row[y][x];
+
+    if(index == target)
+      return;
+
+    const rgba_type rgba = getRgba(pal->data[index]);
+    const int color = makeRgb(rgba.r, rgba.g, rgba.b);
+
+    // start of each span still to fill
+    std::vector<int> stack;
+    stack.push_back(x);
+    stack.push_back(y);
+
+    while(!stack.empty())
+    {
+      y = stack.back();
+      stack.pop_back();
+      x = stack.back();
+      stack.pop_back();
+
+      unsigned char *p = indices->row[y];
+
+      if(p[x] != target)
+        continue;
+
+      int x1 = x;
+      int x2 = x;
+
+      while(x1 > bmp->cl && p[x1 - 1] == target)
+        x1--;
+      while(x2 < bmp->cr && p[x2 + 1] == target)
+        x2++;
+
+      for(int i = x1; i <= x2; i++)
+      {
+        p[i] = index;
+        bmp->row[y][i] = color;
+      }
+
+      // spans above and below
+      for(int yy = y - 1; yy <= y + 1; yy += 2)
+      {
+        if(yy < bmp->ct || yy > bmp->cb)
+          continue;
+
+        const unsigned char *q = indices->row[yy];
+        bool span = false;
+
+        for(int i = x1; i <= x2; i++)
+        {
+          if(q[i] == target)
+          {
+            if(!span)
+            {
+              stack.push_back(i);
+              stack.push_back(yy);
+            }
+
+            span = true;
+          }
+          else
+          {
+            span = false;
+          }
+        }
+      }
+    }
+  }
 }
 
 Fill::Fill()
@@ -59,6 +139,15 @@ void Fill::push(View *view)
                                    Project::bmp->cr, Project::bmp->cb))
   {
     Undo::push();
+
+    if(Project::indices)
+    {
+      Project::indices_stale = false;
+      fillIndexed(view->imgx, view->imgy);
+      view->drawMain(true);
+      return;
+    }
+
     int target = Project::bmp->getpixel(view->imgx, view->imgy);
     rgba_type rgba = getRgba(Project::brush->color);
     int color = makeRgba(rgba.r, rgba.g, rgba.b, 255 - Project::brush->trans);
@@ -345,7 +345,9 @@ void Gui::init()
   menubar->add("&Palette/&Create From Image...", 0,
     (Fl_Callback *)Dialog::makePalette, 0, 0);
   menubar->add("&Palette/&Dither Image...", 0,
-    (Fl_Callback *)FX::ditherImage, 0, FL_MENU_DIVIDER);
+    (Fl_Callback *)FX::ditherImage, 0, 0);
+  menubar->add("&Palette/&Indexed Image", 0,
+    (Fl_Callback *)paletteIndexed, 0, FL_MENU_TOGGLE | FL_MENU_DIVIDER);
   menubar->add("&Palette/Presets/Default", 0,
     (Fl_Callback *)paletteDefault, 0, 0);
   menubar->add("&Palette/Presets/Grays", 0,
@@ -389,6 +391,10 @@ void Gui::init()
     (Fl_Callback *)FX::unsharpMask, 0, 0);
   menubar->add("F&X/Filter/Convolution Matrix...", 0,
     (Fl_Callback *)FX::convolutionMatrix, 0, 0);
+  menubar->add("F&X/Filter/Lens Blur...", 0,
+    (Fl_Callback *)FX::lensBlur, 0, 0);
+  menubar->add("F&X/Filter/Motion Blur...", 0,
+    (Fl_Callback *)FX::motionBlur, 0, 0);
   menubar->add("F&X/Photo/Auto-Correct...", 0,
     (Fl_Callback *)FX::autoCorrect, 0, 0);
   menubar->add("F&X/Photo/Correction Matrix", 0,
@@ -397,6 +403,8 @@ void Gui::init()
     (Fl_Callback *)FX::restore, 0, 0);
   menubar->add("F&X/Photo/Remove Dust...", 0,
     (Fl_Callback *)FX::removeDust, 0, 0);
+  menubar->add("F&X/Photo/Median...", 0,
+    (Fl_Callback *)FX::median, 0, 0);
   menubar->add("F&X/Artistic/Stained Glass...", 0,
     (Fl_Callback *)FX::stainedGlass, 0, 0);
   menubar->add("F&X/Artistic/Painting...", 0,
@@ -974,7 +982,6 @@ void Gui::checkPaletteInsert(Widget *widget, void *var)
   Project::palette->copy(undo_palette);
   begin_palette_undo = true;
   Project::palette->insertColor(Project::brush->color, palette_swatches->var);
-  Project::palette->fillTable();
   Project::palette->draw(palette_swatches);
   palette_swatches->do_callback();
 }
@@ -984,7 +991,6 @@ void Gui::checkPaletteDelete(Widget *widget, void *var)
   Project::palette->copy(undo_palette);
   begin_palette_undo = true;
   Project::palette->deleteColor(palette_swatches->var);
-  Project::palette->fillTable();
   Project::palette->draw(palette_swatches);
 
   if(palette_swatches->var > Project::palette->max - 1)
@@ -1370,42 +1376,58 @@ void Gui::paletteDefault()
 {
   Project::palette->setDefault();
   Project::palette->draw(palette_swatches);
+  view->drawMain(true);
 }
 
 void Gui::paletteGrays()
 {
   Project::palette->setGrays();
   Project::palette->draw(palette_swatches);
+  view->drawMain(true);
 }
 
 void Gui::paletteBlackAndWhite()
 {
   Project::palette->setBlackAndWhite();
   Project::palette->draw(palette_swatches);
+  view->drawMain(true);
 }
 
 void Gui::paletteWebSafe()
 {
   Project::palette->setWebSafe();
   Project::palette->draw(palette_swatches);
+  view->drawMain(true);
 }
 
 void Gui::palette3LevelRGB()
 {
   Project::palette->set3LevelRGB();
   Project::palette->draw(palette_swatches);
+  view->drawMain(true);
 }
 
 void Gui::palette4LevelRGB()
 {
   Project::palette->set4LevelRGB();
   Project::palette->draw(palette_swatches);
+  view->drawMain(true);
 }
 
 void Gui::palette332()
 {
   Project::palette->set332();
   Project::palette->draw(palette_swatches);
+  view->drawMain(true);
+}
+
+// switch between RGBA and indexed images (pixels that are palette
+// indices, painted and shown through the palette)
+void Gui::paletteIndexed()
+{
+  Undo::push();
+  Project::setIndexed(!Project::indices);
+  view->drawMain(true);
 }
 
 void Gui::checkClearToPaintColor()
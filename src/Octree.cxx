@@ -22,94 +22,116 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 
 Octree::Octree()
 {
-  root = new node_type;
-  root->value = 0;
-
-  for(int i = 0; i < 8; i++)
-    root->child[i] = 0;
+  chunk_count = 0;
+  chunk_max = 16;
+  chunks = new node_type *[chunk_max];
+  clear();
 }
 
 Octree::~Octree()
 {
-  clear(root);
+  for(int i = 0; i < chunk_count; i++)
+    delete[] chunks[i];
+
+  delete[] chunks;
+}
+
+// drop every node but the root, the chunks are kept for reuse
+void Octree::clear()
+{
+  used = 0;
+  newNode(0);
 }
 
-void Octree::clear(node_type *node)
+int Octree::newNode(const float &value)
 {
+  if(used >= chunk_count * CHUNK_SIZE)
+  {
+    if(chunk_count == chunk_max)
+    {
+      node_type **temp = new node_type *[chunk_max * 2];
+
+      for(int i = 0; i < chunk_count; i++)
+        temp[i] = chunks[i];
+
+      delete[] chunks;
+      chunks = temp;
+      chunk_max *= 2;
+    }
+
+    chunks[chunk_count++] = new node_type[CHUNK_SIZE];
+  }
+
+  node_type *node = getNode(used);
+  node->value = value;
+
   for(int i = 0; i < 8; i++)
-    if(node->child[i])
-      clear(node->child[i]);
+    node->child[i] = 0;
 
-  delete node;
+  return used++;
 }
 
 void Octree::write(const int &r, const int &g, const int &b,
                    const float &value)
 {
-  node_type *node = root;
+  int index = 0;
 
   for(int i = 7; i >= 0; i--)
   {
-    const int index = ((r >> i) & 1) << 0 |
-                      ((g >> i) & 1) << 1 |
-                      ((b >> i) & 1) << 2;
+    const int j = ((r >> i) & 1) << 0 |
+                  ((g >> i) & 1) << 1 |
+                  ((b >> i) & 1) << 2;
 
-    if(node->child[index])
+    int next = getNode(index)->child[j];
+
+    if(!next)
     {
-      node = node->child[index];
-      continue;
+      next = newNode(0);
+      getNode(index)->child[j] = next;
     }
 
-    node->child[index] = new node_type;
-    node = node->child[index];
-    node->value = 0;
-
-    for(int j = 0; j < 8; j++)
-      node->child[j] = 0;
+    index = next;
   }
 
-  node->value = value;
+  getNode(index)->value = value;
 }
 
 // this allows the octree to be used in the context of a palette lookup table
 void Octree::writePath(const int &r, const int &g, const int &b,
                        const float &value)
 {
-  node_type *node = root;
+  int index = 0;
 
   for(int i = 7; i >= 0; i--)
   {
-    const int index = ((r >> i) & 1) << 0 |
-                      ((g >> i) & 1) << 1 |
-                      ((b >> i) & 1) << 2;
+    const int j = ((r >> i) & 1) << 0 |
+                  ((g >> i) & 1) << 1 |
+                  ((b >> i) & 1) << 2;
 
-    if(node->child[index])
+    int next = getNode(index)->child[j];
+
+    if(!next)
     {
-        node = node->child[index];
-        continue;
+      next = newNode(value);
+      getNode(index)->child[j] = next;
     }
 
-    node->child[index] = new node_type;
-    node = node->child[index];
-    node->value = value;
-
-    for(int j = 0; j < 8; j++)
-        node->child[j] = 0;
+    index = next;
   }
 }
 
 float Octree::read(const int &r, const int &g, const int &b)
 {
-  node_type *node = root;
+  const node_type *node = getNode(0);
 
   for(int i = 7; i >= 0; i--)
   {
-    const int index = ((r >> i) & 1) << 0 |
-                      ((g >> i) & 1) << 1 |
-                      ((b >> i) & 1) << 2;
+    const int j = ((r >> i) & 1) << 0 |
+                  ((g >> i) & 1) << 1 |
+                  ((b >> i) & 1) << 2;
 
-    if(node->child[index])
-      node = node->child[index];
+    if(node->child[j])
+      node = getNode(node->child[j]);
     else
       break;
   }
@@ -90,6 +90,8 @@ void Offset::drag(View *view)
   offset_buffer->blit(Project::bmp, 0, 0,
                       x + overscroll, y + overscroll, w - x, h - y);
 
+  // moved since the last redraw, an indexed image needs its indices again
+  Project::indices_stale = true;
   view->drawMain(true);
   Gui::checkOffsetValues(dx, dy);
 }
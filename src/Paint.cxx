@@ -18,6 +18,7 @@ along with Rendera; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 */
 
+#include <algorithm>
 #include <cmath>
 
 #include "Bitmap.H"
@@ -81,10 +82,31 @@ void Paint::drag(View *view)
 
   if(stroke->type != 3)
   {
+    const int lastx = stroke->lastx;
+    const int lasty = stroke->lasty;
+
     stroke->draw(view->imgx, view->imgy, view->ox, view->oy, view->zoom);
-    view->drawMain(false);
-    stroke->previewPaint(view->backbuf, view->ox, view->oy, view->zoom,
-                         view->bgr_order);
+
+    if(Render::isLive())
+    {
+      // paint the new segment now so release only has to finish up
+      const int r = Project::brush->size / 2 + 1;
+
+      Blend::set(Project::brush->blend);
+      Render::live(std::min(lastx, view->imgx) - r,
+                   std::min(lasty, view->imgy) - r,
+                   std::max(lastx, view->imgx) + r,
+                   std::max(lasty, view->imgy) + r);
+      Blend::set(Blend::TRANS);
+      view->drawMain(false);
+    }
+    else
+    {
+      view->drawMain(false);
+      stroke->previewPaint(view->backbuf, view->ox, view->oy, view->zoom,
+                           view->bgr_order);
+    }
+
     view->redraw();
   }
 }
@@ -168,6 +190,8 @@ bool Paint::isActive()
 
 void Paint::reset()
 {
+  // a stroke painted while dragging is taken back out of the image
+  Render::cancelLive();
   active = false;
   state = 0;
 }
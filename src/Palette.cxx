@@ -19,13 +19,15 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 */
 
 #include <algorithm>
+#include <vector>
 
 #include "Bitmap.H"
 #include "Blend.H"
 #include "FileSP.H"
 #include "Inline.H"
-#include "Octree.H"
+#include "Map.H"
 #include "Palette.H"
+#include "Threads.H"
 #include "Widget.H"
 
 namespace
@@ -34,6 +36,336 @@ namespace
   {
     return getl(c1) < getl(c2);
   }
+
+  // position of a color in the 32x32x32 table
+  inline int cellIndex(const int &r, const int &g, const int &b)
+  {
+    return (r >> 3) | (g >> 3) << 5 | (b >> 3) << 10;
+  }
+
+  // corner color of a table cell
+  inline int cellColor(const int &cell)
+  {
+    return makeRgb24((cell & 31) << 3, ((cell >> 5) & 31) << 3,
+                     (cell >> 10) << 3);
+  }
+
+  // palette entries in order of green, for nearest-color searches
+  struct search_type
+  {
+    const int *data;
+    int max;
+    int order[256];
+    int start[256];
+  };
+
+  void initSearch(search_type *search, const int *data, const int &max)
+  {
+    search->data = data;
+    search->max = max;
+
+    int count[257];
+
+    for(int i = 0; i < 257; i++)
+      count[i] = 0;
+
+    for(int i = 0; i < max; i++)
+      count[getg(data[i]) + 1]++;
+
+    for(int i = 1; i < 257; i++)
+      count[i] += count[i - 1];
+
+    for(int i = 0; i < 256; i++)
+      search->start[i] = count[i];
+
+    for(int i = 0; i < max; i++)
+      search->order[count[getg(data[i])]++] = i;
+  }
+
+  // nearest palette entry (earliest on a tie), working outward in green
+  // from a first guess until the green distance alone is too far
+  int nearest(const search_type *search, const int &c, int use)
+  {
+    const int *data = search->data;
+    const int g = getg(c);
+    const int mid = search->start[g];
+    int smallest = diff24(c, data[use]);
+
+    for(int j = mid; j < search->max; j++)
+    {
+      const int i = search->order[j];
+      const int dg = getg(data[i]) - g;
+
+      if(dg * dg > smallest)
+        break;
+
+      const int d = diff24(c, data[i]);
+
+      if(d < smallest || (d == smallest && i < use))
+      {
+        smallest = d;
+        use = i;
+      }
+    }
+
+    for(int j = mid - 1; j >= 0; j--)
+    {
+      const int i = search->order[j];
+      const int dg = g - getg(data[i]);
+
+      if(dg * dg > smallest)
+        break;
+
+      const int d = diff24(c, data[i]);
+
+      if(d < smallest || (d == smallest && i < use))
+      {
+        smallest = d;
+        use = i;
+      }
+    }
+
+    return use;
+  }
+
+  // reaches a color box (8x8x8, starting at r, g, b) from a color,
+  // nearest and furthest squared distances to it
+  inline int nearestInBox(const int &c, const int &r, const int &g,
+                          const int &b)
+  {
+    const rgba_type rgba = getRgba(c);
+    const int dr = std::max(std::max(r - rgba.r, rgba.r - r - 7), 0);
+    const int dg = std::max(std::max(g - rgba.g, rgba.g - g - 7), 0);
+    const int db = std::max(std::max(b - rgba.b, rgba.b - b - 7), 0);
+
+    return dr * dr + dg * dg + db * db;
+  }
+
+  inline int furthestInBox(const int &c, const int &r, const int &g,
+                           const int &b)
+  {
+    const rgba_type rgba = getRgba(c);
+    const int dr = std::max(std::abs(rgba.r - r), std::abs(rgba.r - r - 7));
+    const int dg = std::max(std::abs(rgba.g - g), std::abs(rgba.g - g - 7));
+    const int db = std::max(std::abs(rgba.b - b), std::abs(rgba.b - b - 7));
+
+    return dr * dr + dg * dg + db * db;
+  }
+
+  // whether entry i wins over entry use for some color in the box,
+  // the difference of the two squared distances is linear in the color,
+  // so the smallest value over the box (at a corner) decides
+  bool winsInBox(const int *data, const int &i, const int &use,
+                 const int &r, const int &g, const int &b)
+  {
+    const rgba_type c1 = getRgba(data[i]);
+    const rgba_type c2 = getRgba(data[use]);
+    const int lo[3] = { r, g, b };
+    const int v1[3] = { c1.r, c1.g, c1.b };
+    const int v2[3] = { c2.r, c2.g, c2.b };
+    int f = 0;
+
+    for(int j = 0; j < 3; j++)
+    {
+      const int s = 2 * (v2[j] - v1[j]);
+
+      f += std::min(s * lo[j], s * (lo[j] + 7))
+             + v1[j] * v1[j] - v2[j] * v2[j];
+    }
+
+    return f < 0 || (f == 0 && i < use);
+  }
+
+  // entries that are nearest to some color in a table cell: the one
+  // nearest its center and any other that wins over it somewhere,
+  // returned in index order
+  void cellEntries(const search_type *search, const int &cell, int use,
+                   std::vector<int> *list)
+  {
+    const int *data = search->data;
+    const int r = (cell & 31) << 3;
+    const int g = ((cell >> 5) & 31) << 3;
+    const int b = (cell >> 10) << 3;
+
+    use = nearest(search, makeRgb24(r + 4, g + 4, b + 4), use);
+
+    // entries further than this can't win anywhere in the cell
+    const int reach = furthestInBox(data[use], r, g, b);
+
+    list->clear();
+    list->push_back(use);
+
+    // entries sorted by green, starting inside the cell
+    for(int j = search->start[g]; j < search->max; j++)
+    {
+      const int i = search->order[j];
+      const int dg = std::max(getg(data[i]) - g - 7, 0);
+
+      if(dg * dg > reach)
+        break;
+
+      if(i != use && nearestInBox(data[i], r, g, b) <= reach &&
+         winsInBox(data, i, use, r, g, b))
+      {
+        list->push_back(i);
+      }
+    }
+
+    for(int j = search->start[g] - 1; j >= 0; j--)
+    {
+      const int i = search->order[j];
+      const int dg = g - getg(data[i]);
+
+      if(dg * dg > reach)
+        break;
+
+      if(i != use && nearestInBox(data[i], r, g, b) <= reach &&
+         winsInBox(data, i, use, r, g, b))
+      {
+        list->push_back(i);
+      }
+    }
+
+    std::sort(list->begin(), list->end());
+  }
+
+  // stores the entries of a table cell (see fillTable)
+  void packCell(int *table, const int &cell, const std::vector<int> &list,
+                std::vector<unsigned char> *lists)
+  {
+    if(list.size() == 1)
+    {
+      table[cell] = list[0];
+      return;
+    }
+
+    table[cell] = 256 + lists->size();
+    lists->push_back(list.size() - 1);
+
+    for(int i = 0; i < (int)list.size(); i++)
+      lists->push_back(list[i]);
+  }
+
+  void setDetail(Palette *pal, const std::vector<unsigned char> &lists)
+  {
+    delete[] pal->detail;
+    pal->detail = new unsigned char[std::max((int)lists.size(), 1)];
+    std::copy(lists.begin(), lists.end(), pal->detail);
+  }
+
+  // redoes the table after editing one entry: remap gives the new index
+  // of each old entry (-1 if its color is gone), changed is the entry with
+  // a new color (-1 if none), only cells that lost one of their entries
+  // or where the new color can come nearer than their own are searched
+  void updateTable(Palette *pal, const int *remap, const int &changed)
+  {
+    if(!pal->detail)
+    {
+      pal->fillTable();
+      return;
+    }
+
+    const int *data = pal->data;
+    search_type search;
+    initSearch(&search, data, pal->max);
+
+    std::vector<unsigned char> lists;
+    std::vector<int> list;
+    int use = 0;
+
+    for(int cell = 0; cell < 32 * 32 * 32; cell++)
+    {
+      const int old = pal->table[cell];
+      const unsigned char *entries = old < 256 ? 0 : pal->detail + old - 256;
+      const int count = entries ? entries[0] + 1 : 1;
+      bool redo = false;
+
+      list.clear();
+
+      for(int i = 0; i < count; i++)
+      {
+        const int j = remap[entries ? entries[i + 1] : old];
+
+        if(j < 0)
+        {
+          redo = true;
+          break;
+        }
+
+        list.push_back(j);
+      }
+
+      if(!redo && changed >= 0)
+      {
+        const int r = (cell & 31) << 3;
+        const int g = ((cell >> 5) & 31) << 3;
+        const int b = (cell >> 10) << 3;
+
+        // every color in the cell is at least this close to an entry
+        int reach = furthestInBox(data[list[0]], r, g, b);
+
+        for(int i = 1; i < (int)list.size(); i++)
+          reach = std::min(reach, furthestInBox(data[list[i]], r, g, b));
+
+        redo = nearestInBox(data[changed], r, g, b) <= reach;
+      }
+
+      if(redo)
+      {
+        cellEntries(&search, cell, use, &list);
+        use = list[0];
+      }
+
+      packCell(pal->table, cell, list, &lists);
+    }
+
+    setDetail(pal, lists);
+  }
+
+  // conversion to and from palette indices
+  struct index_type
+  {
+    Palette *pal;
+    Bitmap *bmp;
+    Map *indices;
+    int colors[256];
+    int max;
+  };
+
+  void indexRows(int first, int last, int, void *data)
+  {
+    index_type *job = (index_type *)data;
+    Bitmap *bmp = job->bmp;
+
+    for(int y = first; y <= last; y++)
+    {
+      const int *p = bmp->row[y] + bmp->cl;
+      unsigned char *d = job->indices->row[y] + bmp->cl;
+
+      for(int x = 0; x < bmp->cw; x++)
+        d[x] = job->pal->lookup(p[x]);
+    }
+  }
+
+  void colorRows(int first, int last, int, void *data)
+  {
+    index_type *job = (index_type *)data;
+    Bitmap *bmp = job->bmp;
+
+    for(int y = first; y <= last; y++)
+    {
+      unsigned char *p = job->indices->row[y] + bmp->cl;
+      int *d = bmp->row[y] + bmp->cl;
+
+      for(int x = 0; x < bmp->cw; x++)
+      {
+        if(p[x] >= job->max)
+          p[x] = job->max - 1;
+
+        d[x] = job->colors[p[x]] | (d[x] & 0xFF000000);
+      }
+    }
+  }
 }
 
 Palette::Palette()
@@ -41,8 +373,9 @@ Palette::Palette()
   // palette color data
   data = new int[256];
 
-  // data structure for fast color lookup
-  table = new Octree();
+  // tables for fast color lookup
+  table = new int[32 * 32 * 32];
+  detail = 0;
 
   // use a default palette
   setDefault();
@@ -50,7 +383,8 @@ Palette::Palette()
 
 Palette::~Palette()
 {
-  delete table;
+  delete[] detail;
+  delete[] table;
   delete[] data;
 }
 
@@ -108,7 +442,7 @@ void Palette::draw(Widget *widget)
   widget->redraw();
 }
 
-// functions to modify palette (be sure to call fillTable afterwards)
+// copy palette colors (be sure to call fillTable afterwards)
 void Palette::copy(Palette *dest)
 {
   for(int i = 0; i < 256; i++)
@@ -117,17 +451,25 @@ void Palette::copy(Palette *dest)
   dest->max = max;
 }
 
+// functions to edit a single entry, these update only the affected
+// parts of the lookup table
 void Palette::insertColor(int color, int index)
 {
   if(max >= 256)
     return;
 
+  int remap[256];
+
+  for(int i = 0; i < max; i++)
+    remap[i] = i < index ? i : i + 1;
+
   max++;
 
   for(int i = max - 1; i > index; i--)
     data[i] = data[i - 1];
 
   data[index] = color;
+  updateTable(this, remap, index);
 }
 
 void Palette::deleteColor(int index)
@@ -135,62 +477,111 @@ void Palette::deleteColor(int index)
   if(max <= 1)
     return;
 
+  int remap[256];
+
+  for(int i = 0; i < max; i++)
+    remap[i] = i < index ? i : i - 1;
+
+  remap[index] = -1;
+
   for(int i = index; i < max - 1; i++)
     data[i] = data[i + 1];
 
   max--;
+  updateTable(this, remap, -1);
 }
 
 void Palette::replaceColor(int color, int index)
 {
+  int remap[256];
+
+  for(int i = 0; i < max; i++)
+    remap[i] = i;
+
+  remap[index] = -1;
   data[index] = color;
+  updateTable(this, remap, index);
 }
 
 // generate color lookup table
 void Palette::fillTable()
 {
-  delete table;
-  table = new Octree();
+  search_type search;
+  initSearch(&search, data, max);
 
-  const int step = 8;
+  // cells of the color cube with a single nearest entry hold it directly,
+  // the others refer to a list of the entries that can be nearest there
+  // (the count less one, then the entries), from 256 up
+  std::vector<unsigned char> lists;
+  std::vector<int> list;
+  int use = 0;
 
-  // each 4x4 block of the color cube gets a palette entry
-  // close enough, and avoids a huge data structure
-  for(int b = 0; b <= 256 - step; b += step)
+  for(int cell = 0; cell < 32 * 32 * 32; cell++)
   {
-    for(int g = 0; g <= 256 - step; g += step)
-    {
-      for(int r = 0; r <= 256 - step; r += step)
-      {
-        int c = makeRgb24(r, g, b);
-        int smallest = 0xFFFFFF;
-        int use = 0;
+    cellEntries(&search, cell, use, &list);
+    use = list[0];
+    packCell(table, cell, list, &lists);
+  }
 
-        for(int i = 0; i < max; i++)
-        {
-          int d = diff24(c, data[i]);
-          if(d < smallest)
-          {
-            smallest = d;
-            use = i;
-          }
-        }
+  setDetail(this, lists);
+}
 
-        table->writePath(r, g, b, use);
-      }
+// return the nearest palette entry for an RGB color
+// (earliest entry on a tie)
+int Palette::lookup(const int &c)
+{
+  const rgba_type rgba = getRgba(c);
+  const int use = table[cellIndex(rgba.r, rgba.g, rgba.b)];
+
+  if(use < 256)
+    return use;
+
+  const unsigned char *list = detail + use - 256;
+  const int count = list[0] + 1;
+  int best = list[1];
+  int smallest = diff24(c, data[best]);
+
+  for(int i = 2; i <= count; i++)
+  {
+    const int d = diff24(c, data[list[i]]);
+
+    if(d < smallest)
+    {
+      smallest = d;
+      best = list[i];
     }
   }
 
-  // put exact matches back in
-  for(int i = 0; i < max; i++)
-    table->writePath(getr(data[i]), getg(data[i]), getb(data[i]), i);
+  return best;
 }
 
-// return the nearest palette entry for an RGB color
-int Palette::lookup(const int &c)
+// palette index of each pixel in the clipped area of a bitmap,
+// written to the same place in a map the size of the bitmap
+void Palette::toIndexed(Bitmap *src, Map *dest)
+{
+  index_type job;
+  job.pal = this;
+  job.bmp = src;
+  job.indices = dest;
+
+  Threads::run(indexRows, src->ct, src->cb, &job);
+}
+
+// the reverse, each pixel in the clipped area of a bitmap gets the color
+// of its index (keeping its alpha), indices past the end of the palette
+// are moved to the last entry
+void Palette::fromIndexed(Map *src, Bitmap *dest)
 {
-  rgba_type rgba = getRgba(c);
-  return table->read(rgba.r, rgba.g, rgba.b);
+  index_type job;
+  job.pal = this;
+  job.bmp = dest;
+  job.indices = src;
+  job.max = max;
+
+  for(int i = 0; i < max; i++)
+    job.colors[i] = data[i] & 0xFFFFFF;
+
+  Threads::run(colorRows, dest->ct, dest->cb, &job);
 }
 
 void Palette::sort()
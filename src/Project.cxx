@@ -18,6 +18,7 @@ along with Rendera; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 */
 
+#include <algorithm>
 #include <climits>
 #include <string>
 
@@ -34,11 +35,36 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 #include "Paint.H"
 #include "Palette.H"
 #include "Project.H"
+#include "Raster.H"
+#include "Stats.H"
 #include "Stroke.H"
 #include "Text.H"
 #include "Tool.H"
 #include "Undo.H"
 
+namespace
+{
+  // palette the indices were last matched with
+  int index_colors[256];
+  int index_max = 0;
+
+  void rememberPalette()
+  {
+    Palette *pal = Project::palette.get();
+
+    std::copy(pal->data, pal->data + pal->max, index_colors);
+    index_max = pal->max;
+  }
+
+  bool paletteChanged()
+  {
+    Palette *pal = Project::palette.get();
+
+    return pal->max != index_max ||
+           !std::equal(pal->data, pal->data + pal->max, index_colors);
+  }
+}
+
 // container for commonly-used objects and related functions
 namespace Project
 {
@@ -46,6 +72,20 @@ namespace Project
   Bitmap *select_bmp = new Bitmap(8, 8);
   Map *map = 0;
 
+  // palette index of each pixel in indexed mode (0 otherwise), bmp keeps
+  // the matching colors for the tools and filters that work on RGBA
+  Map *indices = 0;
+
+  // set when the image may have changed since the indices were found
+  bool indices_stale = false;
+
+  // the image with more than eight bits per channel (from a 16-bit file),
+  // bmp holds it reduced for everything that works on RGBA
+  Raster<float> *wide = 0;
+
+  // set when the image may have changed without it
+  bool wide_stale = false;
+
   SP<Brush> brush = new Brush();
   SP<Palette> palette = new Palette();
   SP<Stroke> stroke = new Stroke();
@@ -107,6 +147,9 @@ void Project::newImage(int w, int h)
     delete bmp;
 
   bmp = new Bitmap(w, h, overscroll);
+  Stats::invalidate();
+  indices_stale = true;
+  setWide(0);
 
   if(map)
     delete map;
@@ -125,6 +168,9 @@ void Project::resizeImage(int w, int h)
     delete bmp;
 
   bmp = temp;
+  Stats::invalidate();
+  indices_stale = true;
+  setWide(0);
 
   if(map)
     delete map;
@@ -133,3 +179,63 @@ void Project::resizeImage(int w, int h)
   map->clear(0);
 }
 
+// turns indexed mode on or off, turning it on maps the image to the
+// palette
+void Project::setIndexed(bool indexed)
+{
+  delete indices;
+  indices = 0;
+
+  if(indexed)
+  {
+    setWide(0);
+    indices = new Map(bmp->w, bmp->h);
+    indices->clear(0);
+    indices_stale = true;
+    updateIndices();
+  }
+}
+
+// in indexed mode, finds the palette index of each pixel once after
+// something that works on RGBA changed the image and gives the pixels
+// their palette colors, or gives them their new colors if the palette
+// changed, otherwise there is nothing to do
+void Project::updateIndices()
+{
+  if(!indices)
+    return;
+
+  if(indices->w != bmp->w || indices->h != bmp->h)
+  {
+    delete indices;
+    indices = new Map(bmp->w, bmp->h);
+    indices->clear(0);
+    indices_stale = true;
+  }
+
+  if(indices_stale)
+    palette->toIndexed(bmp, indices);
+  else if(!paletteChanged())
+    return;
+
+  palette->fromIndexed(indices, bmp);
+  rememberPalette();
+  indices_stale = false;
+  Stats::invalidate();
+}
+
+// replaces the wide image, which must be the size of bmp and match it
+void Project::setWide(Raster<float> *raster)
+{
+  delete wide;
+  wide = raster;
+  wide_stale = false;
+}
+
+// drops the wide image if bmp changed without it (only some filters
+// keep it up to date) or holds palette colors
+void Project::checkWide()
+{
+  if(wide && (wide_stale || indices))
+    setWide(0);
+}
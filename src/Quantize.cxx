@@ -25,10 +25,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 #include "Dialog.H"
 #include "Gui.H"
 #include "Inline.H"
-#include "Octree.H"
 #include "Palette.H"
 #include "Project.H"
 #include "Quantize.H"
+#include "Threads.H"
 #include "Widget.H"
 
 namespace
@@ -76,60 +76,188 @@ namespace
     c1->freq += c2->freq;  
   }
 
-  // reduces color count by averaging sections of the color cube
-  int limitColors(Octree *histogram, color_type *colors, int max_colors)
+  // per-thread results of the histogram scan, block sums are kept for
+  // 16x16x16 sections of the color cube (red, green, blue, count)
+  struct band_type
   {
-    int count = 0;
-    int step = 16;
+    int lightest, darkest;
+    std::vector<double> sum;
+    std::vector<int> hits;
+  };
+
+  struct histogram_type
+  {
+    Bitmap *bmp;
+    unsigned int *used;
+    std::vector<band_type> *bands;
+    const int *wanted;
+    int wanted_count;
+  };
+
+  // mark the colors used and sum up sections of the color cube
+  void scanRows(int first, int last, int band, void *data)
+  {
+    histogram_type *histogram = (histogram_type *)data;
+    Bitmap *bmp = histogram->bmp;
+    unsigned int *used = histogram->used;
+    band_type *b = &(*histogram->bands)[band];
+    double *sum = &b->sum[0];
+
+    for(int j = first; j <= last; j++)
+    {
+      const int *p = bmp->row[j] + bmp->cl;
+
+      for(int i = bmp->cl; i <= bmp->cr; i++, p++)
+      {
+        if(getl(*p) > getl(b->lightest))
+          b->lightest = *p;
+
+        if(getl(*p) < getl(b->darkest))
+          b->darkest = *p;
+
+        const rgba_type rgba = getRgba(*p);
+        const int c = makeRgb24(rgba.r, rgba.g, rgba.b);
+        const unsigned int bit = 1u << (c & 31);
+
+        if((__atomic_load_n(&used[c >> 5], __ATOMIC_RELAXED) & bit) == 0)
+          __sync_fetch_and_or(&used[c >> 5], bit);
+
+        double *s = sum + 4 * ((rgba.r >> 4) | (rgba.g >> 4) << 4 |
+                               (rgba.b >> 4) << 8);
+
+        s[0] += rgba.r;
+        s[1] += rgba.g;
+        s[2] += rgba.b;
+        s[3]++;
+      }
+    }
+  }
+
+  // count the pixels of each of a sorted list of colors
+  void countRows(int first, int last, int band, void *data)
+  {
+    histogram_type *histogram = (histogram_type *)data;
+    Bitmap *bmp = histogram->bmp;
+    const int *wanted = histogram->wanted;
+    const int *end = wanted + histogram->wanted_count;
+    int *hits = &(*histogram->bands)[band].hits[0];
+
+    for(int j = first; j <= last; j++)
+    {
+      const int *p = bmp->row[j] + bmp->cl;
 
-    if(max_colors == 512)
-      step = 32;
+      for(int i = bmp->cl; i <= bmp->cr; i++, p++)
+      {
+        const rgba_type rgba = getRgba(*p);
+        const int c = makeRgb24(rgba.r, rgba.g, rgba.b);
+        const int *q = std::lower_bound(wanted, end, c);
+
+        if(q != end && *q == c)
+          hits[q - wanted]++;
+      }
+    }
+  }
+
+  // reduces color count by averaging sections of the color cube,
+  // "special" colors are weighted by "freq" instead of their pixel count
+  int limitColors(const std::vector<double> &sum, color_type *colors,
+                  int max_colors, const float &inc,
+                  const int *special, const int *special_hits,
+                  const int &special_count, const float &freq)
+  {
+    const int shift = max_colors == 512 ? 5 : 4;
+    const int size = 256 >> shift;
+    const int fold = 1 << (shift - 4);
+    std::vector<double> block(size * size * size * 4, 0.0);
 
-    for(int b = 0; b <= 256 - step; b += step)
+    for(int b = 0; b < 16; b++)
     {
-      for(int g = 0; g <= 256 - step; g += step)
+      for(int g = 0; g < 16; g++)
       {
-        for(int r = 0; r <= 256 - step; r += step)
+        for(int r = 0; r < 16; r++)
         {
-          float rr = 0;
-          float gg = 0;
-          float bb = 0;
-          float div = 0;
-
-          for(int k = 0; k < step; k++)
-          {
-            for(int j = 0; j < step; j++)
-            {
-              for(int i = 0; i < step; i++)
-              {
-                const float d = histogram->read(r + i, g + j, b + k);
-
-                if(d > 0)
-                  histogram->write(r + i, g + j, b + k, 0);
-
-                rr += d * (r + i);
-                gg += d * (g + j);
-                bb += d * (b + k);
-                div += d;
-              }
-            }
-          }
-
-          if(div > 0)
-          {
-            rr /= div;
-            gg /= div;
-            bb /= div;
-            makeColor(&colors[count], rr, gg, bb, div);
-            count++;
-          }
+          const double *s = &sum[4 * (r | g << 4 | b << 8)];
+          double *d = &block[4 * (r / fold + g / fold * size +
+                                  b / fold * size * size)];
+
+          for(int i = 0; i < 4; i++)
+            d[i] += s[i] * inc;
         }
       }
     }
 
+    for(int i = 0; i < special_count; i++)
+    {
+      const rgba_type rgba = getRgba(special[i]);
+      double *d = &block[4 * ((rgba.r >> shift) |
+                              (rgba.g >> shift) * size |
+                              (rgba.b >> shift) * size * size)];
+      const double weight = freq - special_hits[i] * inc;
+
+      d[0] += weight * rgba.r;
+      d[1] += weight * rgba.g;
+      d[2] += weight * rgba.b;
+      d[3] += weight;
+    }
+
+    int count = 0;
+
+    for(int i = 0; i < size * size * size; i++)
+    {
+      const double *d = &block[4 * i];
+
+      if(d[3] > 0)
+      {
+        makeColor(&colors[count], d[0] / d[3], d[1] / d[3], d[2] / d[3],
+                  d[3]);
+        count++;
+      }
+    }
+
     return count;
   }
 
+  // lowest-numbered active color nearest to each color (earliest on a tie),
+  // this takes the place of a full error matrix
+  struct nearest_type
+  {
+    color_type *colors;
+    int *nearest;
+    float *least;
+  };
+
+  void findNearest(nearest_type *job, const int &j)
+  {
+    color_type *colors = job->colors;
+    float least = 999999;
+    int nearest = -1;
+
+    for(int i = 0; i < j; i++)
+    {
+      if(colors[i].active)
+      {
+        const float e = error(&colors[i], &colors[j]);
+
+        if(e < least)
+        {
+          least = e;
+          nearest = i;
+        }
+      }
+    }
+
+    job->least[j] = least;
+    job->nearest[j] = nearest;
+  }
+
+  void nearestRows(int first, int last, int, void *data)
+  {
+    nearest_type *job = (nearest_type *)data;
+
+    for(int j = first; j <= last; j++)
+      findNearest(job, j);
+  }
+
   // stretch a palette to obtain the exact number of colors desired
   void stretchPalette(int *data, int current, int target)
   {
@@ -177,6 +305,390 @@ namespace
     for(int x = 0; x < target; x++)
       data[x] = temp[x];
   }
+
+  // stretch to the size asked for, then update the palette widget
+  // and lookup table
+  void finishPalette(Palette *pal, int size)
+  {
+    if(pal->max != size)
+    {
+      stretchPalette(pal->data, pal->max, size);
+      pal->max = size;
+    }
+
+    Gui::drawPalette();
+    pal->fillTable();
+  }
+
+  // 32x32x32 color histogram with the moments used by Wu's quantizer
+  // (pixel count, color sums and sum of squares), indexed from 1 so that
+  // the cumulative tables have a zero border
+  enum
+  {
+    WEIGHT,
+    SUM_R,
+    SUM_G,
+    SUM_B,
+    SUM_SQUARES,
+    MOMENTS
+  };
+
+  inline int momentIndex(const int &r, const int &g, const int &b)
+  {
+    return (r * 33 + g) * 33 + b;
+  }
+
+  struct moment_job_type
+  {
+    Bitmap *bmp;
+    std::vector<std::vector<double> > *bands;
+  };
+
+  void momentRows(int first, int last, int band, void *data)
+  {
+    moment_job_type *job = (moment_job_type *)data;
+    Bitmap *bmp = job->bmp;
+    double *m = &(*job->bands)[band][0];
+
+    for(int j = first; j <= last; j++)
+    {
+      const int *p = bmp->row[j] + bmp->cl;
+
+      for(int i = bmp->cl; i <= bmp->cr; i++, p++)
+      {
+        const rgba_type rgba = getRgba(*p);
+        double *d = m + MOMENTS * momentIndex((rgba.r >> 3) + 1,
+                                              (rgba.g >> 3) + 1,
+                                              (rgba.b >> 3) + 1);
+
+        d[WEIGHT]++;
+        d[SUM_R] += rgba.r;
+        d[SUM_G] += rgba.g;
+        d[SUM_B] += rgba.b;
+        d[SUM_SQUARES] += rgba.r * rgba.r + rgba.g * rgba.g + rgba.b * rgba.b;
+      }
+    }
+  }
+
+  // moments are interleaved, MOMENTS values per cell
+  void getMoments(Bitmap *src, std::vector<double> *moments)
+  {
+    const int size = 33 * 33 * 33 * MOMENTS;
+    std::vector<std::vector<double> > bands(Threads::count());
+
+    for(int i = 0; i < (int)bands.size(); i++)
+      bands[i].assign(size, 0.0);
+
+    moment_job_type job;
+    job.bmp = src;
+    job.bands = &bands;
+
+    Threads::run(momentRows, src->ct, src->cb, &job);
+
+    moments->assign(size, 0.0);
+
+    for(int i = 0; i < (int)bands.size(); i++)
+      for(int j = 0; j < size; j++)
+        (*moments)[j] += bands[i][j];
+  }
+
+  // occupied histogram cells as weighted points (average color)
+  struct point_type
+  {
+    float c[3];
+    float weight;
+  };
+
+  void getPoints(const std::vector<double> &moments,
+                 std::vector<point_type> *points)
+  {
+    points->clear();
+
+    for(int i = 0; i < 33 * 33 * 33; i++)
+    {
+      const double *d = &moments[MOMENTS * i];
+
+      if(d[WEIGHT] > 0)
+      {
+        point_type point;
+
+        point.c[0] = d[SUM_R] / d[WEIGHT];
+        point.c[1] = d[SUM_G] / d[WEIGHT];
+        point.c[2] = d[SUM_B] / d[WEIGHT];
+        point.weight = d[WEIGHT];
+        points->push_back(point);
+      }
+    }
+  }
+
+  // Wu's quantizer, boxes are (r0, r1] x (g0, g1] x (b0, b1] in cells
+  struct box_type
+  {
+    int r0, r1;
+    int g0, g1;
+    int b0, b1;
+    int vol;
+  };
+
+  // sum of a moment over a box, from the cumulative table
+  double volume(const box_type &box, const double *m, const int &k)
+  {
+    return m[MOMENTS * momentIndex(box.r1, box.g1, box.b1) + k]
+         - m[MOMENTS * momentIndex(box.r1, box.g1, box.b0) + k]
+         - m[MOMENTS * momentIndex(box.r1, box.g0, box.b1) + k]
+         + m[MOMENTS * momentIndex(box.r1, box.g0, box.b0) + k]
+         - m[MOMENTS * momentIndex(box.r0, box.g1, box.b1) + k]
+         + m[MOMENTS * momentIndex(box.r0, box.g1, box.b0) + k]
+         + m[MOMENTS * momentIndex(box.r0, box.g0, box.b1) + k]
+         - m[MOMENTS * momentIndex(box.r0, box.g0, box.b0) + k];
+  }
+
+  // sum of a moment over the part of a box up to "pos" along an axis
+  // (less the part below the box, which is the same for every "pos")
+  double bottom(const box_type &box, const int &axis,
+                const double *m, const int &k)
+  {
+    switch(axis)
+    {
+      case 0:
+        return - m[MOMENTS * momentIndex(box.r0, box.g1, box.b1) + k]
+               + m[MOMENTS * momentIndex(box.r0, box.g1, box.b0) + k]
+               + m[MOMENTS * momentIndex(box.r0, box.g0, box.b1) + k]
+               - m[MOMENTS * momentIndex(box.r0, box.g0, box.b0) + k];
+      case 1:
+        return - m[MOMENTS * momentIndex(box.r1, box.g0, box.b1) + k]
+               + m[MOMENTS * momentIndex(box.r1, box.g0, box.b0) + k]
+               + m[MOMENTS * momentIndex(box.r0, box.g0, box.b1) + k]
+               - m[MOMENTS * momentIndex(box.r0, box.g0, box.b0) + k];
+      default:
+        return - m[MOMENTS * momentIndex(box.r1, box.g1, box.b0) + k]
+               + m[MOMENTS * momentIndex(box.r1, box.g0, box.b0) + k]
+               + m[MOMENTS * momentIndex(box.r0, box.g1, box.b0) + k]
+               - m[MOMENTS * momentIndex(box.r0, box.g0, box.b0) + k];
+    }
+  }
+
+  double top(const box_type &box, const int &axis, const int &pos,
+             const double *m, const int &k)
+  {
+    switch(axis)
+    {
+      case 0:
+        return m[MOMENTS * momentIndex(pos, box.g1, box.b1) + k]
+             - m[MOMENTS * momentIndex(pos, box.g1, box.b0) + k]
+             - m[MOMENTS * momentIndex(pos, box.g0, box.b1) + k]
+             + m[MOMENTS * momentIndex(pos, box.g0, box.b0) + k];
+      case 1:
+        return m[MOMENTS * momentIndex(box.r1, pos, box.b1) + k]
+             - m[MOMENTS * momentIndex(box.r1, pos, box.b0) + k]
+             - m[MOMENTS * momentIndex(box.r0, pos, box.b1) + k]
+             + m[MOMENTS * momentIndex(box.r0, pos, box.b0) + k];
+      default:
+        return m[MOMENTS * momentIndex(box.r1, box.g1, pos) + k]
+             - m[MOMENTS * momentIndex(box.r1, box.g0, pos) + k]
+             - m[MOMENTS * momentIndex(box.r0, box.g1, pos) + k]
+             + m[MOMENTS * momentIndex(box.r0, box.g0, pos) + k];
+    }
+  }
+
+  // weighted variance of a box
+  double variance(const box_type &box, const double *m)
+  {
+    const double r = volume(box, m, SUM_R);
+    const double g = volume(box, m, SUM_G);
+    const double b = volume(box, m, SUM_B);
+
+    return volume(box, m, SUM_SQUARES) -
+           (r * r + g * g + b * b) / volume(box, m, WEIGHT);
+  }
+
+  // best place to cut a box along an axis, returns the score to maximize
+  double maximize(const box_type &box, const int &axis,
+                  const int &first, const int &last, int *cut,
+                  const double *whole, const double *m)
+  {
+    double base[4];
+
+    for(int k = 0; k < 4; k++)
+      base[k] = bottom(box, axis, m, k);
+
+    double best = 0;
+    *cut = -1;
+
+    for(int i = first; i < last; i++)
+    {
+      double half[4];
+
+      for(int k = 0; k < 4; k++)
+        half[k] = base[k] + top(box, axis, i, m, k);
+
+      if(half[WEIGHT] == 0)
+        continue;
+
+      double score = (half[SUM_R] * half[SUM_R] +
+                      half[SUM_G] * half[SUM_G] +
+                      half[SUM_B] * half[SUM_B]) / half[WEIGHT];
+
+      for(int k = 0; k < 4; k++)
+        half[k] = whole[k] - half[k];
+
+      if(half[WEIGHT] == 0)
+        continue;
+
+      score += (half[SUM_R] * half[SUM_R] +
+                half[SUM_G] * half[SUM_G] +
+                half[SUM_B] * half[SUM_B]) / half[WEIGHT];
+
+      if(score > best)
+      {
+        best = score;
+        *cut = i;
+      }
+    }
+
+    return best;
+  }
+
+  // split box1, putting the upper part in box2
+  bool cutBox(box_type *box1, box_type *box2, const double *m)
+  {
+    double whole[4];
+
+    for(int k = 0; k < 4; k++)
+      whole[k] = volume(*box1, m, k);
+
+    int cut[3];
+    double best[3];
+
+    best[0] = maximize(*box1, 0, box1->r0 + 1, box1->r1, &cut[0], whole, m);
+    best[1] = maximize(*box1, 1, box1->g0 + 1, box1->g1, &cut[1], whole, m);
+    best[2] = maximize(*box1, 2, box1->b0 + 1, box1->b1, &cut[2], whole, m);
+
+    int axis = 2;
+
+    if(best[0] >= best[1] && best[0] >= best[2])
+      axis = 0;
+    else if(best[1] >= best[0] && best[1] >= best[2])
+      axis = 1;
+
+    if(cut[axis] < 0)
+      return false;
+
+    *box2 = *box1;
+
+    switch(axis)
+    {
+      case 0:
+        box2->r0 = box1->r1 = cut[0];
+        break;
+      case 1:
+        box2->g0 = box1->g1 = cut[1];
+        break;
+      default:
+        box2->b0 = box1->b1 = cut[2];
+        break;
+    }
+
+    box1->vol = (box1->r1 - box1->r0) * (box1->g1 - box1->g0) *
+                (box1->b1 - box1->b0);
+    box2->vol = (box2->r1 - box2->r0) * (box2->g1 - box2->g0) *
+                (box2->b1 - box2->b0);
+
+    return true;
+  }
+
+  // median cut, splits the box with the most pixels times its longest
+  // side at the weighted median along that side
+  struct median_box_type
+  {
+    int first, last;
+    int axis;
+    double score;
+  };
+
+  struct sortByAxis
+  {
+    int axis;
+
+    bool operator()(const point_type &p1, const point_type &p2) const
+    {
+      return p1.c[axis] < p2.c[axis];
+    }
+  };
+
+  void measureBox(median_box_type *box, const std::vector<point_type> &points)
+  {
+    float lo[3] = { 255, 255, 255 };
+    float hi[3] = { 0, 0, 0 };
+    double weight = 0;
+
+    for(int i = box->first; i <= box->last; i++)
+    {
+      for(int k = 0; k < 3; k++)
+      {
+        lo[k] = std::min(lo[k], points[i].c[k]);
+        hi[k] = std::max(hi[k], points[i].c[k]);
+      }
+
+      weight += points[i].weight;
+    }
+
+    box->axis = 0;
+
+    for(int k = 1; k < 3; k++)
+      if(hi[k] - lo[k] > hi[box->axis] - lo[box->axis])
+        box->axis = k;
+
+    box->score = 0;
+
+    if(box->last > box->first)
+      box->score = weight * (hi[box->axis] - lo[box->axis]);
+  }
+
+  // k-means refinement over the histogram cells
+  struct kmeans_type
+  {
+    const point_type *points;
+    const float *cr;
+    const float *cg;
+    const float *cb;
+    int count;
+    std::vector<std::vector<double> > *bands;
+  };
+
+  void kmeansRows(int first, int last, int band, void *data)
+  {
+    kmeans_type *job = (kmeans_type *)data;
+    double *sums = &(*job->bands)[band][0];
+
+    for(int i = first; i <= last; i++)
+    {
+      const point_type *p = &job->points[i];
+      float least = 1e9f;
+      int use = 0;
+
+      for(int j = 0; j < job->count; j++)
+      {
+        const float r = p->c[0] - job->cr[j];
+        const float g = p->c[1] - job->cg[j];
+        const float b = p->c[2] - job->cb[j];
+        const float d = r * r + g * g + b * b;
+
+        if(d < least)
+        {
+          least = d;
+          use = j;
+        }
+      }
+
+      double *s = sums + 4 * use;
+
+      s[0] += p->c[0] * p->weight;
+      s[1] += p->c[1] * p->weight;
+      s[2] += p->c[2] * p->weight;
+      s[3] += p->weight;
+    }
+  }
 }
 
 // Pairwise clustering quantization, adapted from the algorithm described here:
@@ -189,57 +701,66 @@ namespace
 // accuracy is not as important).
 void Quantize::pca(Bitmap *src, Palette *pal, int size)
 {
-  // popularity histogram
-  Octree histogram;
-
   int max;
   int rep = size;
 
   // build histogram, inc is the weight of 1 pixel in the image
-  float inc = 1.0 / (src->cw * src->ch);
-  int count = 0;
+  const float inc = 1.0 / (src->cw * src->ch);
 
-  // measure of how colorful an image is
-  // more colorful images fill more spaces in the table
-  std::vector<int> color_metric(512, 0);
+  // one bit for each 24-bit color, and per-thread section sums
+  std::vector<unsigned int> used(16777216 / 32, 0);
+  std::vector<band_type> bands(Threads::count());
+
+  for(int i = 0; i < (int)bands.size(); i++)
+  {
+    bands[i].lightest = makeRgb(0, 0, 0);
+    bands[i].darkest = makeRgb(255, 255, 255);
+    bands[i].sum.resize(4096 * 4, 0.0);
+  }
+
+  histogram_type histogram;
+  histogram.bmp = src;
+  histogram.used = &used[0];
+  histogram.bands = &bands;
+
+  Threads::run(scanRows, src->ct, src->cb, &histogram);
 
   // preserve lightest/darkest colors
   int lightest = makeRgb(0, 0, 0);
   int darkest = makeRgb(255, 255, 255);
+  std::vector<double> sum(4096 * 4, 0.0);
 
-  for(int j = src->ct; j <= src->cb; j++)
+  for(int i = 0; i < (int)bands.size(); i++)
   {
-    int *p = src->row[j] + src->cl;
+    if(getl(bands[i].lightest) > getl(lightest))
+      lightest = bands[i].lightest;
 
-    for(int i = src->cl; i <= src->cr; i++)
-    {
-      if(getl(*p) > getl(lightest))
-        lightest = *p;
-
-      if(getl(*p) < getl(darkest))
-        darkest = *p;
+    if(getl(bands[i].darkest) < getl(darkest))
+      darkest = bands[i].darkest;
 
-      rgba_type rgba = getRgba(*p++);
-      float freq = histogram.read(rgba.r, rgba.g, rgba.b);
+    for(int j = 0; j < 4096 * 4; j++)
+      sum[j] += bands[i].sum[j];
+  }
 
-      if(freq < inc)
-        count++;
+  // measure of how colorful an image is
+  // more colorful images fill more spaces in the table
+  // (each word of the bitmap is 32 reds in one 1/8 section)
+  std::vector<int> color_metric(512, 0);
+  int count = 0;
 
-      histogram.write(rgba.r, rgba.g, rgba.b, freq + inc);
+  for(int i = 0; i < (int)used.size(); i++)
+  {
+    if(used[i])
+    {
+      const int c = i * 32;
 
-      color_metric[((int)rgba.r >> 5) << 0 |
-                   ((int)rgba.g >> 5) << 3 |
-                   ((int)rgba.b >> 5) << 6] = 1;
+      count += __builtin_popcount(used[i]);
+      color_metric[((c & 255) >> 5) << 0 |
+                   (((c >> 8) & 255) >> 5) << 3 |
+                   ((c >> 16) >> 5) << 6] = 1;
     }
   }
 
-  // assign maximum frequency to lightest/darkest colors
-  rgba_type rgba;
-  rgba = getRgba(lightest);
-  histogram.write(rgba.r, rgba.g, rgba.b, 1.0f);
-  rgba = getRgba(darkest);
-  histogram.write(rgba.r, rgba.g, rgba.b, 1.0f);
-
   // if image uses more than 1/2 of the color cube then
   // reduce table sizes to save time
   int color_metric_count = 0;
@@ -259,30 +780,83 @@ void Quantize::pca(Bitmap *src, Palette *pal, int size)
   for(int i = 0; i < max_colors; i++)
     colors[i].active = false;
 
-  // quantization error matrix
-  std::vector<float> err_data(((max_colors + 1) * max_colors) / 2);
+  // lightest/darkest colors are given maximum frequency
+  const rgba_type light = getRgba(lightest);
+  const rgba_type dark = getRgba(darkest);
+  int special[2];
+  int special_count = 0;
+
+  special[special_count++] = makeRgb24(light.r, light.g, light.b);
+
+  if(makeRgb24(dark.r, dark.g, dark.b) != special[0])
+    special[special_count++] = makeRgb24(dark.r, dark.g, dark.b);
+
+  // find the colors that need pixel counts
+  std::vector<int> wanted;
+
+  if(count <= rep)
+  {
+    for(int i = 0; i < special_count; i++)
+      used[special[i] >> 5] |= 1u << (special[i] & 31);
+
+    for(int i = 0; i < (int)used.size(); i++)
+    {
+      if(used[i] == 0)
+        continue;
+
+      for(int j = 0; j < 32; j++)
+        if(used[i] & (1u << j))
+          wanted.push_back(i * 32 + j);
+    }
+  }
+  else
+  {
+    wanted.assign(special, special + special_count);
+    std::sort(wanted.begin(), wanted.end());
+  }
+
+  for(int i = 0; i < (int)bands.size(); i++)
+    bands[i].hits.assign(wanted.size(), 0);
+
+  histogram.wanted = &wanted[0];
+  histogram.wanted_count = wanted.size();
+
+  Threads::run(countRows, src->ct, src->cb, &histogram);
+
+  std::vector<int> hits(wanted.size(), 0);
+
+  for(int i = 0; i < (int)bands.size(); i++)
+    for(int j = 0; j < (int)wanted.size(); j++)
+      hits[j] += bands[i].hits[j];
 
   // skip if already enough colors
   if(count <= rep)
   {
     count = 0;
 
-    for(int i = 0; i < 16777216; i++)
+    for(int i = 0; i < (int)wanted.size(); i++)
     {
-      rgba_type rgba = getRgba(i);
-      const float freq = histogram.read(rgba.r, rgba.g, rgba.b);
+      const rgba_type rgba = getRgba(wanted[i]);
+      float freq = hits[i] * inc;
 
-      if(freq > 0)
-      {
-        makeColor(&colors[count], rgba.r, rgba.g, rgba.b, freq);
-        count++;
-      }
+      if(wanted[i] == special[0] || wanted[i] == special[special_count - 1])
+        freq = 1.0f;
+
+      makeColor(&colors[count], rgba.r, rgba.g, rgba.b, freq);
+      count++;
     }
   }
   else
   {
+    int special_hits[2];
+
+    for(int i = 0; i < special_count; i++)
+      special_hits[i] = hits[std::lower_bound(wanted.begin(), wanted.end(),
+                                              special[i]) - wanted.begin()];
+
     // limit color count to 4096
-    count = limitColors(&histogram, &colors[0], max_colors);
+    count = limitColors(sum, &colors[0], max_colors, inc,
+                        special, special_hits, special_count, 1.0f);
   }
 
   // set max
@@ -290,41 +864,32 @@ void Quantize::pca(Bitmap *src, Palette *pal, int size)
   if(max < rep)
     rep = max;
 
-  // init error matrix
-  for(int j = 0; j < max; j++)
-  {
-    for(int i = 0; i < j; i++)
-      err_data[i + (j + 1) * j / 2] = error(&colors[i], &colors[j]);
-  }
+  // nearest neighbor of each color
+  std::vector<int> nearest(max + 1);
+  std::vector<float> least(max + 1);
 
-  Gui::showProgress(count - rep);
+  nearest_type job;
+  job.colors = &colors[0];
+  job.nearest = &nearest[0];
+  job.least = &least[0];
 
-  // measure offset between array elements
-  const int step = &(colors[1].active) - &(colors[0].active);
+  Threads::run(nearestRows, 0, max - 1, &job, 64);
+
+  Gui::showProgress(count - rep);
 
   while(count > rep)
   {
     int ii = 0, jj = 0;
     float least_err = 999999;
-    bool *a = &(colors[0].active);
 
-    // find lowest value in error matrix
-    for(int j = 0; j < max; j++, a += step)
+    // find lowest quantization error
+    for(int j = 0; j < max; j++)
     {
-      if(*a)
+      if(colors[j].active && least[j] < least_err)
       {
-        float *e = &err_data[(j + 1) * j / 2];
-        bool *b = &(colors[0].active);
-
-        for(int i = 0; i < j; i++, e++, b += step)
-        {
-          if(*b && (*e < least_err))
-          {
-            least_err = *e;
-            ii = i;
-            jj = j;
-          }
-        }
+        least_err = least[j];
+        ii = nearest[j];
+        jj = j;
       }
     }
 
@@ -333,11 +898,29 @@ void Quantize::pca(Bitmap *src, Palette *pal, int size)
     colors[jj].active = false;
     count--;
 
-    // recompute error matrix for new row
-    for(int j = ii; j < max; j++)
+    // colors above i that were nearest to i or j need a new search,
+    // the rest only check the merged color
+    findNearest(&job, ii);
+
+    for(int j = ii + 1; j < max; j++)
     {
-      if(colors[j].active)
-        err_data[ii + (j + 1) * j / 2] = error(&colors[ii], &colors[j]);
+      if(!colors[j].active)
+        continue;
+
+      if(nearest[j] == ii || nearest[j] == jj)
+      {
+        findNearest(&job, j);
+      }
+      else
+      {
+        const float e = error(&colors[ii], &colors[j]);
+
+        if(e < least[j] || (e == least[j] && ii < nearest[j]))
+        {
+          least[j] = e;
+          nearest[j] = ii;
+        }
+      }
     }
 
     // user cancelled operation
@@ -364,17 +947,256 @@ void Quantize::pca(Bitmap *src, Palette *pal, int size)
   }
 
   pal->max = index;
+  finishPalette(pal, size);
+}
+
+// Xiaolin Wu's variance-minimizing quantizer, described in
+// "Efficient Statistical Computations for Optimal Color Quantization"
+// (Graphics Gems II). The color cube is cut into boxes along the planes
+// that most reduce the variance, using cumulative moment tables.
+void Quantize::wu(Bitmap *src, Palette *pal, int size)
+{
+  std::vector<double> moments;
+  getMoments(src, &moments);
 
-  // stretch palette
-  if(pal->max != size)
+  // cumulative moments
+  std::vector<double> area(33 * MOMENTS);
+  double *m = &moments[0];
+
+  for(int r = 1; r <= 32; r++)
   {
-    stretchPalette(pal->data, pal->max, size);
-    pal->max = size;
+    std::fill(area.begin(), area.end(), 0.0);
+
+    for(int g = 1; g <= 32; g++)
+    {
+      double line[MOMENTS] = { 0, 0, 0, 0, 0 };
+
+      for(int b = 1; b <= 32; b++)
+      {
+        double *d = m + MOMENTS * momentIndex(r, g, b);
+        const double *below = m + MOMENTS * momentIndex(r - 1, g, b);
+
+        for(int k = 0; k < MOMENTS; k++)
+        {
+          line[k] += d[k];
+          area[MOMENTS * b + k] += line[k];
+          d[k] = below[k] + area[MOMENTS * b + k];
+        }
+      }
+    }
+  }
+
+  // keep splitting the box with the largest variance
+  std::vector<box_type> boxes(size);
+  std::vector<double> var(size, 0.0);
+
+  boxes[0].r0 = boxes[0].g0 = boxes[0].b0 = 0;
+  boxes[0].r1 = boxes[0].g1 = boxes[0].b1 = 32;
+  boxes[0].vol = 32 * 32 * 32;
+
+  int count = 1;
+  int next = 0;
+
+  while(count < size)
+  {
+    if(cutBox(&boxes[next], &boxes[count], m))
+    {
+      var[next] = boxes[next].vol > 1 ? variance(boxes[next], m) : 0;
+      var[count] = boxes[count].vol > 1 ? variance(boxes[count], m) : 0;
+      count++;
+    }
+    else
+    {
+      var[next] = 0;
+    }
+
+    next = 0;
+
+    for(int i = 1; i < count; i++)
+      if(var[i] > var[next])
+        next = i;
+
+    if(var[next] <= 0)
+      break;
+  }
+
+  // average color of each box
+  int index = 0;
+
+  for(int i = 0; i < count; i++)
+  {
+    const double weight = volume(boxes[i], m, WEIGHT);
+
+    if(weight > 0)
+    {
+      pal->data[index++] = makeRgb((int)(volume(boxes[i], m, SUM_R) / weight),
+                                   (int)(volume(boxes[i], m, SUM_G) / weight),
+                                   (int)(volume(boxes[i], m, SUM_B) / weight));
+    }
+  }
+
+  pal->max = index;
+  finishPalette(pal, size);
+}
+
+// Heckbert's median cut, over the occupied cells of a 32x32x32 histogram
+void Quantize::median(Bitmap *src, Palette *pal, int size)
+{
+  std::vector<double> moments;
+  std::vector<point_type> points;
+
+  getMoments(src, &moments);
+  getPoints(moments, &points);
+
+  std::vector<median_box_type> boxes;
+  median_box_type box;
+
+  box.first = 0;
+  box.last = points.size() - 1;
+  measureBox(&box, points);
+  boxes.push_back(box);
+
+  while((int)boxes.size() < size)
+  {
+    int next = 0;
+
+    for(int i = 1; i < (int)boxes.size(); i++)
+      if(boxes[i].score > boxes[next].score)
+        next = i;
+
+    if(boxes[next].score <= 0)
+      break;
+
+    median_box_type *split = &boxes[next];
+    sortByAxis sort_by_axis;
+    sort_by_axis.axis = split->axis;
+    std::sort(points.begin() + split->first, points.begin() + split->last + 1,
+              sort_by_axis);
+
+    // weighted median, leaving at least one cell on each side
+    double total = 0;
+
+    for(int i = split->first; i <= split->last; i++)
+      total += points[i].weight;
+
+    double sum = 0;
+    int cut = split->first;
+
+    for(; cut < split->last - 1; cut++)
+    {
+      sum += points[cut].weight;
+
+      if(sum >= total / 2)
+        break;
+    }
+
+    box.first = cut + 1;
+    box.last = split->last;
+    split->last = cut;
+    measureBox(split, points);
+    measureBox(&box, points);
+    boxes.push_back(box);
+  }
+
+  // average color of each box
+  int index = 0;
+
+  for(int i = 0; i < (int)boxes.size(); i++)
+  {
+    double r = 0, g = 0, b = 0, weight = 0;
+
+    for(int j = boxes[i].first; j <= boxes[i].last; j++)
+    {
+      r += points[j].c[0] * points[j].weight;
+      g += points[j].c[1] * points[j].weight;
+      b += points[j].c[2] * points[j].weight;
+      weight += points[j].weight;
+    }
+
+    if(weight > 0)
+      pal->data[index++] = makeRgb((int)(r / weight), (int)(g / weight),
+                                   (int)(b / weight));
   }
 
-  // redraw palette widget
-  Gui::drawPalette();
-  Project::palette->fillTable();
+  pal->max = index;
+  finishPalette(pal, size);
+}
+
+// moves each palette entry to the average of the colors nearest to it
+// (k-means), over the occupied cells of a 32x32x32 histogram
+void Quantize::refine(Bitmap *src, Palette *pal, int passes)
+{
+  std::vector<double> moments;
+  std::vector<point_type> points;
+
+  getMoments(src, &moments);
+  getPoints(moments, &points);
+
+  const int count = pal->max;
+  std::vector<float> cr(count), cg(count), cb(count);
+
+  for(int i = 0; i < count; i++)
+  {
+    cr[i] = getr(pal->data[i]);
+    cg[i] = getg(pal->data[i]);
+    cb[i] = getb(pal->data[i]);
+  }
+
+  std::vector<std::vector<double> > bands(Threads::count());
+
+  kmeans_type job;
+  job.points = &points[0];
+  job.cr = &cr[0];
+  job.cg = &cg[0];
+  job.cb = &cb[0];
+  job.count = count;
+  job.bands = &bands;
+
+  for(int pass = 0; pass < passes; pass++)
+  {
+    for(int i = 0; i < (int)bands.size(); i++)
+      bands[i].assign(count * 4, 0.0);
+
+    Threads::run(kmeansRows, 0, points.size() - 1, &job, 256);
+
+    bool moved = false;
+
+    for(int i = 0; i < count; i++)
+    {
+      double r = 0, g = 0, b = 0, weight = 0;
+
+      for(int j = 0; j < (int)bands.size(); j++)
+      {
+        r += bands[j][4 * i + 0];
+        g += bands[j][4 * i + 1];
+        b += bands[j][4 * i + 2];
+        weight += bands[j][4 * i + 3];
+      }
+
+      // entries nothing is nearest to stay where they are
+      if(weight > 0)
+      {
+        const float nr = r / weight;
+        const float ng = g / weight;
+        const float nb = b / weight;
+
+        if(nr != cr[i] || ng != cg[i] || nb != cb[i])
+          moved = true;
+
+        cr[i] = nr;
+        cg[i] = ng;
+        cb[i] = nb;
+      }
+    }
+
+    if(!moved)
+      break;
+  }
+
+  for(int i = 0; i < count; i++)
+    pal->data[i] = makeRgb((int)cr[i], (int)cg[i], (int)cb[i]);
+
+  finishPalette(pal, count);
 }
 
 // this only makes 256-color palettes
@@ -392,10 +1214,19 @@ void Quantize::fast(Bitmap *src, Palette *pal, int /* */)
   pal->max = 256;
   pal->sort();
 
-  for(int i = 0; i < pal->max - 1; i++)
+  // remove near-duplicates directly, deleteColor would also keep the
+  // lookup table up to date, which this palette never uses
+  std::vector<int> colors(pal->data, pal->data + pal->max);
+
+  for(int i = 0; i < (int)colors.size() - 1; i++)
   {
-    if(diff24(pal->data[i], pal->data[i + 1]) < 512)
-      pal->deleteColor(i);
+    if(diff24(colors[i], colors[i + 1]) < 512)
+      colors.erase(colors.begin() + i);
   }
+
+  for(int i = 0; i < (int)colors.size(); i++)
+    pal->data[i] = colors[i];
+
+  pal->max = colors.size();
 }
 
@@ -0,0 +1,169 @@
+/*
+Copyright (c) 2015 Joe Davisson.
+
+This file is part of Rendera.
+
+Rendera is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Rendera is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rendera; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "Bitmap.H"
+#include "Inline.H"
+#include "Raster.H"
+#include "Threads.H"
+
+namespace
+{
+  std::vector<float> init_table_linear()
+  {
+    std::vector<float> ret(65536);
+
+    for(int i = 0; i < 65536; i++)
+      ret[i] = std::pow((double)i / 65535, 2.2) * 65535;
+
+    return ret;
+  }
+
+  const std::vector<float> table_linear = init_table_linear();
+
+  // gamma-corrected levels are close to linear in the square root of
+  // linear light, so an entry for each 1/256 step of it (the first
+  // level at or above the step) leaves only a few levels to check
+  std::vector<unsigned short> init_table_gamma()
+  {
+    std::vector<unsigned short> ret(65536);
+    int level = 0;
+
+    for(int i = 0; i < 65536; i++)
+    {
+      const double bound = ((double)i / 256) * ((double)i / 256);
+
+      while(level < 65535 && table_linear[level] < bound)
+        level++;
+
+      ret[i] = level;
+    }
+
+    return ret;
+  }
+
+  const std::vector<unsigned short> table_gamma = init_table_gamma();
+
+  template <typename T>
+  struct convert_type
+  {
+    const Raster<T> *src;
+    Bitmap *dest;
+    int x, y;
+  };
+
+  // 16-bit levels are reduced the way libpng scales them
+  inline int reduce(const float &val)
+  {
+    return (gammaLevel(val) * 255 + 32895) >> 16;
+  }
+
+  template <typename T>
+  void convertRows(int y1, int y2, int, void *data)
+  {
+    const convert_type<T> *convert = (convert_type<T> *)data;
+    const Bitmap *dest = convert->dest;
+
+    for(int y = y1; y <= y2; y++)
+    {
+      const T *p = convert->src->row[y - dest->ct + convert->y]
+                     + (convert->x * 4);
+      int *d = dest->row[y] + dest->cl;
+
+      for(int x = dest->cl; x <= dest->cr; x++, p += 4)
+      {
+        const int a = clamp((int)(p[3] + 0.5f), 65535);
+
+        *d++ = makeRgba(reduce(p[0]), reduce(p[1]), reduce(p[2]),
+                        (a * 255 + 32895) >> 16);
+      }
+    }
+  }
+}
+
+template <typename T>
+Raster<T>::Raster(int width, int height)
+{
+  w = width;
+  h = height;
+
+  data = new T[w * h * 4];
+  row = new T *[h];
+
+  for(int i = 0; i < h; i++)
+    row[i] = &data[w * i * 4];
+}
+
+template <typename T>
+Raster<T>::~Raster()
+{
+  delete[] row;
+  delete[] data;
+}
+
+// converts the area starting at x, y into the clipped part of dest
+template <typename T>
+void Raster<T>::toBitmap(Bitmap *dest, int x, int y)
+{
+  convert_type<T> convert;
+
+  convert.src = this;
+  convert.dest = dest;
+  convert.x = x;
+  convert.y = y;
+
+  Threads::run(convertRows<T>, dest->ct, dest->cb, &convert);
+}
+
+template class Raster<float>;
+
+float linearLevel(const int val)
+{
+  return table_linear[val];
+}
+
+// inverts the linear table, every level in it comes back exactly and
+// other values go to the nearest one
+int gammaLevel(const float val)
+{
+  if(val <= 0)
+    return 0;
+
+  if(val >= 65535)
+    return 65535;
+
+  int i = table_gamma[std::min((int)(std::sqrt(val) * 256), 65535)];
+
+  // first level at or above val, the step may round either way
+  while(i > 0 && table_linear[i - 1] >= val)
+    i--;
+
+  while(table_linear[i] < val)
+    i++;
+
+  if(i > 0 && val - table_linear[i - 1] < table_linear[i] - val)
+    return i - 1;
+
+  return i;
+}
+
@@ -18,19 +18,24 @@ along with Rendera; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 */
 
+#include <algorithm>
 #include <cmath>
 #include <vector>
 
 #include "Bitmap.H"
+#include "Blend.H"
 #include "Brush.H"
+#include "Clone.H"
 #include "DitherMatrix.H"
 #include "Gui.H"
 #include "Inline.H"
 #include "Map.H"
 #include "ExtraMath.H"
+#include "Palette.H"
 #include "Project.H"
 #include "Render.H"
 #include "Stroke.H"
+#include "Threads.H"
 #include "Tool.H"
 #include "Undo.H"
 #include "View.H"
@@ -45,6 +50,43 @@ namespace
   int color;
   int trans;
 
+  // indexed mode, the palette entry painted and its color
+  Map *indices;
+  int index;
+  int index_color;
+
+  // marks pixels already composited while dragging
+  Map *live_map = 0;
+  bool live_active = false;
+
+  void setup()
+  {
+    view = Gui::getView();
+    bmp = Project::bmp;
+    map = Project::map;
+    brush = Project::brush.get();
+    stroke = Project::stroke.get();
+    color = brush->color;
+    trans = brush->trans;
+
+    indices = Project::indices;
+    index = Project::palette->lookup(color);
+
+    const rgba_type rgba = getRgba(Project::palette->data[index]);
+    index_color = makeRgb(rgba.r, rgba.g, rgba.b);
+  }
+
+  // indexed mode, sets a pixel to the palette entry nearest the brush
+  // color (blending and transparency don't apply to indices)
+  inline void setIndex(const int &x, const int &y)
+  {
+    if(x < bmp->cl || x > bmp->cr || y < bmp->ct || y > bmp->cb)
+      return;
+
+    indices->row[y][x] = index;
+    bmp->row[y][x] = index_color;
+  }
+
   // returns true if pixel is on a boundary
   bool isEdge(Map *map, const int &x, const int &y)
   {
@@ -213,6 +255,34 @@ namespace
     }
   }
 
+  // indexed rendering, every paint mode sets the pixels the stroke
+  // covers, solid mode keeps its dither pattern
+  void renderIndexed()
+  {
+    int z = Gui::getDitherPattern();
+    if(z < 0 || z > 7 || Gui::getPaintMode() != Render::SOLID)
+      z = 0;
+
+    const int relative = Gui::getDitherRelative();
+
+    for(int y = stroke->y1; y <= stroke->y2; y++)
+    {
+      unsigned char *p = map->row[y] + stroke->x1;
+      const int yy = relative ? y - stroke->y1 : y;
+
+      for(int x = stroke->x1; x <= stroke->x2; x++, p++)
+      {
+        const int xx = relative ? x - stroke->x1 : x;
+
+        if(*p >= 128 && DitherMatrix::pattern[z][yy & 3][xx & 3] == 1)
+          setIndex(x, y);
+      }
+
+      if(update(y) < 0)
+        break;
+    }
+  }
+
   // antialiased rendering
   void renderAntialiased()
   {
@@ -455,6 +525,7 @@ namespace
     float soft_step = (float)(255 - trans) / ((j >> 1) + 1);
     bool found = false;
     int inc = 0;
+    const int seed = ExtraMath::rnd();
 
     for(int y = stroke->y1; y <= stroke->y2; y++)
     {
@@ -473,7 +544,7 @@ namespace
       {
         for(int x = stroke->x1 + (inc & 1); x < stroke->x2 - 1; x += 2)
         {
-          int yy = y + !(ExtraMath::rnd() & 3);
+          int yy = y + !(ExtraMath::rnd(seed, x, y, i * 2) & 3);
 
           unsigned char *s0 = map->row[yy] + x;
           unsigned char *s1 = map->row[yy] + x + 1;
@@ -495,7 +566,7 @@ namespace
 
           growBlock(s0, s1, s2, s3);
 
-          if(*s0 & !(ExtraMath::rnd() & 15))
+          if(*s0 & !(ExtraMath::rnd(seed, x, yy, i * 2 + 1) & 15))
           {
             *s0 = 1;
             *s1 = 1;
@@ -535,6 +606,7 @@ namespace
     const int j = (3 << brush->edge);
     float soft_step = (float)(255 - trans) / ((j >> 1) + 1);
     bool found = false;
+    const int seed = ExtraMath::rnd();
 
     for(int i = 0; i < j; i++)
     {
@@ -566,7 +638,8 @@ namespace
 
           if(!*s0 && d0)
           {
-            t = (int)soft_trans + (ExtraMath::rnd() & 63) - 32;
+            t = (int)soft_trans
+                  + (ExtraMath::rnd(seed, x, y, i) & 63) - 32;
             if(t < 0)
               t = 0;
             if(t > 255)
@@ -576,7 +649,8 @@ namespace
 
           if(!*s1 && d1)
           {
-            t = (int)soft_trans + (ExtraMath::rnd() & 63) - 32;
+            t = (int)soft_trans
+                  + (ExtraMath::rnd(seed, x + 1, y, i) & 63) - 32;
             if(t < 0)
               t = 0;
             if(t > 255)
@@ -586,7 +660,8 @@ namespace
 
           if(!*s2 && d2)
           {
-            t = (int)soft_trans + (ExtraMath::rnd() & 63) - 32;
+            t = (int)soft_trans
+                  + (ExtraMath::rnd(seed, x, y + 1, i) & 63) - 32;
             if(t < 0)
               t = 0;
             if(t > 255)
@@ -596,7 +671,8 @@ namespace
 
           if(!*s3 && d3)
           {
-            t = (int)soft_trans + (ExtraMath::rnd() & 63) - 32;
+            t = (int)soft_trans
+                  + (ExtraMath::rnd(seed, x + 1, y + 1, i) & 63) - 32;
             if(t < 0)
               t = 0;
             if(t > 255)
@@ -620,7 +696,8 @@ namespace
           {
             if(map->getpixel(x, y))
             {
-              int t = (int)soft_trans + (ExtraMath::rnd() & 63) - 32;
+              int t = (int)soft_trans
+                        + (ExtraMath::rnd(seed, x, y, j) & 63) - 32;
               if(t < 0)
                 t = 0;
               if(t > 255)
@@ -638,39 +715,81 @@ namespace
     }
   }
 
-  // averaging rendering
-  void renderAverage()
+  // per-band color sums for the averaging mode
+  struct average_type
   {
-    int r = 0;
-    int g = 0;
-    int b = 0;
-    int count = 0;
+    int64_t r, g, b;
+    int64_t count;
+  };
 
-    for(int y = stroke->y1; y <= stroke->y2; y++)
+  void sumAverage(int y1, int y2, int index, void *data)
+  {
+    average_type *sum = (average_type *)data + index;
+    int64_t r = 0, g = 0, b = 0, count = 0;
+
+    for(int y = y1; y <= y2; y++)
     {
-      unsigned char *p = map->row[y] + stroke->x1;
+      const unsigned char *p = map->row[y] + stroke->x1;
+      const int *c = bmp->row[y] + stroke->x1;
+      const int w = stroke->x2 - stroke->x1 + 1;
+      int rr = 0, gg = 0, bb = 0, n = 0;
 
-      for(int x = stroke->x1; x <= stroke->x2; x++)
+      // branchless so the compiler can vectorize it
+      for(int x = 0; x < w; x++)
       {
-        if(*p++)
-        {
-          const int c = bmp->getpixel(x, y);
-          rgba_type rgba = getRgba(c);
-          r += rgba.r;
-          g += rgba.g;
-          b += rgba.b;
-          count++; 
-        }
+        const int m = -(p[x] != 0);
+        const rgba_type rgba = getRgba(c[x]);
+
+        rr += rgba.r & m;
+        gg += rgba.g & m;
+        bb += rgba.b & m;
+        n -= m;
       }
+
+      r += rr;
+      g += gg;
+      b += bb;
+      count += n;
+    }
+
+    sum->r = r;
+    sum->g = g;
+    sum->b = b;
+    sum->count = count;
+  }
+
+  // averaging rendering
+  void renderAverage()
+  {
+    std::vector<average_type> sums(Threads::count());
+
+    for(int i = 0; i < (int)sums.size(); i++)
+    {
+      sums[i].r = 0;
+      sums[i].g = 0;
+      sums[i].b = 0;
+      sums[i].count = 0;
+    }
+
+    Threads::run(sumAverage, stroke->y1, stroke->y2, &sums[0]);
+
+    int64_t r = 0;
+    int64_t g = 0;
+    int64_t b = 0;
+    int64_t count = 0;
+
+    for(int i = 0; i < (int)sums.size(); i++)
+    {
+      r += sums[i].r;
+      g += sums[i].g;
+      b += sums[i].b;
+      count += sums[i].count;
     }
 
     if(count == 0)
       return;
 
-    r /= count;
-    g /= count;
-    b /= count;
-    const int c = makeRgb(r, g, b);
+    const int c = makeRgb(r / count, g / count, b / count);
 
     for(int y = stroke->y1; y <= stroke->y2; y++)
     {
@@ -690,16 +809,137 @@ namespace
   }
 }
 
+// true if the current stroke can be painted while the mouse is dragged
+// (each pixel must be rendered once, independently of its neighbors)
+bool Render::isLive()
+{
+  Brush *brush = Project::brush.get();
+  Stroke *stroke = Project::stroke.get();
+
+  // antialiased strokes are redrawn on release and the clone source
+  // is captured on release
+  if(stroke->type != Stroke::FREEHAND || brush->aa || Clone::active)
+    return false;
+
+  // these blending modes sample neighboring pixels
+  switch(brush->blend)
+  {
+    case Blend::SMOOTH:
+    case Blend::SMOOTH_COLOR:
+    case Blend::SMOOTH_LUMINOSITY:
+    case Blend::SHARPEN:
+      return false;
+  }
+
+  switch(Gui::getPaintMode())
+  {
+    case SOLID:
+      // relative patterns move as the stroke grows
+      return !Gui::getDitherRelative();
+    case ANTIALIASED:
+      return true;
+  }
+
+  return false;
+}
+
+// composites newly covered map pixels inside the given rectangle
+void Render::live(int x1, int y1, int x2, int y2)
+{
+  setup();
+
+  if(!live_active)
+  {
+    if(!live_map || live_map->w != map->w || live_map->h != map->h)
+    {
+      delete live_map;
+      live_map = new Map(map->w, map->h);
+    }
+
+    live_map->clear(0);
+    Undo::push();
+    live_active = true;
+
+    // the indices are written along with the pixels
+    Project::indices_stale = false;
+  }
+
+  if(x1 > x2)
+    std::swap(x1, x2);
+  if(y1 > y2)
+    std::swap(y1, y2);
+
+  if(x1 < 0)
+    x1 = 0;
+  if(y1 < 0)
+    y1 = 0;
+  if(x2 > map->w - 1)
+    x2 = map->w - 1;
+  if(y2 > map->h - 1)
+    y2 = map->h - 1;
+
+  const bool solid = (Gui::getPaintMode() == SOLID);
+  int z = Gui::getDitherPattern();
+  if(z < 0 || z > 7)
+    z = 0;
+
+  for(int y = y1; y <= y2; y++)
+  {
+    unsigned char *p = map->row[y] + x1;
+    unsigned char *d = live_map->row[y] + x1;
+
+    for(int x = x1; x <= x2; x++, p++, d++)
+    {
+      if(*p == 0 || *d)
+        continue;
+
+      *d = 1;
+
+      if(indices)
+      {
+        if(*p >= 128 && (!solid || DitherMatrix::pattern[z][y & 3][x & 3]))
+          setIndex(x, y);
+      }
+      else if(solid)
+      {
+        if(DitherMatrix::pattern[z][y & 3][x & 3] == 1)
+          bmp->setpixel(x, y, color, trans);
+      }
+      else
+      {
+        bmp->setpixel(x, y, color, scaleVal((255 - *p), trans));
+      }
+    }
+  }
+}
+
+// abandons a stroke painted while dragging and restores the image
+void Render::cancelLive()
+{
+  if(!live_active)
+    return;
+
+  Undo::cancel();
+  live_active = false;
+}
+
 // start the rendering process
 void Render::begin()
 {
-  view = Gui::getView();
-  bmp = Project::bmp;
-  map = Project::map;
-  brush = Project::brush.get();
-  stroke = Project::stroke.get();
-  color = brush->color;
-  trans = brush->trans;
+  setup();
+
+  // the paint mode changed during the drag, so render the usual way
+  if(live_active && !isLive())
+    cancelLive();
+
+  // stroke was already painted while dragging, just finish it
+  if(live_active)
+  {
+    live(stroke->x1, stroke->y1, stroke->x2, stroke->y2);
+    live_active = false;
+    view->drawMain(true);
+    return;
+  }
 
   int size = 1;
 
@@ -728,6 +968,16 @@ void Render::begin()
 
   view->rendering = true;
 
+  if(indices)
+  {
+    // the indices are written along with the pixels
+    Project::indices_stale = false;
+    renderIndexed();
+    view->drawMain(true);
+    view->rendering = false;
+    return;
+  }
+
   switch(Gui::getPaintMode())
   {
     case SOLID:
@@ -0,0 +1,264 @@
+/*
+Copyright (c) 2015 Joe Davisson.
+
+This file is part of Rendera.
+
+Rendera is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Rendera is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rendera; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+*/
+
+#include <vector>
+
+#include "Bitmap.H"
+#include "Blend.H"
+#include "Inline.H"
+#include "Stats.H"
+#include "Threads.H"
+
+// the statistics are kept until the image changes, Undo::push and the
+// functions that replace the image invalidate them, filters that only
+// remap each channel through a table can update the histograms instead
+// of having them rescanned
+namespace
+{
+  Stats::stats_type stats;
+  int have = 0;
+  bool held = false;
+
+  Bitmap *owner = 0;
+  int owner_w, owner_h;
+  int owner_cl, owner_ct, owner_cr, owner_cb;
+
+  struct band_type
+  {
+    int hist[3][256];
+    int lum[256];
+    int sat[256];
+  };
+
+  struct scan_type
+  {
+    Bitmap *bmp;
+    int what;
+    std::vector<band_type> *bands;
+  };
+
+  void scanRows(int y1, int y2, int index, void *data)
+  {
+    const scan_type *scan = (scan_type *)data;
+    const Bitmap *bmp = scan->bmp;
+    band_type *band = &(*scan->bands)[index];
+
+    for(int y = y1; y <= y2; y++)
+    {
+      const int *p = bmp->row[y] + bmp->cl;
+
+      for(int x = bmp->cl; x <= bmp->cr; x++, p++)
+      {
+        const rgba_type rgba = getRgba(*p);
+
+        if(scan->what & Stats::RGB)
+        {
+          band->hist[0][rgba.r]++;
+          band->hist[1][rgba.g]++;
+          band->hist[2][rgba.b]++;
+        }
+
+        if(scan->what & Stats::LUM)
+          band->lum[getl(*p)]++;
+
+        if(scan->what & Stats::SAT)
+        {
+          int h, s, v;
+
+          Blend::rgbToHsv(rgba.r, rgba.g, rgba.b, &h, &s, &v);
+          band->sat[s]++;
+        }
+      }
+    }
+  }
+
+  // min, max and mean follow from the histograms
+  void summarize(Stats::stats_type *stats)
+  {
+    for(int i = 0; i < 3; i++)
+    {
+      const int *hist = stats->hist[i];
+      double sum = 0;
+
+      stats->min[i] = 255;
+      stats->max[i] = 0;
+
+      for(int j = 0; j < 256; j++)
+      {
+        if(hist[j] == 0)
+          continue;
+
+        if(j < stats->min[i])
+          stats->min[i] = j;
+        if(j > stats->max[i])
+          stats->max[i] = j;
+
+        sum += (double)j * hist[j];
+      }
+
+      stats->mean[i] = stats->count > 0 ? sum / stats->count : 0;
+    }
+  }
+
+  bool isOwner(const Bitmap *bmp)
+  {
+    return bmp == owner && bmp->w == owner_w && bmp->h == owner_h
+           && bmp->cl == owner_cl && bmp->ct == owner_ct
+           && bmp->cr == owner_cr && bmp->cb == owner_cb;
+  }
+}
+
+// returns statistics for the clipped area, what is a combination of
+// RGB, LUM and SAT, only the parts that aren't cached are scanned
+// (in one pass over the image)
+const Stats::stats_type *Stats::get(Bitmap *bmp, int what)
+{
+  if(!isOwner(bmp))
+  {
+    have = 0;
+    owner = bmp;
+    owner_w = bmp->w;
+    owner_h = bmp->h;
+    owner_cl = bmp->cl;
+    owner_ct = bmp->ct;
+    owner_cr = bmp->cr;
+    owner_cb = bmp->cb;
+  }
+
+  const int need = what & ~have;
+
+  if(need == 0)
+    return &stats;
+
+  std::vector<band_type> bands(Threads::count());
+
+  for(int i = 0; i < (int)bands.size(); i++)
+  {
+    for(int j = 0; j < 256; j++)
+    {
+      bands[i].hist[0][j] = 0;
+      bands[i].hist[1][j] = 0;
+      bands[i].hist[2][j] = 0;
+      bands[i].lum[j] = 0;
+      bands[i].sat[j] = 0;
+    }
+  }
+
+  scan_type scan;
+  scan.bmp = bmp;
+  scan.what = need;
+  scan.bands = &bands;
+
+  Threads::run(scanRows, bmp->ct, bmp->cb, &scan);
+
+  stats.count = bmp->cw * bmp->ch;
+
+  for(int j = 0; j < 256; j++)
+  {
+    if(need & RGB)
+    {
+      stats.hist[0][j] = 0;
+      stats.hist[1][j] = 0;
+      stats.hist[2][j] = 0;
+    }
+
+    if(need & LUM)
+      stats.lum[j] = 0;
+
+    if(need & SAT)
+      stats.sat[j] = 0;
+
+    for(int i = 0; i < (int)bands.size(); i++)
+    {
+      if(need & RGB)
+      {
+        stats.hist[0][j] += bands[i].hist[0][j];
+        stats.hist[1][j] += bands[i].hist[1][j];
+        stats.hist[2][j] += bands[i].hist[2][j];
+      }
+
+      if(need & LUM)
+        stats.lum[j] += bands[i].lum[j];
+
+      if(need & SAT)
+        stats.sat[j] += bands[i].sat[j];
+    }
+  }
+
+  if(need & RGB)
+    summarize(&stats);
+
+  have |= need;
+
+  return &stats;
+}
+
+// updates channel histograms for every pixel going through these
+// tables, the luminance and saturation histograms can't be derived
+// this way and are stale afterwards
+void Stats::remap(stats_type *stats,
+                  const int *lut_r, const int *lut_g, const int *lut_b)
+{
+  const int *lut[3] = { lut_r, lut_g, lut_b };
+
+  for(int i = 0; i < 3; i++)
+  {
+    int hist[256];
+
+    for(int j = 0; j < 256; j++)
+      hist[j] = 0;
+
+    for(int j = 0; j < 256; j++)
+      if(stats->hist[i][j] > 0)
+        hist[clamp(lut[i][j], 255)] += stats->hist[i][j];
+
+    for(int j = 0; j < 256; j++)
+      stats->hist[i][j] = hist[j];
+  }
+
+  summarize(stats);
+}
+
+// same for the cached statistics, after the image itself was changed
+void Stats::remap(const int *lut_r, const int *lut_g, const int *lut_b)
+{
+  if(!(have & RGB))
+  {
+    have = 0;
+    return;
+  }
+
+  remap(&stats, lut_r, lut_g, lut_b);
+  have = RGB;
+}
+
+void Stats::invalidate()
+{
+  if(!held)
+    have = 0;
+}
+
+// while held, invalidate() is ignored, for callers that update the
+// statistics themselves
+void Stats::hold(bool state)
+{
+  held = state;
+}
+
@@ -0,0 +1,193 @@
+/*
+Copyright (c) 2015 Joe Davisson.
+
+This file is part of Rendera.
+
+Rendera is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Rendera is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Rendera; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+*/
+
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Threads.H"
+
+namespace
+{
+  struct job_type
+  {
+    void (*func)(int, int, int, void *);
+    int first, last;
+    int index;
+    void *data;
+  };
+
+  const int max_threads = 64;
+
+  // persistent worker pool, started on first use
+  // (all of this is constant-initialized, so it may be used at any time,
+  // even from other files' static constructors)
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+  pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+  job_type jobs[max_threads];
+  int workers = -1;
+  int generation = 0;
+  int bands = 0;
+  int pending = 0;
+  bool busy = false;
+
+  void *worker(void *arg)
+  {
+    const int index = (int)(long)arg;
+    int seen = 0;
+
+    pthread_mutex_lock(&lock);
+
+    while(true)
+    {
+      while(generation == seen)
+        pthread_cond_wait(&wake, &lock);
+
+      seen = generation;
+
+      // the calling thread always takes the last band
+      if(index < bands - 1)
+      {
+        const job_type job = jobs[index];
+
+        pthread_mutex_unlock(&lock);
+        job.func(job.first, job.last, job.index, job.data);
+        pthread_mutex_lock(&lock);
+
+        pending--;
+
+        if(pending == 0)
+          pthread_cond_signal(&done);
+      }
+    }
+
+    return 0;
+  }
+
+  void startWorkers()
+  {
+    workers = 0;
+
+    for(int i = 0; i < Threads::count() - 1; i++)
+    {
+      pthread_t thread;
+
+      if(pthread_create(&thread, 0, worker, (void *)(long)i) != 0)
+        break;
+
+      pthread_detach(thread);
+      workers++;
+    }
+  }
+}
+
+// number of threads used to run jobs (one per processor)
+int Threads::count()
+{
+  static int cpus = 0;
+
+  if(cpus == 0)
+  {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    cpus = info.dwNumberOfProcessors;
+#else
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    if(cpus < 1)
+      cpus = 1;
+    if(cpus > max_threads)
+      cpus = max_threads;
+  }
+
+  return cpus;
+}
+
+// splits the range first..last (inclusive) into bands of at least
+// "grain" items and calls func(band_first, band_last, band_index, data)
+// for each band on its own thread, band_index is always less than count()
+// the calling thread handles the last band and waits for the others
+// (nested calls from inside a band just run in the calling thread)
+void Threads::run(void (*func)(int, int, int, void *),
+                  int first, int last, void *data, int grain)
+{
+  const int size = last - first + 1;
+
+  if(size < 1)
+    return;
+
+  if(grain < 1)
+    grain = 1;
+
+  pthread_mutex_lock(&lock);
+
+  if(workers < 0)
+    startWorkers();
+
+  int count = workers + 1;
+
+  if(count > size / grain)
+    count = size / grain;
+  if(count < 1 || busy)
+    count = 1;
+
+  if(count == 1)
+  {
+    pthread_mutex_unlock(&lock);
+    func(first, last, 0, data);
+    return;
+  }
+
+  for(int i = 0; i < count; i++)
+  {
+    jobs[i].func = func;
+    jobs[i].first = first + (int)((long long)size * i / count);
+    jobs[i].last = first + (int)((long long)size * (i + 1) / count) - 1;
+    jobs[i].index = i;
+    jobs[i].data = data;
+  }
+
+  const job_type job = jobs[count - 1];
+
+  busy = true;
+  bands = count;
+  pending = count - 1;
+  generation++;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+
+  job.func(job.first, job.last, job.index, job.data);
+
+  pthread_mutex_lock(&lock);
+
+  while(pending > 0)
+    pthread_cond_wait(&done, &lock);
+
+  busy = false;
+  pthread_mutex_unlock(&lock);
+}
+
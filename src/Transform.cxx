@@ -21,6 +21,8 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 #include <algorithm>
 #include <cmath>
 
+#include <FL/Fl_Choice.H>
+
 #include "Bitmap.H"
 #include "CheckBox.H"
 #include "Dialog.H"
@@ -33,6 +35,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 #include "Map.H"
 #include "Project.H"
 #include "Separator.H"
+#include "Threads.H"
 #include "Transform.H"
 #include "Undo.H"
 #include "View.H"
@@ -179,116 +182,32 @@ namespace Scale
     DialogWindow *dialog;
     InputInt *width;
     InputInt *height;
+    Fl_Choice *filter;
     CheckBox *keep_aspect;
     CheckBox *wrap;
     Fl_Button *ok;
     Fl_Button *cancel;
   }
 
-  void apply(int dw, int dh, bool wrap_edges)
+  void apply(int dw, int dh, int filter, bool wrap_edges)
   {
     Bitmap *bmp = Project::bmp;
     int overscroll = bmp->overscroll;
-    const int sx = overscroll;
-    const int sy = overscroll;
-    const int sw = bmp->cw;
-    const int sh = bmp->ch;
-    const int dx = overscroll;
-    const int dy = overscroll;
-
-    const float ax = ((float)sw / dw);
-    const float ay = ((float)sh / dh);
 
-    if(sw < 1 || sh < 1)
+    if(bmp->cw < 1 || bmp->ch < 1)
       return;
 
     if(dw < 1 || dh < 1)
       return;
 
     Bitmap *temp = new Bitmap(dw, dh, overscroll);
-  
-    Gui::showProgress(dh);
-
-    for(int y = 0; y < dh; y++) 
-    {
-      int *d = temp->row[dy + y] + dx;
-      const float vv = (y * ay);
-      const int v1 = vv;
-      const float v = vv - v1;
-
-      if(sy + v1 >= bmp->h - 1)
-        break;
-
-      int v2 = v1 + 1;
-
-      if(v2 >= sh)
-      {
-        if(wrap_edges)
-          v2 -= sh;
-        else
-          v2--;
-      }
-
-      int *c[4];
-      c[0] = c[1] = bmp->row[sy + v1] + sx;
-      c[2] = c[3] = bmp->row[sy + v2] + sx;
-
-      for(int x = 0; x < dw; x++) 
-      {
-        const float uu = (x * ax);
-        const int u1 = uu;
-        const float u = uu - u1;
 
-        if(sx + u1 >= bmp->w - 1)
-          break;
-
-        int u2 = u1 + 1;
-
-        if(u2 >= sw)
-        {
-          if(wrap_edges)
-            u2 -= sw;
-          else
-            u2--;
-        }
-
-        c[0] += u1;
-        c[1] += u2;
-        c[2] += u1;
-        c[3] += u2;
-
-        float f[4];
-
-        f[0] = (1.0f - u) * (1.0f - v);
-        f[1] = u * (1.0f - v);
-        f[2] = (1.0f - u) * v;
-        f[3] = u * v;
-
-        float r = 0.0f, g = 0.0f, b = 0.0f, a = 0.0f;
-
-        for(int i = 0; i < 4; i++)
-        {
-          rgba_type rgba = getRgba(*c[i]);
-          r += (float)Gamma::fix(rgba.r) * f[i];
-          g += (float)Gamma::fix(rgba.g) * f[i];
-          b += (float)Gamma::fix(rgba.b) * f[i];
-          a += rgba.a * f[i];
-        }
-
-        r = Gamma::unfix((int)r);
-        g = Gamma::unfix((int)g);
-        b = Gamma::unfix((int)b);
-
-        *d++ = makeRgba((int)r, (int)g, (int)b, (int)a);
-
-        c[0] -= u1;
-        c[1] -= u2;
-        c[2] -= u1;
-        c[3] -= u2;
-      }
+    Gui::showProgress(bmp->ch + dh);
 
-      if(Gui::updateProgress(y) < 0)
-        break;
+    if(!bmp->scale(temp, filter, wrap_edges, Gui::updateProgress))
+    {
+      delete temp;
+      return;
     }
 
     Gui::hideProgress();
@@ -358,6 +277,7 @@ namespace Scale
     pushUndo();
     apply(atoi(Items::width->value()),
           atoi(Items::height->value()),
+          Items::filter->value(),
           Items::wrap->value());
   }
 
@@ -383,6 +303,16 @@ namespace Scale
     Items::height->maximum_size(8);
     Items::width->value("640");
     Items::height->value("480");
+    Items::filter = new Fl_Choice(96, y1, 128, 24, "Filter:");
+    Items::filter->tooltip("Filter");
+    Items::filter->textsize(10);
+    Items::filter->add("Box");
+    Items::filter->add("Bilinear");
+    Items::filter->add("Bicubic");
+    Items::filter->add("Mitchell");
+    Items::filter->add("Lanczos");
+    Items::filter->value(Bitmap::SCALE_BILINEAR);
+    y1 += 24 + 8;
     Items::keep_aspect = new CheckBox(Items::dialog, 0, y1, 16, 16, "Keep Aspect", 0);
     Items::keep_aspect->callback((Fl_Callback *)checkKeepAspect);
     y1 += 16 + 8;
@@ -406,141 +336,312 @@ namespace RotateArbitrary
     DialogWindow *dialog;
     InputFloat *angle;
     InputFloat *scale;
+    Fl_Choice *filter;
     CheckBox *tile;
     Fl_Button *ok;
     Fl_Button *cancel;
   }
 
-  void apply(float angle, float scale, int overscroll, bool tile)
+  enum
   {
-    Bitmap *bmp = Project::bmp;
+    NEAREST,
+    BILINEAR,
+    BICUBIC
+  };
+
+  // destination rows per band, columns per tile
+  const int band_size = 32;
+  const int tile_size = 64;
+
+  // every destination pixel is mapped back to the source, positions are
+  // 16.16 fixed point in source clip coordinates (pixel centers at whole
+  // numbers) and step by du/dv per column and row
+  struct rotate_type
+  {
+    Bitmap *src;
+    Bitmap *dest;
+    double u0, v0;
+    int du_col, dv_col;
+    int du_row, dv_row;
+    int filter;
+    bool tile;
+  };
+
+  inline int wrap(int i, const int &size)
+  {
+    i %= size;
 
-    // angle correction
-    angle += 90;
-
-    // rotation
-    int du_col = (int)((std::sin(angle * (3.14159f / 180)) * scale) * 65536);
-    int dv_col = (int)((std::sin((angle + 90) * (3.14159f / 180)) * scale) * 65536);
-    int du_row = -dv_col;
-    int dv_row = du_col;
-
-    const int ww = (bmp->cr - bmp->cl) / 2;
-    const int hh = (bmp->cb - bmp->ct) / 2;
-
-    const int xx = bmp->cl;
-    const int yy = bmp->ct;
-
-    // origin
-    const int ox = xx + ww;
-    const int oy = yy + hh;
-	
-    // project new corners
-    int x0 = xx - ox;
-    int y0 = yy - oy;
-    int x1 = xx + (ww * 2) - ox;
-    int y1 = yy - oy;
-    int x2 = xx - ox;
-    int y2 = yy + (hh * 2) - oy;
-    int x3 = xx + (ww * 2) - ox;
-    int y3 = yy + (hh * 2) - oy;
-
-    const int oldx0 = x0;
-    const int oldy0 = y0;
-    const int oldx1 = x1;
-    const int oldy1 = y1;
-    const int oldx2 = x2;
-    const int oldy2 = y2;
-    const int oldx3 = x3;
-    const int oldy3 = y3;
-
-    // rotate
-    x0 = xx + ((oldx0 * du_col + oldy0 * du_row) >> 16);
-    y0 = yy + ((oldx0 * dv_col + oldy0 * dv_row) >> 16);
-    x1 = xx + ((oldx1 * du_col + oldy1 * du_row) >> 16);
-    y1 = yy + ((oldx1 * dv_col + oldy1 * dv_row) >> 16);
-    x2 = xx + ((oldx2 * du_col + oldy2 * du_row) >> 16);
-    y2 = yy + ((oldx2 * dv_col + oldy2 * dv_row) >> 16);
-    x3 = xx + ((oldx3 * du_col + oldy3 * du_row) >> 16);
-    y3 = yy + ((oldx3 * dv_col + oldy3 * dv_row) >> 16);
-
-    // find new bounding box
-    const int bx1 = std::min(x0, std::min(x1, std::min(x2, x3))) - scale * 2;
-    const int by1 = std::min(y0, std::min(y1, std::min(y2, y3))) - scale * 2;
-    const int bx2 = std::max(x0, std::max(x1, std::max(x2, x3))) + scale * 2;
-    const int by2 = std::max(y0, std::max(y1, std::max(y2, y3))) + scale * 2;
-    int bw = (bx2 - bx1) + 1;
-    int bh = (by2 - by1) + 1;
+    return i < 0 ? i + size : i;
+  }
 
-    // create image with new size
-    Bitmap *temp = new Bitmap(bw, bh, overscroll);
-    temp->rectfill(temp->cl, temp->ct, temp->cr, temp->cb,
-                   makeRgba(0, 0, 0, 0), 0);
+  inline int edge(const int &i, const int &size, const bool &tile)
+  {
+    if(tile)
+      return wrap(i, size);
+    else
+      return std::min(std::max(i, 0), size - 1);
+  }
 
-    bw /= 2;
-    bh /= 2;
+  inline const int *srcPixel(const rotate_type *job, const int &x, const int &y)
+  {
+    const Bitmap *src = job->src;
 
-    // rotation
-    du_col = (int)((std::sin(angle * (3.14159f / 180)) / scale) * 65536);
-    dv_col = (int)((std::sin((angle + 90) * (3.14159f / 180)) / scale) * 65536);
-    du_row = -dv_col;
-    dv_row = du_col;
+    return src->row[src->ct + y] + src->cl + x;
+  }
 
-    int row_u = (bmp->w / 2) << 16;
-    int row_v = (bmp->h / 2) << 16;
+  int sampleNearest(const rotate_type *job, const int &u, const int &v)
+  {
+    const int x = edge((u + 32768) >> 16, job->src->cw, job->tile);
+    const int y = edge((v + 32768) >> 16, job->src->ch, job->tile);
+
+    return *srcPixel(job, x, y);
+  }
+
+  inline int lerp(const int &a, const int &b, const int &f)
+  {
+    return (a * (256 - f) + b * f) >> 8;
+  }
+
+  int sampleBilinear(const rotate_type *job, const int &u, const int &v)
+  {
+    const int sw = job->src->cw;
+    const int sh = job->src->ch;
+    const int fx = (u >> 8) & 255;
+    const int fy = (v >> 8) & 255;
+    const int x1 = edge(u >> 16, sw, job->tile);
+    const int y1 = edge(v >> 16, sh, job->tile);
+    const int x2 = edge((u >> 16) + 1, sw, job->tile);
+    const int y2 = edge((v >> 16) + 1, sh, job->tile);
+
+    const rgba_type c1 = getRgba(*srcPixel(job, x1, y1));
+    const rgba_type c2 = getRgba(*srcPixel(job, x2, y1));
+    const rgba_type c3 = getRgba(*srcPixel(job, x1, y2));
+    const rgba_type c4 = getRgba(*srcPixel(job, x2, y2));
+
+    const int r = lerp(lerp(Gamma::fix(c1.r), Gamma::fix(c2.r), fx),
+                       lerp(Gamma::fix(c3.r), Gamma::fix(c4.r), fx), fy);
+    const int g = lerp(lerp(Gamma::fix(c1.g), Gamma::fix(c2.g), fx),
+                       lerp(Gamma::fix(c3.g), Gamma::fix(c4.g), fx), fy);
+    const int b = lerp(lerp(Gamma::fix(c1.b), Gamma::fix(c2.b), fx),
+                       lerp(Gamma::fix(c3.b), Gamma::fix(c4.b), fx), fy);
+    const int a = lerp(lerp(c1.a << 8, c2.a << 8, fx),
+                       lerp(c3.a << 8, c4.a << 8, fx), fy);
+
+    return makeRgba(Gamma::unfix(r), Gamma::unfix(g), Gamma::unfix(b),
+                    (a + 128) >> 8);
+  }
+
+  // Catmull-Rom weights
+  void cubicWeights(const float &t, float *w)
+  {
+    const float t2 = t * t;
+    const float t3 = t2 * t;
 
-    row_u -= bw * du_col + bh * du_row;
-    row_v -= bw * dv_col + bh * dv_row;
+    w[0] = (-t3 + 2 * t2 - t) / 2;
+    w[1] = (3 * t3 - 5 * t2 + 2) / 2;
+    w[2] = (-3 * t3 + 4 * t2 + t) / 2;
+    w[3] = (t3 - t2) / 2;
+  }
+
+  int sampleBicubic(const rotate_type *job, const int &u, const int &v)
+  {
+    const int sw = job->src->cw;
+    const int sh = job->src->ch;
+    float wx[4], wy[4];
+    int xs[4];
 
-    Gui::showProgress(by2 - by1);
+    cubicWeights((u & 65535) / 65536.0f, wx);
+    cubicWeights((v & 65535) / 65536.0f, wy);
 
-    // draw image
-    for(int y = by1; y <= by2; y++)
+    for(int i = 0; i < 4; i++)
+      xs[i] = edge((u >> 16) + i - 1, sw, job->tile);
+
+    float r = 0, g = 0, b = 0, a = 0;
+
+    for(int j = 0; j < 4; j++)
     {
-      int u = row_u;
-      int v = row_v;
+      const int y = edge((v >> 16) + j - 1, sh, job->tile);
+      const int *row = srcPixel(job, 0, y);
+
+      for(int i = 0; i < 4; i++)
+      {
+        const rgba_type rgba = getRgba(row[xs[i]]);
+        const float w = wx[i] * wy[j];
+
+        r += Gamma::fix(rgba.r) * w;
+        g += Gamma::fix(rgba.g) * w;
+        b += Gamma::fix(rgba.b) * w;
+        a += rgba.a * w;
+      }
+    }
+
+    return makeRgba(Gamma::unfix(clamp((int)(r + 0.5f), 65535)),
+                    Gamma::unfix(clamp((int)(g + 0.5f), 65535)),
+                    Gamma::unfix(clamp((int)(b + 0.5f), 65535)),
+                    clamp((int)(a + 0.5f), 255));
+  }
+
+  // narrows x1..x2 to the columns where p0 + x * dp stays in lo..hi-1,
+  // the solution is estimated first, then checked in fixed point
+  void clipSpan(long long p0, long long dp, long long lo, long long hi,
+                int *x1, int *x2)
+  {
+    if(dp == 0)
+    {
+      if(p0 < lo || p0 >= hi)
+        *x2 = *x1 - 1;
+
+      return;
+    }
 
-      row_u += du_row;
-      row_v += dv_row;
+    double a = (double)(lo - p0) / dp;
+    double b = (double)(hi - p0) / dp;
 
-      const int yy = ((temp->ch) / 2) + y;
-      if(yy < temp->ct || yy > temp->cb)
-        continue;
+    if(a > b)
+      std::swap(a, b);
 
-      for(int x = bx1; x <= bx2; x++)
+    int xa = std::max((double)*x1, std::min(std::ceil(a) - 1, (double)*x2 + 1));
+    int xb = std::min((double)*x2, std::max(std::floor(b) + 1, (double)*x1 - 1));
+
+    while(xa <= xb && (p0 + xa * dp < lo || p0 + xa * dp >= hi))
+      xa++;
+    while(xb >= xa && (p0 + xb * dp < lo || p0 + xb * dp >= hi))
+      xb--;
+
+    *x1 = xa;
+    *x2 = xb;
+  }
+
+  void rotateBands(int first, int last, int, void *data)
+  {
+    const rotate_type *job = (rotate_type *)data;
+    Bitmap *dest = job->dest;
+    const int sw = job->src->cw;
+    const int sh = job->src->ch;
+
+    int (*sample)(const rotate_type *, const int &, const int &) =
+      job->filter == BICUBIC ? sampleBicubic :
+      job->filter == BILINEAR ? sampleBilinear : sampleNearest;
+
+    long long row_u[band_size], row_v[band_size];
+    int span_x1[band_size], span_x2[band_size];
+
+    for(int band = first; band <= last; band++)
+    {
+      const int y1 = band * band_size;
+      const int y2 = std::min(y1 + band_size, dest->ch) - 1;
+
+      // clip each row to the source parallelogram
+      for(int y = y1; y <= y2; y++)
       {
-        int uu = u >> 16;
-        int vv = v >> 16;
+        const int i = y - y1;
 
-        u += du_col;
-        v += dv_col;
+        row_u[i] = (long long)(job->u0 * 65536) + (long long)y * job->du_row;
+        row_v[i] = (long long)(job->v0 * 65536) + (long long)y * job->dv_row;
+        span_x1[i] = 0;
+        span_x2[i] = dest->cw - 1;
 
-        // clip source image
-        if(tile)
+        if(!job->tile)
         {
-          while(uu < bmp->cl)
-            uu += (bmp->cr - bmp->cl) + 1;
-          while(vv < bmp->ct)
-            vv += (bmp->cb - bmp->ct) + 1;
-          while(uu > bmp->cr)
-            uu -= (bmp->cr - bmp->cl) + 1;
-          while(vv > bmp->cb)
-            vv -= (bmp->cb - bmp->ct) + 1;
+          clipSpan(row_u[i], job->du_col, -32768,
+                   ((long long)sw << 16) - 32768, &span_x1[i], &span_x2[i]);
+          clipSpan(row_v[i], job->dv_col, -32768,
+                   ((long long)sh << 16) - 32768, &span_x1[i], &span_x2[i]);
         }
-        else
+      }
+
+      // then walk the band a tile at a time
+      for(int tx = 0; tx < dest->cw; tx += tile_size)
+      {
+        for(int y = y1; y <= y2; y++)
         {
-          if(uu < bmp->cl || uu > bmp->cr || vv < bmp->ct || vv > bmp->cb)
+          const int i = y - y1;
+          const int x1 = std::max(span_x1[i], tx);
+          const int x2 = std::min(span_x2[i], tx + tile_size - 1);
+
+          if(x1 > x2)
             continue;
+
+          long long u = row_u[i] + (long long)x1 * job->du_col;
+          long long v = row_v[i] + (long long)x1 * job->dv_col;
+          int *d = dest->row[dest->ct + y] + dest->cl;
+
+          for(int x = x1; x <= x2; x++)
+          {
+            // keep tiled positions near the source to avoid overflow
+            if(job->tile)
+            {
+              u = wrap(u >> 16, sw) * 65536LL + (u & 65535);
+              v = wrap(v >> 16, sh) * 65536LL + (v & 65535);
+            }
+
+            d[x] = sample(job, (int)u, (int)v);
+            u += job->du_col;
+            v += job->dv_col;
+          }
         }
+      }
+    }
+  }
 
-        const int xx = ((temp->cw) / 2) + x;
-        if(xx < temp->cl || xx > temp->cr)
-          continue;
+  void apply(float angle, float scale, int overscroll, bool tile, int filter)
+  {
+    Bitmap *bmp = Project::bmp;
+    const double rad = angle * M_PI / 180;
+    const double c = std::cos(rad);
+    const double s = std::sin(rad);
+    const int sw = bmp->cw;
+    const int sh = bmp->ch;
 
-        int c = *(bmp->row[vv] + uu);
-        *(temp->row[yy] + xx) = c;
-      }
+    // bounding box of the rotated image, with a small margin
+    const int bw = (int)std::ceil((std::fabs(sw * c) + std::fabs(sh * s))
+                                  * scale + scale * 4);
+    const int bh = (int)std::ceil((std::fabs(sw * s) + std::fabs(sh * c))
+                                  * scale + scale * 4);
+
+    // create image with new size
+    Bitmap *temp = new Bitmap(bw, bh, overscroll);
+    temp->rectfill(temp->cl, temp->ct, temp->cr, temp->cb,
+                   makeRgba(0, 0, 0, 0), 0);
+
+    // inverse mapping, centers line up
+    rotate_type job;
 
-      Gui::updateProgress(y - by1);
+    job.src = bmp;
+    job.dest = temp;
+    job.du_col = (int)(c / scale * 65536);
+    job.dv_col = (int)(-s / scale * 65536);
+    job.du_row = (int)(s / scale * 65536);
+    job.dv_row = (int)(c / scale * 65536);
+    job.u0 = sw / 2.0 - 0.5 + (c * (0.5 - bw / 2.0) + s * (0.5 - bh / 2.0))
+                                / scale;
+    job.v0 = sh / 2.0 - 0.5 + (-s * (0.5 - bw / 2.0) + c * (0.5 - bh / 2.0))
+                                / scale;
+    job.filter = filter;
+    job.tile = tile;
+
+    const int bands = (bh + band_size - 1) / band_size;
+    const int batch = Threads::count() * 4;
+
+    Gui::showProgress(bh);
+
+    for(int band = 0; band < bands; band += batch)
+    {
+      const int last = std::min(band + batch, bands) - 1;
+
+      Threads::run(rotateBands, band, last, &job, 1);
+
+      // report every row, the bar only moves on multiples of 50
+      const int y2 = std::min((last + 1) * band_size, bh) - 1;
+
+      for(int y = band * band_size; y <= y2; y++)
+      {
+        if(Gui::updateProgress(y) < 0)
+        {
+          delete temp;
+          return;
+        }
+      }
     }
 
     Gui::hideProgress();
@@ -554,7 +655,7 @@ namespace RotateArbitrary
     Gui::getView()->ox = 0;
     Gui::getView()->oy = 0;
     Gui::getView()->drawMain(true);
-}
+  }
 
   void begin()
   {
@@ -567,7 +668,7 @@ namespace RotateArbitrary
     pushUndo();
 
     apply(atof(Items::angle->value()), atof(Items::scale->value()),
-          Project::overscroll, Items::tile->value());
+          Project::overscroll, Items::tile->value(), Items::filter->value());
   }
 
   void quit()
@@ -588,6 +689,14 @@ namespace RotateArbitrary
     Items::scale->center();
     y1 += 24 + 8;
     Items::scale->value("1.0");
+    Items::filter = new Fl_Choice(96, y1, 128, 24, "Filter:");
+    Items::filter->tooltip("Filter");
+    Items::filter->textsize(10);
+    Items::filter->add("Nearest");
+    Items::filter->add("Bilinear");
+    Items::filter->add("Bicubic");
+    Items::filter->value(BILINEAR);
+    y1 += 24 + 8;
     Items::tile = new CheckBox(Items::dialog, 0, y1, 16, 16, "Tile", 0);
     y1 += 16 + 8;
     Items::tile->center();
@@ -18,38 +18,145 @@ along with Rendera; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
 */
 
+#include <algorithm>
 #include <vector>
 
 #include "Bitmap.H"
 #include "Clone.H"
 #include "Gui.H"
+#include "Inline.H"
 #include "Map.H"
+#include "Palette.H"
 #include "Project.H"
+#include "Stats.H"
 #include "Tool.H"
 #include "Undo.H"
 #include "View.H"
 
 namespace
 {
+  // a saved image, an indexed image keeps only its palette indices
+  // (and alpha, unless it is opaque), a quarter of the memory or less
+  struct state_type
+  {
+    Bitmap *bmp;
+    Map *indices;
+    Map *alpha;
+    int w, h;
+  };
+
   const int levels = 10;
-  std::vector<Bitmap *> undo_stack(levels); 
-  std::vector<Bitmap *> redo_stack(levels); 
+  std::vector<state_type> undo_stack(levels); 
+  std::vector<state_type> redo_stack(levels); 
   int undo_current = levels - 1;
   int redo_current = levels - 1;
+
+  void clear(state_type *state)
+  {
+    delete state->bmp;
+    delete state->indices;
+    delete state->alpha;
+
+    state->bmp = 0;
+    state->indices = 0;
+    state->alpha = 0;
+    state->w = 0;
+    state->h = 0;
+  }
+
+  Map *copyMap(const Map *src)
+  {
+    Map *dest = new Map(src->w, src->h);
+
+    std::copy(src->data, src->data + src->w * src->h, dest->data);
+
+    return dest;
+  }
+
+  void save(state_type *state)
+  {
+    Bitmap *bmp = Project::bmp;
+
+    clear(state);
+    state->w = bmp->w;
+    state->h = bmp->h;
+
+    if(!Project::indices)
+    {
+      state->bmp = new Bitmap(bmp->w, bmp->h);
+      bmp->blit(state->bmp, 0, 0, 0, 0, bmp->w, bmp->h);
+      return;
+    }
+
+    Project::updateIndices();
+    state->indices = copyMap(Project::indices);
+
+    for(int y = bmp->ct; y <= bmp->cb; y++)
+    {
+      for(int x = bmp->cl; x <= bmp->cr; x++)
+      {
+        const int a = geta(bmp->row[y][x]);
+
+        if(a < 255 && !state->alpha)
+        {
+          state->alpha = new Map(bmp->w, bmp->h);
+          state->alpha->clear(255);
+        }
+
+        if(state->alpha)
+          state->alpha->row[y][x] = a;
+      }
+    }
+  }
+
+  // puts a saved image back into Project::bmp, which must be its size
+  void restore(const state_type *state)
+  {
+    Bitmap *bmp = Project::bmp;
+
+    Stats::invalidate();
+
+    if(state->bmp)
+    {
+      state->bmp->blit(bmp, 0, 0, 0, 0, state->w, state->h);
+      Project::indices_stale = true;
+      return;
+    }
+
+    // the colors are set from the indices, keeping this alpha
+    for(int y = bmp->ct; y <= bmp->cb; y++)
+    {
+      for(int x = bmp->cl; x <= bmp->cr; x++)
+      {
+        bmp->row[y][x] = makeRgba(0, 0, 0,
+                                  state->alpha ? state->alpha->row[y][x]
+                                               : 255);
+      }
+    }
+
+    Map *indices = copyMap(state->indices);
+
+    Project::palette->fromIndexed(indices, bmp);
+
+    if(Project::indices)
+    {
+      delete Project::indices;
+      Project::indices = indices;
+      Project::indices_stale = false;
+    }
+    else
+    {
+      delete indices;
+    }
+  }
 }
 
 void Undo::init()
 {
   for(int i = 0; i < levels; i++)
   {
-    if(undo_stack[i])
-      delete undo_stack[i];
-
-    if(redo_stack[i])
-      delete redo_stack[i];
-
-    undo_stack[i] = new Bitmap(8, 8);
-    redo_stack[i] = new Bitmap(8, 8);
+    clear(&undo_stack[i]);
+    clear(&redo_stack[i]);
   }
 
   undo_current = levels - 1;
@@ -62,29 +169,33 @@ void Undo::doPush()
   {
     undo_current = 0;
 
-    Bitmap *temp_bmp = undo_stack[levels - 1];
+    state_type temp = undo_stack[levels - 1];
 
     for(int i = levels - 1; i > 0; i--)
       undo_stack[i] = undo_stack[i - 1];
 
-    undo_stack[0] = temp_bmp;
+    undo_stack[0] = temp;
   }
 
-  delete undo_stack[undo_current];
-  undo_stack[undo_current] = new Bitmap(Project::bmp->w, Project::bmp->h);
-
-  Project::bmp->blit(undo_stack[undo_current], 0, 0, 0, 0,
-                     Project::bmp->w, Project::bmp->h);
-
+  save(&undo_stack[undo_current]);
   undo_current--;
 }
 
 void Undo::push()
 {
+  // an indexed image keeps only palette colors
+  Project::updateIndices();
+  Project::checkWide();
+
   doPush();
 
   // reset redo list since user performed some action
   redo_current = levels - 1;
+
+  // the image is about to change
+  Stats::invalidate();
+  Project::indices_stale = true;
+  Project::wide_stale = true;
 }
 
 void Undo::pop()
@@ -95,8 +206,8 @@ void Undo::pop()
   pushRedo();
   undo_current++;
 
-  int w = undo_stack[undo_current]->w;
-  int h = undo_stack[undo_current]->h;
+  int w = undo_stack[undo_current].w;
+  int h = undo_stack[undo_current].h;
 
   Project::newImage(w - Project::overscroll * 2, h - Project::overscroll * 2);
 
@@ -115,32 +226,37 @@ void Undo::pop()
   Gui::getView()->ox = ox;
   Gui::getView()->oy = oy;
 
-  undo_stack[undo_current]->blit(Project::bmp, 0, 0, 0, 0, w, h);
+  restore(&undo_stack[undo_current]);
 
   Gui::getView()->ignore_tool = true;
   Gui::getView()->drawMain(true);
 }
 
+// restores the last state pushed without keeping it for redo
+void Undo::cancel()
+{
+  if(undo_current >= levels - 1)
+    return;
+
+  undo_current++;
+  restore(&undo_stack[undo_current]);
+}
+
 void Undo::pushRedo()
 {
   if(redo_current < 0)
   {
     redo_current = 0;
 
-    Bitmap *temp_bmp = redo_stack[levels - 1];
+    state_type temp = redo_stack[levels - 1];
 
     for(int i = levels - 1; i > 0; i--)
       redo_stack[i] = redo_stack[i - 1];
 
-    redo_stack[0] = temp_bmp;
+    redo_stack[0] = temp;
   }
 
-  delete redo_stack[redo_current];
-  redo_stack[redo_current] = new Bitmap(Project::bmp->w, Project::bmp->h);
-
-  Project::bmp->blit(redo_stack[redo_current], 0, 0, 0, 0,
-                     Project::bmp->w, Project::bmp->h);
-
+  save(&redo_stack[redo_current]);
   redo_current--;
 }
 
@@ -152,8 +268,8 @@ void Undo::popRedo()
   doPush();
   redo_current++;
 
-  int w = redo_stack[redo_current]->w;
-  int h = redo_stack[redo_current]->h;
+  int w = redo_stack[redo_current].w;
+  int h = redo_stack[redo_current].h;
 
   Project::newImage(w - Project::overscroll * 2, h - Project::overscroll * 2);
 
@@ -172,7 +288,7 @@ void Undo::popRedo()
   Gui::getView()->ox = ox;
   Gui::getView()->oy = oy;
 
-  redo_stack[redo_current]->blit(Project::bmp, 0, 0, 0, 0, w, h);
+  restore(&redo_stack[redo_current]);
 
   Gui::getView()->ignore_tool = true;
   Gui::getView()->drawMain(true);
@@ -182,11 +298,8 @@ void Undo::free()
 {
   for(int i = 0; i < levels; i++)
   {
-    if(undo_stack[i])
-      delete undo_stack[i];
-
-    if(redo_stack[i])
-      delete redo_stack[i];
+    clear(&undo_stack[i]);
+    clear(&redo_stack[i]);
   }
 }
 
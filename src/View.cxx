@@ -509,8 +509,19 @@ void View::drawMain(bool refresh)
 
   backbuf->clear(getFltkColor(FL_BACKGROUND2_COLOR));
 
+  // indexed images are drawn from their indices through the palette
+  // (indices past the end of the palette show the last color)
+  Project::updateIndices();
+
+  Palette *pal = Project::palette.get();
+  int lut[256];
+
+  for(int i = 0; i < 256; i++)
+    lut[i] = pal->data[std::min(i, pal->max - 1)] & 0xFFFFFF;
+
   Project::bmp->pointStretch(backbuf, ox, oy, sw, sh,
-                             0, 0, dw, dh, overx, overy, bgr_order);
+                             0, 0, dw, dh, overx, overy, bgr_order,
+                             Project::indices, lut);
 
   if(grid)
     drawGrid();